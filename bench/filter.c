@@ -0,0 +1,108 @@
+// type-to-filter costs on a headless surface: adding the options, every keystroke of a query, the idle steps finishing it and Backspace
+//
+//   gcc -O2 bench/filter.c menu.c -I. -o filter_bench -pthread
+//   ./filter_bench [options] [query] [--fuzzy]
+//
+// prints one key=value line per keystroke and a summary line
+#include "menu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_OPTIONS 1000000
+#define MAX_IDLE_STEPS 1000000
+
+static const char* words[] = {"alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel", "india", "juliet", "kilo", "lima"};
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// the footer shows "(N+)" while the count is not final yet
+static int count_pending(MENU_SURFACE surface, int height)
+{
+    for (int y = 0; y < height; y++)
+        if (strstr(surface_get_row(surface, y), "+)")) return 1;
+    return 0;
+}
+
+static double press(MENU menu, MENU_SURFACE surface, WORD key, char c)
+{
+    surface_push_key(surface, key, c);
+    double start = now_ms();
+    menu_poll(menu, 0);
+    return now_ms() - start;
+}
+
+int main(int argc, char** argv)
+{
+    size_t options = DEFAULT_OPTIONS;
+    const char* query = NULL;
+    int fuzzy = 0, width = 80, height = 24;
+    char label[64];
+
+    for (int i = 1, positional = 0; i < argc; i++)
+        {
+            if (!strcmp(argv[i], "--fuzzy")) fuzzy = 1;
+            else if (positional++ == 0) options = strtoul(argv[i], NULL, 10);
+            else query = argv[i];
+        }
+    if (options < 1) options = 1;
+    if (!query) query = fuzzy ? "delcho12" : "delta echo 012";
+
+    MENU menu = create_menu_with_capacity(options);
+    if (fuzzy) toggle_fuzzy_filter(menu);
+    MENU_ITEM* items = malloc(options * sizeof(MENU_ITEM));
+    if (!items) return 2;
+    srand(1);
+    for (size_t i = 0; i < options; i++)
+        {
+            snprintf(label, sizeof(label), fuzzy ? "src/%s/%s_%06lu.c" : "%s %s %06lu", words[rand() % 12], words[rand() % 12], (unsigned long)i);
+            items[i] = create_menu_item_in(menu, label, NULL, NULL);
+        }
+
+    // the filter index grows with the options, its cost shows up here
+    double start = now_ms();
+    add_options(menu, items, options);
+    double add_ms = now_ms() - start;
+    free(items);
+
+    MENU_SURFACE surface = create_headless_surface(width, height);
+    set_menu_surface(menu, surface);
+    menu_poll(menu, 0);
+
+    double worst_key = 0, worst_step = 0;
+    for (const char* c = query; *c; c++)
+        {
+            WORD key = (*c >= 'a' && *c <= 'z') ? (WORD)(*c - 'a' + 'A') : (WORD)(unsigned char)*c;
+            double key_ms = press(menu, surface, key, *c), idle_ms = 0;
+            int steps = 0;
+
+            // a keystroke only matches what the screen shows, the idle steps find the rest
+            while (count_pending(surface, height) && steps < MAX_IDLE_STEPS)
+                {
+                    start = now_ms();
+                    menu_poll(menu, 0);
+                    double step_ms = now_ms() - start;
+                    idle_ms += step_ms;
+                    if (step_ms > worst_step) worst_step = step_ms;
+                    steps++;
+                }
+            if (key_ms > worst_key) worst_key = key_ms;
+            printf("bench=filter mode=%s options=%lu key=%c key_ms=%.3f idle_steps=%d idle_ms=%.2f\n",
+                   fuzzy ? "fuzzy" : "substring", (unsigned long)options, *c, key_ms, steps, idle_ms);
+        }
+    double back_ms = press(menu, surface, VK_BACK, '\b');
+
+    printf("bench=filter mode=%s options=%lu query=\"%s\" add_options_ms=%.1f worst_key_ms=%.3f worst_idle_step_ms=%.3f backspace_ms=%.3f\n",
+           fuzzy ? "fuzzy" : "substring", (unsigned long)options, query, add_ms, worst_key, worst_step, back_ms);
+
+    clear_menus();
+    destroy_surface(surface);
+    return 0;
+}
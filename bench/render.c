@@ -0,0 +1,237 @@
+// frame costs on a headless surface: full, dirty, resize and selection-change redraws
+//
+//   gcc -O2 bench/render.c menu.c -I. -o render_bench -pthread -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+//   ./render_bench [--quick] [frames]
+//
+// prints one key=value line per case, allocations are counted through the linker wraps (GNU ld)
+#include "menu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_FRAMES 200
+#define WARMUP_FRAMES 4
+
+/* ----- Allocation Counter ----- */
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t amount, size_t size);
+void* __real_realloc(void* block, size_t size);
+
+static size_t allocations;
+
+void* __wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t amount, size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_calloc(amount, size);
+}
+
+void* __wrap_realloc(void* block, size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_realloc(block, size);
+}
+
+/* ----- Cases ----- */
+enum { FULL_REDRAW, DIRTY_REDRAW, RESIZE_REDRAW, SELECTION_REDRAW, REDRAW_KINDS };
+static const char* redraw_names[REDRAW_KINDS] = {"full", "dirty", "resize", "selection"};
+
+struct bench_case
+{
+    int options;
+    int label_columns;
+    int utf8; // every other label mixes in accented latin and CJK
+    int width, height;
+};
+
+// one frame per step, whatever triggered it
+struct bench_state
+{
+    MENU menu;
+    MENU_SURFACE surfaces[2];
+    MENU_ITEM dirty_item;
+    char* dirty_labels[2];
+    struct bench_case config;
+    int flip;
+};
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// fills a label up to the wanted terminal width, 'é' is one column and '日' two
+static void make_label(char* label, int index, int columns, int utf8)
+{
+    int length = snprintf(label, 32, "Option %d ", index), width = length;
+    while (width < columns)
+        {
+            if (utf8 && (width % 5) == 0 && width + 2 <= columns)
+                {
+                    memcpy(label + length, "\xe6\x97\xa5", 3);
+                    length += 3;
+                    width += 2;
+                }
+            else if (utf8 && (width % 3) == 0)
+                {
+                    memcpy(label + length, "\xc3\xa9", 2);
+                    length += 2;
+                    width++;
+                }
+            else
+                {
+                    label[length++] = 'a' + (width % 26);
+                    width++;
+                }
+        }
+    label[length] = '\0';
+}
+
+// the next frame of one kind, the trigger alternates so every frame has something to draw
+static void trigger(struct bench_state* state, int kind)
+{
+    state->flip ^= 1;
+    switch (kind)
+        {
+            case FULL_REDRAW:
+                // a screen nobody knows the content of, everything is repainted
+                set_menu_surface(state->menu, state->surfaces[state->flip]);
+                break;
+            case DIRTY_REDRAW:
+                update_option_text(state->menu, state->dirty_item, state->dirty_labels[state->flip]);
+                break;
+            case RESIZE_REDRAW:
+                surface_push_resize(state->surfaces[0], state->config.width - state->flip * 8, state->config.height - state->flip * 4);
+                break;
+            case SELECTION_REDRAW:
+                surface_push_key(state->surfaces[0], state->flip ? VK_UP : VK_DOWN, 0);
+                break;
+        }
+}
+
+static void run_kind(struct bench_state* state, int kind, int frames)
+{
+    MENU_FRAME_STATS before, after;
+
+    for (int i = 0; i < WARMUP_FRAMES; i++)
+        {
+            trigger(state, kind);
+            menu_poll(state->menu, 0);
+        }
+
+    before = get_frame_stats(state->menu);
+    size_t allocated = 0;
+    double elapsed = 0;
+    for (int i = 0; i < frames; i++)
+        {
+            trigger(state, kind); // not measured, it only queues the change
+            size_t allocations_before = allocations;
+            double start = now_ns();
+            menu_poll(state->menu, 0);
+            elapsed += now_ns() - start;
+            allocated += allocations - allocations_before;
+        }
+    after = get_frame_stats(state->menu);
+
+    size_t flushed = after.frames - before.frames;
+    double per = flushed ? (double)flushed : 1;
+    printf("bench=render redraw=%s options=%d label_cols=%d charset=%s term=%dx%d frames=%zu "
+           "ns_per_frame=%.0f bytes_per_frame=%.1f syscalls_per_frame=%.2f allocs_per_frame=%.2f\n",
+           redraw_names[kind], state->config.options, state->config.label_columns,
+           state->config.utf8 ? "utf8" : "ascii", state->config.width, state->config.height, flushed,
+           elapsed / per, (after.total_bytes - before.total_bytes) / per,
+           (after.total_writes - before.total_writes) / per, allocated / per);
+    fflush(stdout);
+
+    // back where the next kind expects the menu
+    if (state->flip)
+        {
+            trigger(state, kind);
+            menu_poll(state->menu, 0);
+        }
+}
+
+static void run_case(struct bench_case config, int frames)
+{
+    struct bench_state state;
+    char label[256];
+
+    memset(&state, 0, sizeof(state));
+    state.config = config;
+    state.surfaces[0] = create_headless_surface(config.width, config.height);
+    state.surfaces[1] = create_headless_surface(config.width, config.height);
+
+    state.menu = create_menu_with_capacity((size_t)config.options);
+
+    // the first row is relabeled in place, always on screen
+    make_label(label, 0, config.label_columns, config.utf8);
+    state.dirty_labels[0] = strdup(label);
+    label[0] = 'o';
+    state.dirty_labels[1] = strdup(label);
+    state.dirty_item = create_menu_item(state.dirty_labels[0], NULL, NULL);
+    add_option(state.menu, state.dirty_item);
+
+    for (int i = 1; i < config.options; i++)
+        {
+            make_label(label, i, config.label_columns, config.utf8 && (i & 1));
+            add_option(state.menu, create_menu_item(label, NULL, NULL));
+        }
+    set_menu_surface(state.menu, state.surfaces[0]);
+
+    menu_poll(state.menu, 0);
+    surface_push_key(state.surfaces[0], VK_DOWN, 0); // a selection to move away from and back to
+    menu_poll(state.menu, 0);
+
+    for (int kind = 0; kind < REDRAW_KINDS; kind++)
+        run_kind(&state, kind, frames);
+
+    disable_menu(state.menu);
+    menu_poll(state.menu, 0);
+    clear_menu(state.menu);
+    destroy_surface(state.surfaces[0]);
+    destroy_surface(state.surfaces[1]);
+    free(state.dirty_labels[0]);
+    free(state.dirty_labels[1]);
+}
+
+int main(int argc, char** argv)
+{
+    static const int option_counts[] = {10, 1000, 100000, 1000000};
+    static const int label_columns[] = {12, 48};
+    static const COORD terminal_sizes[] = {{80, 24}, {200, 60}};
+    int frames = DEFAULT_FRAMES, quick = 0;
+
+    for (int i = 1; i < argc; i++)
+        {
+            if (!strcmp(argv[i], "--quick")) quick = 1;
+            else frames = atoi(argv[i]);
+        }
+    if (frames < 1) frames = 1;
+
+    // every relabel is painted right away, pacing would only measure the frame rate cap
+    MENU_SETTINGS settings = create_new_settings();
+    settings.max_frame_rate = 0;
+    set_default_menu_settings(settings);
+
+    for (size_t o = 0; o < sizeof(option_counts) / sizeof(option_counts[0]); o++)
+        {
+            if (quick && option_counts[o] > 1000) break;
+            for (size_t l = 0; l < sizeof(label_columns) / sizeof(label_columns[0]); l++)
+                for (int utf8 = 0; utf8 <= 1; utf8++)
+                    for (size_t t = 0; t < sizeof(terminal_sizes) / sizeof(terminal_sizes[0]); t++)
+                        {
+                            struct bench_case config = {option_counts[o], label_columns[l], utf8, terminal_sizes[t].X, terminal_sizes[t].Y};
+                            run_case(config, frames);
+                        }
+        }
+    return 0;
+}
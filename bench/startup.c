@@ -0,0 +1,97 @@
+// time to first frame: from create_menu() to the first frame flushed to the screen
+//
+//   gcc -O2 bench/startup.c menu.c -I. -o startup_bench -pthread
+//   ./startup_bench [options] [budget_us] [--headless]
+//
+// prints one key=value line, exits with 1 when the cold start is over the budget
+#include "menu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define WARM_RUNS 50
+
+static double now_us()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (!frequency.QuadPart) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1e6 / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+#endif
+}
+
+// one menu from nothing to its first frame, then closed again
+static double first_frame_us(int options, MENU_SURFACE surface, size_t* frames)
+{
+    char label[32];
+    double start = now_us();
+
+    MENU menu = create_menu_with_capacity((size_t)options);
+    for (int i = 0; i < options; i++)
+        {
+            snprintf(label, sizeof(label), "Option %d", i);
+            add_option(menu, create_menu_item(label, NULL, NULL));
+        }
+    if (surface) set_menu_surface(menu, surface);
+    menu_poll(menu, 0); // shows the menu, the first frame is flushed before it returns
+
+    double elapsed = now_us() - start;
+    *frames = get_frame_stats(menu).frames;
+
+    disable_menu(menu);
+    menu_poll(menu, 0);
+    clear_menu(menu);
+    return elapsed;
+}
+
+int main(int argc, char** argv)
+{
+    int options = 20;
+    double budget = 0;
+    MENU_SURFACE surface = NULL;
+    size_t frames;
+
+    for (int i = 1, positional = 0; i < argc; i++)
+        {
+            if (!strcmp(argv[i], "--headless")) surface = create_headless_surface(120, 40);
+            else if (positional++ == 0) options = atoi(argv[i]);
+            else budget = atof(argv[i]);
+        }
+    if (options < 1) options = 1;
+
+    // the first menu of the process pays for the console setup, that is the number a CLI launch sees
+    double cold = first_frame_us(options, surface, &frames);
+    if (frames != 1)
+        {
+            fprintf(stderr, "no frame was flushed\n");
+            return 2;
+        }
+
+    double warm_min = 0, warm_total = 0;
+    for (int run = 0; run < WARM_RUNS; run++)
+        {
+            double elapsed = first_frame_us(options, surface, &frames);
+            warm_total += elapsed;
+            if (!run || elapsed < warm_min) warm_min = elapsed;
+        }
+
+    printf("bench=startup surface=%s options=%d cold_us=%.1f warm_avg_us=%.1f warm_min_us=%.1f budget_us=%.1f\n",
+           surface ? "headless" : "console", options, cold, warm_total / WARM_RUNS, warm_min, budget);
+
+    clear_menus();
+    if (surface) destroy_surface(surface);
+    return (budget > 0 && cold > budget) ? 1 : 0;
+}
@@ -4,34 +4,167 @@
  * No warranty is given.
  */
 
+// clock_gettime, sigaction and strdup are posix, not c99; the header pulls in the first system includes
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "menu.h"
 
 /* ============== DEFINES AND MACROS ============== */
 // #define DEBUG
 
-#ifdef DEBUG
+#if defined(DEBUG) && defined(_WIN32)
 #include <psapi.h>
 #endif
 
+// vector path of the text width kernel, plain scalar code when neither is available
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MENU_SIMD_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MENU_SIMD_SSE2
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// atomics of the cross-thread command queues
+#if defined(_MSC_VER) && !defined(__clang__)
+#define MENU_ATOMIC_XCHG_PTR(target, value) InterlockedExchangePointer((PVOID volatile*)(target), (value))
+#define MENU_ATOMIC_LOAD_PTR(source) InterlockedCompareExchangePointer((PVOID volatile*)(source), NULL, NULL)
+#define MENU_ATOMIC_STORE_PTR(target, value) InterlockedExchangePointer((PVOID volatile*)(target), (value))
+#define MENU_ATOMIC_XCHG_INT(target, value) InterlockedExchange((LONG volatile*)(target), (value))
+#define MENU_ATOMIC_LOAD_INT(source) InterlockedCompareExchange((LONG volatile*)(source), 0, 0)
+#define MENU_ATOMIC_ADD_INT(target, value) InterlockedExchangeAdd((LONG volatile*)(target), (value))
+#define MENU_ATOMIC_NEXT_SERIAL(target) ((unsigned long long)InterlockedIncrement64((LONG64 volatile*)(target)))
+#else
+#define MENU_ATOMIC_XCHG_PTR(target, value) __atomic_exchange_n((target), (value), __ATOMIC_ACQ_REL)
+#define MENU_ATOMIC_LOAD_PTR(source) __atomic_load_n((source), __ATOMIC_ACQUIRE)
+#define MENU_ATOMIC_STORE_PTR(target, value) __atomic_store_n((target), (value), __ATOMIC_RELEASE)
+#define MENU_ATOMIC_XCHG_INT(target, value) __atomic_exchange_n((target), (value), __ATOMIC_ACQ_REL)
+#define MENU_ATOMIC_LOAD_INT(source) __atomic_load_n((source), __ATOMIC_ACQUIRE)
+#define MENU_ATOMIC_ADD_INT(target, value) __atomic_fetch_add((target), (value), __ATOMIC_ACQ_REL)
+#define MENU_ATOMIC_NEXT_SERIAL(target) __atomic_add_fetch((target), 1, __ATOMIC_RELAXED)
+#endif
+
+#ifndef _WIN32
+#include <termios.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+#endif
+
+// worker pool primitives
+#ifdef _WIN32
+typedef CRITICAL_SECTION MENU_MUTEX;
+typedef CONDITION_VARIABLE MENU_CONDITION;
+#define MENU_MUTEX_INIT(mutex) InitializeCriticalSection(mutex)
+#define MENU_MUTEX_LOCK(mutex) EnterCriticalSection(mutex)
+#define MENU_MUTEX_UNLOCK(mutex) LeaveCriticalSection(mutex)
+#define MENU_CONDITION_INIT(condition) InitializeConditionVariable(condition)
+#define MENU_CONDITION_WAIT(condition, mutex) SleepConditionVariableCS(condition, mutex, INFINITE)
+#define MENU_CONDITION_SIGNAL(condition) WakeConditionVariable(condition)
+#define MENU_THREAD_RESULT DWORD WINAPI
+#else
+typedef pthread_mutex_t MENU_MUTEX;
+typedef pthread_cond_t MENU_CONDITION;
+#define MENU_MUTEX_INIT(mutex) pthread_mutex_init(mutex, NULL)
+#define MENU_MUTEX_LOCK(mutex) pthread_mutex_lock(mutex)
+#define MENU_MUTEX_UNLOCK(mutex) pthread_mutex_unlock(mutex)
+#define MENU_CONDITION_INIT(condition) pthread_cond_init(condition, NULL)
+#define MENU_CONDITION_WAIT(condition, mutex) pthread_cond_wait(condition, mutex)
+#define MENU_CONDITION_SIGNAL(condition) pthread_cond_signal(condition)
+#define MENU_THREAD_RESULT void*
+#endif
+#ifdef _MSC_VER
+#define MENU_THREAD_LOCAL __declspec(thread)
+#else
+#define MENU_THREAD_LOCAL __thread
+#endif
+
 #define DISABLED -1
 #define BUFFER_CAPACITY 256
 #define UPDATE_FREQUENCE 2147483647 // ms
 #define ERROR_UPDATE_FREQUENCE 20 // ms
 #define EVENT_MAX_RECORDS 4
+#define INPUT_RING_CAPACITY 256 // records read ahead of the render loop, a power of two
+#define INPUT_READ_CHUNK 32 // records per read while filling the ring
 #define CAPACITY_MIN 6
 #define CAPACITY_STEP 4
+#define MENU_SLOTS_MIN 8 // slot table size on the first create_menu, doubled whenever it runs full
+#define NO_FREE_SLOT 0xFFFFFFFFu
+#define RENDER_POOL_MAX 4 // idle screen and frame buffers kept for the next menu that is shown
+#define WIDTH_HISTOGRAM_MIN 64
+#define ARENA_CHUNK_SIZE 16384
+#define ARENA_ALIGNMENT sizeof(void*)
+#define INTERN_TABLE_MIN 64 // slots, always a power of two
+
+// label ownership of a menu item
+#define LABEL_OWNED 0 // strdup'ed, freed with the item
+#define LABEL_BORROWED 1 // caller's memory, has to outlive the item
+#define LABEL_INTERNED 2 // shared copy in the intern table
+
+// commands posted to a menu from other threads
+#define COMMAND_ADD_OPTION 0
+#define COMMAND_CLEAR_OPTION 1
+#define COMMAND_OPTION_TEXT 2
+#define COMMAND_TASK 3
+#define POSIX_WAKEUP_BYTE 0 // written to the signal pipe, signal numbers are never 0
+
+// timer wheel, one tick is a millisecond
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4 // 64^4 ms (~4.6 hours), longer timers wait at the top level and get placed again
+#define TIMER_WHEEL_SPAN (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+#define TIMER_NEVER ((unsigned long long)-1)
+
+#define ASYNC_WORKER_COUNT 4 // threads of the async callback pool, started on first use
+#define ASYNC_BUSY_MARKER "*" // drawn left of an option while its async callback runs
 #define OFFSET_VALUE 2
+#define VIEWPORT_MIN_ROWS 3 // option rows a scrolled menu needs before the size error kicks in
+#define WHEEL_SCROLL_STEP 3
+#define GRID_COLUMN_GAP 2 // blank columns between two grid slots
+#define FILTER_QUERY_MAX 64 // typed characters the filter keeps, each one has its own result level
+#define FILTER_POSTINGS_MIN 1024 // trigram slots, always a power of two
+#define FILTER_PARALLEL_MIN 65536 // labels a fuzzy scan needs before it is split between threads
+#define FILTER_THREADS_MAX 16
+#define FILTER_SCAN_FIRST 256 // ids a lazy substring level looks at before it checks whether it found enough, doubled every time
+#define FILTER_SCAN_CHUNK 8192 // up to this many
+#define FILTER_STEP_BUDGET 4096 // ids matched per idle step while a query is still being completed
+#define FILTER_ID_END 0xFFFFFFFFu // next of a complete level
+#define FILTER_UNLIMITED ((size_t)-1) // matches wanted or ids allowed when a scan has to go all the way
+#define FUZZY_RANK_MIN 64 // matches ranked ahead of the viewport, more are ranked once scrolled to
+#define FUZZY_HEAP_MAX 4096 // a front up to this long is picked with a heap, longer ones by quickselect
+
+// fuzzy scores, modeled after fzf
+#define FUZZY_SCORE_MATCH 16
+#define FUZZY_GAP_START 3
+#define FUZZY_GAP_EXTENSION 1
+#define FUZZY_BONUS_BOUNDARY 8 // first character of a word
+#define FUZZY_BONUS_CAMEL 7 // lower to upper case or letter to digit
+#define FUZZY_BONUS_CONSECUTIVE 4
+#define FUZZY_FIRST_MULTIPLIER 2 // the first query character counts double
 
 #define DEFAULT_HEADER_TEXT "MENU"
 #define DEFAULT_FOOTER_TEXT "Use arrows to navigate, Enter to select"
 #define DEFAULT_MENU_TEXT "Unnamed Option"
 
 #define LOG_FILE_NAME "menu_log.txt"
-#define VT100_MENU_STRING_FORMAT "%s%*s%s%*s"RESET_ALL_STYLES
-#define LEGACY_MENU_STRING_FORMAT "%*s%s%*s"
+#define MENU_STRING_FORMAT "%*s%s%*s"
 #define MOVE_CURSOR_FORMAT "\x1b[%d;%dH%s"
 #define HIDE_CURSOR "\x1b[?25l"
 #define SHOW_CURSOR "\x1b[?25h"
+#define ENTER_ALTERNATE_SCREEN "\x1b[?1049h"
+#define LEAVE_ALTERNATE_SCREEN "\x1b[?1049l"
+#define MOUSE_TRACKING_ON "\x1b[?1003h\x1b[?1006h"
+#define MOUSE_TRACKING_OFF "\x1b[?1006l\x1b[?1003l"
 #define RGB_COLOR_SEQUENCE "\x1b[%d;2;%d;%d;%dm"
 #define RGB_COLOR_DOUBLE_SEQUENCE "\x1b[38;2;%hd;%hd;%hdm\x1b[48;2;%hd;%hd;%hdm"
 #define ERROR_MESSAGE1 "\033[31mError: Console window size is too small!\n""Required size: %d x %d\n"
@@ -49,7 +182,348 @@
 #define SELECTABLE_TYPE 0x3
 #define ERROR_TYPE 0x4
 
+// posix input
+#define POSIX_INPUT_CAPACITY 512
+#define POSIX_ESCAPE_TIMEOUT 25 // ms, time to wait for the rest of an escape sequence
+#define POSIX_DEFAULT_WIDTH 80
+#define POSIX_DEFAULT_HEIGHT 24
+
+// headless surface
+#define SURFACE_SEQUENCE_CAPACITY 64
+#define SURFACE_EVENTS_MIN 16
+#define SURFACE_OUTPUT_MIN 4096
+#define INPUT_EXHAUSTED 2 // injected input ran out, the enable_menu() loop should stop
+
+// frame buffer
+#define FRAME_RUN_GAP 4 // unchanged cells a run may swallow instead of paying for a new cursor move
+#define FRAME_CHUNK_CAPACITY 1024
+#define FRAME_OUTPUT_MIN 4096
+
+/* ============== PLATFORM COMPATIBILITY ============== */
+#ifdef _WIN32
+// on windows the console keeps every screen buffer intact while another one is shown
+#define SCREEN_BUFFERS_PERSIST TRUE
+typedef DWORD CONSOLE_INPUT_MODE;
+#else
+// posix has a single alternate screen which is cleared every time it is entered
+#define SCREEN_BUFFERS_PERSIST FALSE
+typedef struct termios CONSOLE_INPUT_MODE;
+
+// minimal subset of the win32 input records, filled by the vt input parser
+#define KEY_EVENT 0x0001
+#define MOUSE_EVENT 0x0002
+#define WINDOW_BUFFER_SIZE_EVENT 0x0004
+
+typedef struct
+{
+    BOOL bKeyDown;
+    WORD wRepeatCount;
+    WORD wVirtualKeyCode;
+    union
+    {
+        char AsciiChar;
+    } uChar;
+    DWORD dwControlKeyState;
+} KEY_EVENT_RECORD;
+
+typedef struct
+{
+    COORD dwMousePosition;
+    DWORD dwButtonState;
+    DWORD dwControlKeyState;
+    DWORD dwEventFlags;
+} MOUSE_EVENT_RECORD;
+
+typedef struct
+{
+    COORD dwSize;
+} WINDOW_BUFFER_SIZE_RECORD;
+
+typedef struct
+{
+    WORD EventType;
+    union
+    {
+        KEY_EVENT_RECORD KeyEvent;
+        MOUSE_EVENT_RECORD MouseEvent;
+        WINDOW_BUFFER_SIZE_RECORD WindowBufferSizeEvent;
+    } Event;
+} INPUT_RECORD;
+
+// a posix "screen buffer" is just an output fd plus the screen it lives on
+struct __posix_screen
+{
+    int fd;
+    int alternate;
+    int cursor_visible;
+};
+#endif
+
 /* CUSTOM TYPES */
+enum SurfaceParserState
+{
+    SURFACE_GROUND,
+    SURFACE_ESCAPE,
+    SURFACE_CSI
+};
+
+typedef struct __surface_cell
+{
+    char glyph[4]; // utf-8, not null terminated when all 4 bytes are used
+    unsigned int style; // 0 = default, otherwise a hash of the active sgr parameters
+} SURFACE_CELL;
+
+// headless surface: a cell grid fed by the same vt bytes a terminal would get
+struct __menu_surface
+{
+    COORD size;
+    COORD cursor;
+    SURFACE_CELL* cells;
+    char* row_text;
+
+    // vt parser state
+    enum SurfaceParserState parser_state;
+    char sequence[SURFACE_SEQUENCE_CAPACITY];
+    size_t sequence_len;
+    char utf8[4];
+    size_t utf8_len;
+    size_t utf8_expected;
+    unsigned int style;
+    int cursor_visible;
+
+    // injected input (ring)
+    INPUT_RECORD* events;
+    size_t events_head;
+    size_t events_count;
+    size_t events_capacity;
+
+    // recording
+    MENU_SURFACE_STATS stats;
+    int recording;
+    char* output;
+    size_t output_len;
+    size_t output_capacity;
+
+    struct __menu_surface* next;
+};
+
+// one screen cell of a menu frame, style is the render unit type that drew it (0 = plain)
+typedef struct __menu_cell
+{
+    char glyph[8]; // room for a base char plus a combining mark or two, length 0 = right half of a wide char
+    unsigned char length;
+    unsigned char style;
+} MENU_CELL;
+
+// back is what the next frame should look like, front is what the screen shows right now
+struct __menu_framebuffer
+{
+    COORD size;
+    MENU_CELL* back;
+    MENU_CELL* front;
+    int front_valid; // FALSE when the screen content is unknown (first frame, resize, callback...)
+    int dirty_top;
+    int dirty_bottom;
+
+    // vt bytes of the frame being flushed, written with one call at the end
+    char* output;
+    size_t output_len;
+    size_t output_capacity;
+    size_t frame_writes;
+
+    // color sequences of the frame being flushed, indexed by cell style
+    const char* style_sequences[ERROR_TYPE];
+    size_t style_lengths[ERROR_TYPE];
+};
+
+// render buffers of the menus that are not shown, the next menu to be shown takes them over
+struct __menu_render_pool
+{
+    HANDLE screens[RENDER_POOL_MAX];
+    struct __menu_framebuffer* framebuffers[RENDER_POOL_MAX];
+    int screen_count;
+    int framebuffer_count;
+};
+
+// bump allocated block of a menu arena, chunks are only ever freed all at once
+struct __menu_arena_chunk
+{
+    struct __menu_arena_chunk* next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+// open addressing set of interned labels, the strings live in arena chunks
+struct __intern_table
+{
+    const char** slots;
+    size_t* hashes;
+    size_t capacity;
+    size_t count;
+    struct __menu_arena_chunk* chunks;
+};
+
+// one posted mutation, owned by the queue until the render loop applies it
+struct __menu_command
+{
+    struct __menu_command* next;
+    int type;
+    MENU_ITEM item;
+    unsigned long long serial; // of item when it was posted, the pointer alone may belong to a newer item by now
+    char* text;
+    __menu_callback task;
+    void* task_data;
+};
+
+// intrusive multi-producer/single-consumer queue (Vyukov), producers only ever swap head
+struct __menu_command_queue
+{
+    struct __menu_command* head; // last pushed, shared by every producer
+    struct __menu_command* tail; // next to pop, touched by the render loop only
+    struct __menu_command stub;
+    int wakeup_pending; // one wakeup per drain, no matter how many commands were posted
+    int producers; // posts in flight, closing waits for them to leave
+    int closed; // the menu was cleared, posts are refused from now on
+};
+
+// open addressing table of the options keyed by their serial, posted commands find their item here
+struct __menu_item_set
+{
+    MENU_ITEM* slots;
+    size_t mask; // capacity - 1, the capacity is a power of two
+    size_t used;
+};
+
+// periodic timer of a menu, lives in one slot list of the menu's wheel
+struct __menu_timer
+{
+    struct __menu_timer* next;
+    struct __menu_timer** link; // whatever points at us, so removal is O(1)
+    unsigned long long expires; // ms on the tick() clock
+    DWORD interval;
+    __menu_callback callback;
+    void* callback_data;
+    int level;
+    int slot;
+};
+
+// hierarchical timer wheel, a slot at level n covers 64^n ms and is cascaded down once its time comes
+struct __menu_timer_wheel
+{
+    unsigned long long now; // ms, everything due up to here has been fired
+    struct __menu_timer* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    unsigned long long occupied[TIMER_WHEEL_LEVELS]; // one bit per non-empty slot
+    size_t count;
+    struct __menu_timer* running; // timer whose callback is on the stack right now
+    int running_removed;
+};
+
+// one async callback run, created by the render loop and handed back to it once the worker is done
+struct __menu_async_job
+{
+    struct __menu_async_job* next;
+    MENU menu;
+    unsigned long long menu_id;
+    MENU_ITEM item; // NULL once the item is gone or the job was abandoned, render loop only
+    __menu_callback callback;
+    void* callback_data;
+    MENU_TIMER timeout;
+    int cancelled; // polled by the callback through menu_callback_cancelled()
+    int done; // handed back by the worker, guarded by the pool lock
+    int prefetch; // populates a submenu, menu is the child
+    struct __menu_submenu* submenu; // prefetch only, NULL once the option is gone and the child is an orphan
+};
+
+// bounded pool of worker threads shared by every menu
+struct __menu_async_pool
+{
+    MENU_MUTEX lock;
+    MENU_CONDITION work_ready;
+    struct __menu_async_job* pending_head;
+    struct __menu_async_job* pending_tail;
+    struct __menu_async_job* finished; // waiting for the render loop
+    MENU_CONDITION job_done; // a submenu opened mid-prefetch waits on this
+    int workers;
+    int prefetching; // submenu prefetches not handed back yet, render loop only
+};
+
+// lazily populated child of an option, kept until invalidate_submenu() or the option goes away
+struct __menu_submenu
+{
+    __menu_callback populate;
+    void* populate_data;
+    unsigned long long child_id; // 0 until the first expansion or prefetch, looked up since it may be cleared behind our back
+    int populated; // child holds what populate built, FALSE again once invalidated
+    struct __menu_async_job* prefetch; // populate running on the pool, the child is not touched meanwhile
+};
+
+// ids of the items whose label contains one trigram
+struct __menu_posting
+{
+    unsigned int key; // three case-folded bytes, 0 marks a free slot
+    unsigned int count;
+    unsigned int capacity;
+    unsigned int* ids; // ascending, may still list items relabeled since
+};
+
+// options matching the first n characters of the query, in option order
+struct __menu_filter_level
+{
+    unsigned int* ids; // what the next level is refined from and, in substring mode, what is shown
+    size_t count;
+    size_t capacity;
+    unsigned int next; // substring levels are filled lazily, every id below next is decided (FILTER_ID_END = all of them)
+
+    // fuzzy levels only, always complete, shown best first but only ranked as far as somebody looked
+    int* scores; // parallel to ids
+    unsigned long long* keys; // see _fuzzy_key, sorted up to ranked
+    unsigned int* shown; // ids in ranked order, valid up to ranked
+    size_t ranked; // 0 = keys have to be made again
+};
+
+// type-to-filter state of a menu, attached while filtering is enabled and kept up to date by add/clear/relabel
+struct __menu_filter
+{
+    struct __menu_posting* postings; // open addressing on the trigram key
+    size_t postings_capacity;
+    size_t postings_used;
+    int postings_kept; // only substring matching reads the trigrams, fuzzy menus dont pay for them
+    int postings_stale; // a relabel left ids behind, a trigram alone no longer proves a match
+
+    // per id, ids grow with the option order since options are only ever appended
+    MENU_ITEM* items; // NULL once the item is gone
+    unsigned int* text_offsets; // folded copy of the label in text followed by the original one, verified and scored without touching the item
+    unsigned int* text_lengths;
+    unsigned long long* masks; // characters the label contains (see _char_bit), 0 for removed items
+    size_t item_count;
+    size_t item_capacity;
+    size_t dead; // ids of removed items, the index is rebuilt once they outnumber the live ones
+
+    char* text;
+    size_t text_used;
+    size_t text_capacity;
+    size_t text_live; // bytes of the current labels, the rest are copies left behind by relabels
+
+    char query[FILTER_QUERY_MAX]; // case-folded
+    size_t length;
+    int fuzzy; // the levels were made by the fuzzy matcher
+    struct __menu_filter_level levels[FILTER_QUERY_MAX]; // levels[n] refines levels[n - 1]
+};
+
+// one slice of a fuzzy scan, slices of large scans run on threads of their own
+struct __menu_fuzzy_scan
+{
+    struct __menu_filter* filter;
+    struct __menu_filter_level* source; // NULL = every id
+    struct __menu_filter_level* result; // matches go to the same positions the slice covers in source
+    unsigned long long mask;
+    size_t length;
+    size_t first;
+    size_t last;
+    size_t count;
+};
+
 enum RenderArgumentTag
 {
     MENU_TYPE,
@@ -78,19 +552,77 @@ typedef int (*MouseEventHandler)(MENU, const MOUSE_EVENT_RECORD*,
                                  int, int, int, int,
                                  int*, int*, int*, int*);
 
+// input read ahead of the render loop, shared by every menu so type-ahead survives callbacks and submenus
+struct __menu_input_ring
+{
+    INPUT_RECORD records[INPUT_RING_CAPACITY];
+    size_t head;
+    size_t count;
+    MENU_INPUT_STATS stats;
+};
+
+// a menu's __ID is (generation << 32 | slot), a released slot bumps its generation so old handles never match again
+struct __menu_slot
+{
+    MENU menu; // NULL while free
+    unsigned int generation;
+    unsigned int next_free;
+};
+
+// render loop state between two steps, lives from the first frame until the menu closes
+struct __menu_session
+{
+    COORD current_size, old_size, menu_size;
+    int y_max, y_min, x_max, x_start;
+    int last_selected_index, cached_selected_index, selected_index;
+    int shown_index; // highlighted by the last frame, un-highlighted by the next dirty redraw
+    int can_tick, selected_by_mouse;
+    int stepping; // a step is on the stack, clear_menu() leaves the teardown to it
+    int blocking; // run by enable_menu(), nobody is left to push input once a headless queue is empty
+    unsigned long long saved_id; // saved menu ID to verify menu validity after callbacks
+    CONSOLE_INPUT_MODE old_mode;
+    RenderUnitDrawer draw_render_unit;
+    MouseEventHandler mouse_event_handler;
+#ifdef DEBUG
+    int mouse_status;
+    size_t tick_count;
+    COORD debug_mouse_pos;
+#endif
+};
+
 /* ============== GLOBAL VARIABLES ============== */
 static COORD zero_point = {0, 0};
-static DWORD written = 0;
 static COORD cached_size = {0, 0};
 static HANDLE hConsole, hConsoleError, hCurrent, _hError, hStdin;
-static CONSOLE_SCREEN_BUFFER_INFO hBack_csbi;
+
+#ifdef _WIN32
+static DWORD written = 0;
+static HANDLE wakeup_event = NULL; // set by posting threads, waited on together with stdin
+#else
+static struct __posix_screen posix_main_screen = {STDOUT_FILENO, FALSE, TRUE};
+static struct __posix_screen posix_error_screen = {STDERR_FILENO, FALSE, TRUE};
+static struct __posix_screen posix_alternate_screen = {STDOUT_FILENO, TRUE, TRUE};
+
+static int posix_alternate_active = FALSE;
+static int posix_signal_pipe[2] = {-1, -1};
+static int posix_tty_input = FALSE;
+static int posix_input_blocked = FALSE;
+static int posix_input_closed = FALSE;
+static CONSOLE_INPUT_MODE posix_startup_mode;
+static CONSOLE_INPUT_MODE posix_raw_mode; // put back when we are continued after a stop
+static volatile sig_atomic_t posix_screen_lost = FALSE; // the shell had the terminal, the next frame repaints it all
+static unsigned char posix_input[POSIX_INPUT_CAPACITY];
+static size_t posix_input_len = 0;
+#endif
 
 static int menu_settings_initialized = FALSE,
            menu_color_initialized = FALSE,
            menu_legacy_color_initialized = FALSE;
 
 // input defines
+#ifdef _WIN32
 static INPUT input = {0};
+#endif
 static int holding = FALSE;
 
 // settings constants
@@ -98,10 +630,22 @@ static MENU_SETTINGS MENU_DEFAULT_SETTINGS;
 static MENU_COLOR MENU_DEFAULT_COLOR;
 static LEGACY_MENU_COLOR MENU_LEGACY_DEFAULT_COLOR;
 
+// headless surfaces, checked before any handle reaches the console api
+static MENU_SURFACE surfaces_list = NULL;
+static struct __intern_table intern_table; // shared by every menu, released with release_interned_labels()
+static struct __menu_async_pool async_pool;
+static struct __menu_input_ring input_ring;
+static struct __menu_render_pool render_pool;
+static MENU_THREAD_LOCAL struct __menu_async_job* async_current_job = NULL; // job of the calling worker thread
+static unsigned long long item_serial = 0; // last one handed out, items may be created on any thread
+
 // menu values
-static MENU* menus_array = NULL;
+static struct __menu_slot* menu_slots = NULL; // never shrinks, released slots are reused first
+static unsigned int menu_slots_capacity = 0;
+static unsigned int menu_free_slot = NO_FREE_SLOT;
 static size_t menus_amount = 0;
-static size_t menus_capacity = 0;
+static MENU oldest_menu = NULL, newest_menu = NULL;
+static MENU shown_top = NULL, shown_bottom = NULL; // started menus, the top one gets the screen when another closes
 
 // other values
 static WORD reset_color_attribute =
@@ -125,7 +669,7 @@ static DrawAtPositionFunc _draw_at_position;
 static ToggleCursorFunc _toggle_cursor;
 
 /* ============== FORWARD DECLARATIONS ============== */
-#ifdef DEBUG
+#if defined(DEBUG) && defined(_WIN32)
 static void _print_memory_info(HANDLE hBuffer);
 #endif
 
@@ -145,7 +689,10 @@ static MENU_SETTINGS _create_default_settings();
 static MENU_COLOR _create_default_color();
 static MENU_RENDER_UNIT _create_render_unit(const char* text, DWORD unit_type, void* extra_data);
 static MENU_RENDER_ARGUMENT _create_render_argument(enum RenderArgumentTag data_tag, void* value);
-inline static unsigned long long _random_uint64_t();
+static int _acquire_menu_slot(MENU menu);
+static void _release_menu_slot(MENU menu);
+static void _push_shown(MENU menu, int on_top);
+static void _unlink_shown(MENU menu);
 static void _init_menu_system();
 inline static void _init_hError();
 inline static HANDLE _createConsoleScreenBuffer();
@@ -157,27 +704,160 @@ static void _ldraw_at_position_legacy(HANDLE hDestination, SHORT x, SHORT y, con
 static void _vwrite_string(HANDLE hDestination, const char* restrict text, va_list args);
 inline static void _lwrite_string(HANDLE hDestination, const char* restrict text);
 
-static size_t _count_utf8_chars(const char* s);
+static size_t _display_width_n(const char* text, size_t bytes);
+inline static size_t _display_width(const char* text);
+static int _codepoint_width(unsigned int code_point);
+static size_t _decode_utf8(const unsigned char* p, unsigned int* code_point);
 static void _clamp_center_coord(MENU_COORD* coord);
 static WORD _check_if_supports_vt100();
 static HANDLE _find_first_active_menu_buffer();
 
 static void _toggle_cursor_vt(HANDLE hBuffer, int flag);
+#ifdef _WIN32
 static void _toggle_cursor_legacy(HANDLE hBuffer, int flag);
+#endif
 static void _setConsoleActiveScreenBuffer(HANDLE hBufferToActivate);
 static void _get_menu_size(MENU menu);
 static int _size_check(MENU menu);
+#ifdef _WIN32
 static void _initWindow(SMALL_RECT* restrict window, COORD size);
+#endif
 static void _clear_buffer(HANDLE hBuffer);
 static void _reset_mouse_state();
 static MENU _find_menu_by_id(unsigned long long saved_id);
-static void _block_input(DWORD* oldMode);
+static MENU _find_menu_anywhere(unsigned long long saved_id);
+static void _block_input(CONSOLE_INPUT_MODE* oldMode);
+static void _restore_input(const CONSOLE_INPUT_MODE* oldMode);
+
+// PLATFORM FUNCTIONS
+static COORD _get_console_size(HANDLE hBuffer);
+static void _resize_screen_buffer(HANDLE hBuffer, COORD size);
+static void _close_screen_buffer(HANDLE hBuffer);
+static void _flush_input();
+static int _wait_input_events(HANDLE hSource, INPUT_RECORD* records, DWORD max_records, DWORD* numEvents, DWORD timeout);
+static void _set_cursor_position(HANDLE hBuffer, COORD pos);
+static void _set_text_attribute(HANDLE hBuffer, WORD attribute);
+static void _set_cursor_position_vt(HANDLE hBuffer, COORD pos);
+static void _set_text_attribute_vt(HANDLE hBuffer, WORD attribute);
+inline static void _write_bytes(HANDLE hDestination, const char* data, size_t size);
+
+// HEADLESS SURFACE FUNCTIONS
+inline static MENU_SURFACE _as_surface(HANDLE hBuffer);
+static void _surface_write(MENU_SURFACE surface, const char* data, size_t size);
+static void _surface_resize(MENU_SURFACE surface, COORD size);
+static void _surface_clear(MENU_SURFACE surface);
+inline static SURFACE_CELL* _surface_cell(MENU_SURFACE surface, int x, int y);
+static void _surface_push_event(MENU_SURFACE surface, const INPUT_RECORD* record);
+static int _surface_pop_events(MENU_SURFACE surface, INPUT_RECORD* records, DWORD max_records, DWORD* numEvents);
+
+// FRAME BUFFER FUNCTIONS
+static struct __menu_framebuffer* _create_framebuffer();
+static void _destroy_framebuffer(struct __menu_framebuffer* framebuffer);
+static void _resize_framebuffer(struct __menu_framebuffer* framebuffer, COORD size);
+static void _framebuffer_clear(struct __menu_framebuffer* framebuffer);
+static void _framebuffer_put_text(struct __menu_framebuffer* framebuffer, COORD pos, const char* text, unsigned char style);
+static void _framebuffer_flush(MENU menu);
+inline static void _invalidate_screen(MENU menu);
+static void _acquire_render_buffers(MENU menu);
+static void _release_render_buffers(MENU menu);
+static void _acquire_screen(MENU menu);
+static void _release_screen(MENU menu);
+#ifndef _WIN32
+static void _init_posix_terminal();
+static void _toggle_cursor_posix(HANDLE hBuffer, int flag);
+static void _posix_catch_signal(int signal_number, void (*handler)(int), int replace);
+static void _posix_resume_handler(int signal_number);
+#endif
 
 static void _draw_render_unit(MENU_RENDER_ARGUMENT rargument, COORD pos, PMENU_RENDER_UNIT render_unit);
 static void _renderMenu(MENU used_menu);
+static int _begin_menu_session(MENU used_menu);
+static void _end_menu_session(MENU used_menu);
+static int _menu_frame(MENU used_menu);
+static int _menu_step(MENU used_menu, DWORD timeout);
+static void _input_ring_push(const INPUT_RECORD* record);
+static int _fill_input_ring(HANDLE hSource, DWORD timeout);
+static void _discard_pending_input(HANDLE hSource);
+static void _start_menu(MENU used_menu);
 static void _show_error_and_wait_extended(MENU menu);
 static COORD _calculate_start_coordinates(MENU menu, COORD current_size);
 static void _update_formatted_strings(MENU menu);
+static int _reserve_options(MENU menu, size_t needed);
+static void* _arena_alloc(struct __menu_arena_chunk** arena, size_t size);
+static void _arena_release(struct __menu_arena_chunk** arena);
+static MENU_ITEM _create_menu_item_with_label(char* text, size_t text_bytes, int label_kind, __menu_callback callback, void* callback_data);
+inline static void _free_menu_item(MENU_ITEM item);
+static const char* _intern_label(const char* text, size_t length);
+static int _track_option_width(MENU menu, size_t width);
+static void _untrack_option_width(MENU menu, size_t width);
+static int _remove_option(MENU used_menu, MENU_ITEM option_to_clear);
+static int _is_menu_option(MENU menu, MENU_ITEM item);
+static MENU_ITEM _find_option_by_serial(MENU menu, unsigned long long serial);
+static void _option_set_added(MENU menu, MENU_ITEM item);
+static void _option_set_removed(MENU menu, MENU_ITEM item);
+static void _destroy_option_set(MENU menu);
+static int _set_option_text(MENU menu, MENU_ITEM item, char* text, size_t text_bytes);
+static void _mark_option_dirty(MENU menu, MENU_ITEM item);
+static void _clear_dirty_options(MENU menu);
+
+// COMMAND QUEUE FUNCTIONS
+static struct __menu_command_queue* _create_command_queue();
+static void _destroy_command_queue(struct __menu_command_queue* queue);
+static void _close_command_queue(struct __menu_command_queue* queue);
+static int _post_command(MENU menu, int type, MENU_ITEM item, char* text, __menu_callback task, void* task_data);
+static int _apply_menu_commands(MENU menu);
+static void _wake_render_loop();
+
+// ASYNC CALLBACK FUNCTIONS
+static int _start_async_callback(MENU menu, MENU_ITEM item);
+static void _abandon_async_job(MENU menu, struct __menu_async_job* job);
+static void _apply_async_completions();
+static void _hand_back_async_job(struct __menu_async_job* job);
+static void _queue_async_job(struct __menu_async_job* job);
+
+// SUBMENU FUNCTIONS
+static MENU _load_submenu(struct __menu_submenu* submenu);
+static void _prefetch_submenu(struct __menu_submenu* submenu);
+static void _release_submenu(struct __menu_submenu* submenu);
+static void _orphan_prefetch(struct __menu_submenu* submenu);
+static void _cancel_prefetch(struct __menu_async_job* job);
+static void _finish_prefetch(struct __menu_async_job* job);
+static void _close_submenu(MENU used_menu);
+static int _open_submenu(MENU used_menu, MENU_ITEM item);
+static int _submenu_step(MENU used_menu, DWORD timeout);
+
+// TIMER FUNCTIONS
+static void _timer_insert(struct __menu_timer_wheel* wheel, struct __menu_timer* timer);
+static void _timer_unlink(struct __menu_timer_wheel* wheel, struct __menu_timer* timer);
+static void _destroy_timer_wheel(struct __menu_timer_wheel* wheel);
+static int _run_timers(MENU menu);
+static DWORD _timer_delay(MENU menu);
+
+// VIEWPORT FUNCTIONS
+static void _layout_options(MENU menu, COORD current_size);
+static int _grid_neighbor(MENU menu, int index, WORD vk);
+static void _clamp_viewport(MENU menu, COORD current_size);
+static int _scroll_to_selection(MENU menu);
+static int _scroll_viewport(MENU menu, int delta);
+static void _select_option(MENU menu, int index);
+
+// FILTER FUNCTIONS
+inline static unsigned char _fold_char(unsigned char c);
+inline static MENU_ITEM _shown_option(MENU menu, size_t index);
+inline static size_t _shown_count(MENU menu);
+static size_t _filter_reach(MENU menu, size_t upto);
+static int _filter_push(MENU menu, char c);
+static int _filter_pop(MENU menu);
+static void _filter_reset(MENU menu);
+static void _filter_destroy(struct __menu_filter* filter);
+static void _filter_follow_settings(MENU menu);
+static void _filter_requery(MENU menu);
+static void _filter_rank_viewport(MENU menu);
+inline static int _filter_pending(MENU menu);
+static int _filter_continue(MENU menu);
+static void _filter_option_added(MENU menu, MENU_ITEM item);
+static void _filter_option_removed(MENU menu, MENU_ITEM item);
+static void _filter_option_relabeled(MENU menu, MENU_ITEM item);
 
 // LEGACY FUNCTIONS
 static void _clear_buffer_legacy(HANDLE hBuffer);
@@ -186,18 +866,47 @@ static void _draw_render_unit_legacy(MENU_RENDER_ARGUMENT rargument, COORD pos,
 // REDRAWING FUNCTIONS
 inline static void _performFullRedraw(MENU used_menu, COORD current_size, int* y_min, int* y_max, int* x_start, int* x_max, RenderUnitDrawer _draw_render_unit_func);
 inline static void _performDirtyRedraw(MENU used_menu, int last_selected_index, int cached_selected_index, RenderUnitDrawer _draw_render_unit_func);
+inline static void _performRowRedraw(MENU used_menu);
+static DWORD _frame_delay(MENU menu);
 
 /* ============== PUBLIC FUNCTION IMPLEMENTATIONS ============== */
 
 /* ----- timing Functions ----- */
 MENULIB_API double tick()
 {
+#ifdef _WIN32
     static LARGE_INTEGER freq = {0};
     if (freq.QuadPart == 0)
         QueryPerformanceFrequency(&freq);
     LARGE_INTEGER counter;
     QueryPerformanceCounter(&counter);
     return (double)counter.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec counter;
+    clock_gettime(CLOCK_MONOTONIC, &counter);
+    return (double)counter.tv_sec + (double)counter.tv_nsec / 1e9;
+#endif
+}
+
+MENULIB_API MENU_FRAME_STATS get_frame_stats(MENU menu)
+{
+    MENU_FRAME_STATS empty = {0};
+    return menu ? menu->frame_stats : empty;
+}
+
+MENULIB_API void reset_frame_stats(MENU menu)
+{
+    if (menu) memset(&menu->frame_stats, 0, sizeof(MENU_FRAME_STATS));
+}
+
+MENULIB_API MENU_INPUT_STATS get_input_stats()
+{
+    return input_ring.stats;
+}
+
+MENULIB_API void reset_input_stats()
+{
+    memset(&input_ring.stats, 0, sizeof(MENU_INPUT_STATS));
 }
 
 /* ----- Menu Policy Functions ----- */
@@ -212,11 +921,35 @@ MENULIB_API void toggle_mouse(MENU menu_to_change)
     menu_to_change->menu_settings.mouse_enabled = menu_to_change->menu_settings.mouse_enabled ^ 1;
 }
 
+MENULIB_API void toggle_grid_layout(MENU menu_to_change)
+{
+    menu_to_change->menu_settings.grid_layout = menu_to_change->menu_settings.grid_layout ^ 1;
+    menu_to_change->layout_dirty = TRUE;
+    menu_to_change->full_redraw = TRUE;
+    menu_to_change->need_redraw = TRUE;
+}
+
+MENULIB_API void toggle_filter(MENU menu_to_change)
+{
+    menu_to_change->menu_settings.filter_enabled = menu_to_change->menu_settings.filter_enabled ^ 1;
+    _filter_follow_settings(menu_to_change);
+}
+
+MENULIB_API void toggle_fuzzy_filter(MENU menu_to_change)
+{
+    menu_to_change->menu_settings.filter_fuzzy = menu_to_change->menu_settings.filter_fuzzy ^ 1;
+    _filter_follow_settings(menu_to_change);
+    _filter_requery(menu_to_change);
+}
+
 /* ----- Configuration Functions (Setters) ----- */
 MENULIB_API void set_menu_settings(MENU menu, MENU_SETTINGS new_settings)
 {
     memcpy((void*)&(menu->menu_settings), (void*)&new_settings, sizeof(MENU_SETTINGS));
     _clamp_center_coord(&(menu->menu_settings.menu_center));
+    menu->layout_dirty = TRUE;
+    _filter_follow_settings(menu);
+    _filter_requery(menu); // a typed query follows the matching mode
 }
 
 MENULIB_API void set_default_menu_settings(MENU_SETTINGS new_settings)
@@ -249,6 +982,11 @@ MENULIB_API void set_default_legacy_color_object(LEGACY_MENU_COLOR color_object)
 
 /* ----- Creation Functions ----- */
 MENULIB_API MENU create_menu()
+{
+    return create_menu_with_capacity(CAPACITY_MIN);
+}
+
+MENULIB_API MENU create_menu_with_capacity(size_t capacity)
 {
     static int _initialized = FALSE;
     if (!_initialized)
@@ -262,82 +1000,141 @@ MENULIB_API MENU create_menu()
     memset(new_menu, 0, sizeof(struct __menu));
 
     new_menu->count = 0;
-    new_menu->active_buffer = 0;
     new_menu->selected_index = 0;
     new_menu->full_redraw = TRUE;
-    new_menu->capacity = CAPACITY_MIN;
+    new_menu->capacity = capacity > CAPACITY_MIN ? capacity : CAPACITY_MIN;
     new_menu->next = NULL;
 
     new_menu->options = _safe_malloc(new_menu->capacity * sizeof(MENU_ITEM));
-    if (!new_menu->options)
+    new_menu->commands = _create_command_queue();
+    if (!new_menu->options || !new_menu->commands)
         {
+            free(new_menu->options);
+            free(new_menu->commands);
             free(new_menu);
             return NULL;
         }
     new_menu->running = FALSE;
-    new_menu->__ID = _random_uint64_t();
     new_menu->__first_run = TRUE;
 
     new_menu->menu_settings = create_new_settings();
     new_menu->color_object = create_color_object();
     new_menu->legacy_color_object = create_legacy_color_object();
 
-    new_menu->hBuffer[0] = _createConsoleScreenBuffer();
-    new_menu->hBuffer[1] = _createConsoleScreenBuffer();
-
-    _toggle_cursor(new_menu->hBuffer[0], FALSE);
-    _toggle_cursor(new_menu->hBuffer[1], FALSE);
+    new_menu->hBuffer = NULL; // screen and frame buffer come from the pool once the menu is shown
+    new_menu->framebuffer = NULL;
 
     new_menu->menu_size = zero_point;
+    new_menu->layout_columns = 1;
+    new_menu->layout_dirty = TRUE;
     new_menu->header = strdup(DEFAULT_HEADER_TEXT);
     new_menu->footer = strdup(DEFAULT_FOOTER_TEXT);
-    new_menu->header_len = _count_utf8_chars(new_menu->header);
-    new_menu->footer_len = _count_utf8_chars(new_menu->footer);
+    new_menu->header_len = _display_width(new_menu->header);
+    new_menu->footer_len = _display_width(new_menu->footer);
 
     new_menu->formatted_header = NULL;
     new_menu->formatted_footer = NULL;
+    new_menu->header_dirty = new_menu->footer_dirty = TRUE;
 
     _get_menu_size(new_menu);
 
-    // checking if we can fit in our new menu
-    if (menus_amount + 1 > menus_capacity)
-        {
-            // if cant do realloc
-            size_t new_capacity = menus_capacity + CAPACITY_STEP;
-            MENU* temp_array = (MENU*)_safe_realloc(menus_array, new_capacity * sizeof(MENU));
-            if (!temp_array)
-                {
-                    // allocation failed, we cant add the new menu so we do cleanup and return failure
-                    free(new_menu->options);
-                    free(new_menu->formatted_header);
-                    free(new_menu->formatted_footer);
-                    if (new_menu->hBuffer[0] != INVALID_HANDLE_VALUE) CloseHandle(new_menu->hBuffer[0]);
-                    if (new_menu->hBuffer[1] != INVALID_HANDLE_VALUE) CloseHandle(new_menu->hBuffer[1]);
-                    free(new_menu);
-                    return NULL;
-                }
-            menus_array = temp_array;
-            menus_capacity = new_capacity;
+    if (_acquire_menu_slot(new_menu))
+        {
+            // the slot table could not grow, we cant add the new menu so we do cleanup and return failure
+            free(new_menu->options);
+            free(new_menu->formatted_header);
+            free(new_menu->formatted_footer);
+            free(new_menu->width_histogram);
+            free(new_menu->header);
+            free(new_menu->footer);
+            _destroy_command_queue(new_menu->commands);
+            free(new_menu);
+            return NULL;
         }
 
-    menus_array[menus_amount++] = new_menu;
+    new_menu->__older = newest_menu;
+    if (newest_menu) newest_menu->__newer = new_menu;
+    else oldest_menu = new_menu;
+    newest_menu = new_menu;
+    menus_amount++;
 
+    _filter_follow_settings(new_menu); // the index grows with the options instead of being built by the first keystroke
     return new_menu;
 }
 
 MENULIB_API MENU_ITEM create_menu_item(const char* restrict text, __menu_callback callback, void* callback_data)
 {
-    MENU_ITEM item = (MENU_ITEM)_safe_malloc(sizeof(struct __menu_item));
+    if (!text) return create_menu_item_borrowed(DEFAULT_MENU_TEXT, callback, callback_data);
+
+    size_t text_bytes = strlen(text);
+    char* copy = _safe_malloc(text_bytes + 1);
+    if (!copy) return NULL;
+    memcpy(copy, text, text_bytes + 1);
+
+    MENU_ITEM item = _create_menu_item_with_label(copy, text_bytes, LABEL_OWNED, callback, callback_data);
+    if (!item) free(copy);
+    return item;
+}
+
+MENULIB_API MENU_ITEM create_menu_item_borrowed(const char* text, __menu_callback callback, void* callback_data)
+{
+    if (!text) text = DEFAULT_MENU_TEXT;
+    return _create_menu_item_with_label((char*)text, strlen(text), LABEL_BORROWED, callback, callback_data);
+}
+
+MENULIB_API MENU_ITEM create_menu_item_interned(const char* text, __menu_callback callback, void* callback_data)
+{
+    if (!text) text = DEFAULT_MENU_TEXT;
+    size_t text_bytes = strlen(text);
+    const char* shared = _intern_label(text, text_bytes);
+    if (!shared) return NULL;
+    return _create_menu_item_with_label((char*)shared, text_bytes, LABEL_INTERNED, callback, callback_data);
+}
+
+MENULIB_API const char* intern_label(const char* text)
+{
+    return text ? _intern_label(text, strlen(text)) : NULL;
+}
+
+MENULIB_API void release_interned_labels()
+{
+    free(intern_table.slots);
+    free(intern_table.hashes);
+    _arena_release(&intern_table.chunks);
+    memset(&intern_table, 0, sizeof(intern_table));
+}
+
+MENULIB_API MENU_ITEM create_menu_item_in(MENU owner, const char* restrict text, __menu_callback callback, void* callback_data)
+{
+    if (!owner) return NULL;
+    if (!text) text = DEFAULT_MENU_TEXT;
+
+    // item and label share one bump allocation, both go away with the menu
+    size_t text_size = strlen(text) + 1;
+    MENU_ITEM item = (MENU_ITEM)_arena_alloc(&owner->arena, sizeof(struct __menu_item) + text_size);
     if (!item) return NULL;
 
-    item->text = text ? strdup(text) : DEFAULT_MENU_TEXT;
-    item->text_len = _count_utf8_chars(item->text);
+    item->text = (char*)(item + 1);
+    memcpy(item->text, text, text_size);
+    item->text_bytes = text_size - 1;
+    item->text_len = _display_width_n(item->text, item->text_bytes);
     item->boundaries = (COORD)
     {
         item->text_len, 0
     };
-    item->callback = callback; //
+    item->x_position = 0;
+    item->callback = callback;
     item->data_chunk = callback_data;
+    item->__arena_owner = owner;
+    item->__label_kind = LABEL_BORROWED; // the label sits in the arena right after the item
+    item->__cells = NULL;
+    item->__dirty = FALSE;
+    item->__async = FALSE;
+    item->__async_timeout = 0;
+    item->__job = NULL;
+    item->__filter_id = 0;
+    item->__submenu = NULL;
+    item->__serial = MENU_ATOMIC_NEXT_SERIAL(&item_serial);
     return item;
 }
 
@@ -387,23 +1184,46 @@ MENULIB_API COLOR_OBJECT_PROPERTY new_full_rgb_color(MENU_RGB_COLOR _color_foreg
 /* ----- Menu Operations ----- */
 MENULIB_API int add_option(MENU used_menu, const MENU_ITEM item)
 {
-    if (!item) return 1;
+    if (!item || (item->__arena_owner && item->__arena_owner != used_menu)) return 1;
 
-    if (used_menu->count >= used_menu->capacity)
-        {
-            size_t new_size = used_menu->capacity + CAPACITY_STEP;
-            MENU_ITEM* new_options = (MENU_ITEM*)_safe_realloc(used_menu->options, new_size * sizeof(MENU_ITEM));
-            if (!new_options)
-                {
-                    // failed to reallocate, so we cant add the new option.
-                    // the original used_menu->options is still valid so just return.
-                    return 1;
-                }
-            used_menu->options = new_options;
-            used_menu->capacity = new_size;
-        }
+    // failed to reallocate, the original used_menu->options is still valid so just return
+    if (_reserve_options(used_menu, used_menu->count + 1)) return 1;
+    if (_track_option_width(used_menu, item->text_len)) return 1; // nothing was added yet
 
     used_menu->options[used_menu->count++] = item;
+    if (used_menu->filter) _filter_option_added(used_menu, item);
+    if (used_menu->option_set) _option_set_added(used_menu, item);
+    _get_menu_size(used_menu);
+    used_menu->full_redraw = TRUE;
+    return 0;
+}
+
+MENULIB_API int add_options(MENU used_menu, const MENU_ITEM* items, size_t amount)
+{
+    if (!used_menu || !items) return 1;
+    for (size_t i = 0; i < amount; i++)
+        if (items[i] && items[i]->__arena_owner && items[i]->__arena_owner != used_menu) return 1;
+
+    // one allocation and one geometry update for the whole batch
+    if (_reserve_options(used_menu, used_menu->count + amount)) return 1;
+
+    // widths first, a histogram that cannot grow leaves the menu as it was
+    for (size_t i = 0; i < amount; i++)
+        if (items[i] && _track_option_width(used_menu, items[i]->text_len))
+            {
+                while (i-- > 0)
+                    if (items[i]) _untrack_option_width(used_menu, items[i]->text_len);
+                return 1;
+            }
+
+    for (size_t i = 0; i < amount; i++)
+        if (items[i])
+            {
+                used_menu->options[used_menu->count++] = items[i];
+                if (used_menu->filter) _filter_option_added(used_menu, items[i]);
+                if (used_menu->option_set) _option_set_added(used_menu, items[i]);
+            }
+
     _get_menu_size(used_menu);
     used_menu->full_redraw = TRUE;
     return 0;
@@ -416,21 +1236,72 @@ MENULIB_API void set_redraw(MENU menu) {
 
 MENULIB_API void change_header(MENU used_menu, const char* restrict text)
 {
+    free(used_menu->header);
     used_menu->header = strdup(text);
-    used_menu->header_len = _count_utf8_chars(used_menu->header);
+    used_menu->header_len = _display_width(used_menu->header);
+    used_menu->header_dirty = TRUE;
     set_redraw(used_menu);
     _get_menu_size(used_menu);
 }
 
 MENULIB_API void change_footer(MENU used_menu, const char* restrict text)
 {
+    free(used_menu->footer);
     used_menu->footer = strdup(text);
-    used_menu->footer_len = _count_utf8_chars(used_menu->footer);
+    used_menu->footer_len = _display_width(used_menu->footer);
+    used_menu->footer_dirty = TRUE;
 	set_redraw(used_menu);
     _get_menu_size(used_menu);
 }
 
 MENULIB_API void enable_menu(MENU used_menu)
+{
+    _start_menu(used_menu);
+    _renderMenu(used_menu);
+}
+
+MENULIB_API int menu_poll(MENU used_menu, DWORD timeout)
+{
+    if (used_menu && _find_menu_anywhere(used_menu->__ID) != used_menu) return FALSE; // cleared, by Escape for instance
+    if (used_menu && used_menu->session) return _menu_step(used_menu, timeout);
+
+    // the first step only shows the menu, input is handled from the next one on
+    _start_menu(used_menu);
+    return _begin_menu_session(used_menu);
+}
+
+MENULIB_API MENU_FD menu_get_fd(MENU used_menu)
+{
+    // headless surfaces are fed with surface_push_event, there is nothing to wait on
+    if (!used_menu || used_menu->surface) return MENU_NO_FD;
+#ifdef _WIN32
+    return hStdin;
+#else
+    return STDIN_FILENO;
+#endif
+}
+
+MENULIB_API MENU_FD menu_get_wakeup_fd()
+{
+#ifdef _WIN32
+    return wakeup_event ? wakeup_event : MENU_NO_FD;
+#else
+    return posix_signal_pipe[0];
+#endif
+}
+
+MENULIB_API void disable_menu(MENU used_menu)
+{
+    if (!used_menu || used_menu->count == 0)
+        {
+            _lwrite_string(hConsoleError, "Error: Menu has no options. Use add_option first!");
+            exit(BAD_MENU);
+        }
+
+    used_menu->running = 0;
+}
+
+static void _start_menu(MENU used_menu)
 {
     if (!used_menu || used_menu->count == 0)
         {
@@ -438,29 +1309,18 @@ MENULIB_API void enable_menu(MENU used_menu)
             exit(BAD_MENU);
         }
 
+    _acquire_render_buffers(used_menu);
     if (_size_check(used_menu))
         _show_error_and_wait_extended(used_menu);
 
     used_menu->running = 1;
+    _push_shown(used_menu, TRUE);
 
     if (used_menu->__first_run == TRUE)
         {
             used_menu->__first_run = FALSE;
             used_menu->selected_index = 0;
         }
-
-    _renderMenu(used_menu);
-}
-
-MENULIB_API void disable_menu(MENU used_menu)
-{
-    if (!used_menu || used_menu->count == 0)
-        {
-            _lwrite_string(hConsoleError, "Error: Menu has no options. Use add_option first!");
-            exit(BAD_MENU);
-        }
-
-    used_menu->running = 0;
 }
 
 /* ----- Cleanup Functions ----- */
@@ -469,23 +1329,29 @@ MENULIB_API void clear_menu_options(MENU menu_to_clear)
     if (!menu_to_clear) return;
 
     // free all existing options if they exist
+    menu_to_clear->dirty_count = 0; // the items are about to go away
     if (menu_to_clear->options != NULL && menu_to_clear->count > 0)
         {
-            for (int i = 0; i < menu_to_clear->count; i++)
-                if (menu_to_clear->options[i])
-                    {
-                        free(menu_to_clear->options[i]->text);
-                        free(menu_to_clear->options[i]);
-                    }
+            for (size_t i = 0; i < menu_to_clear->count; i++)
+                if (menu_to_clear->options[i]) _free_menu_item(menu_to_clear->options[i]);
             free(menu_to_clear->options);
         }
+    _arena_release(&menu_to_clear->arena); // every arena item in one go, one free per chunk
+    _destroy_option_set(menu_to_clear);
+
+    _filter_destroy(menu_to_clear->filter);
+    menu_to_clear->filter = NULL;
 
     // reset the menu's state to be empty but still valid
     menu_to_clear->options = NULL;
     menu_to_clear->count = 0;
     menu_to_clear->capacity = 0;
+    _filter_follow_settings(menu_to_clear); // nothing left to filter, an empty index takes its place
     menu_to_clear->selected_index = 0;
     menu_to_clear->full_redraw = TRUE;
+    if (menu_to_clear->width_histogram)
+        memset(menu_to_clear->width_histogram, 0, menu_to_clear->width_histogram_len * sizeof(size_t));
+    menu_to_clear->max_option_width = 0;
 
     // recalculate the base size of the now-empty menu
     _get_menu_size(menu_to_clear);
@@ -493,95 +1359,236 @@ MENULIB_API void clear_menu_options(MENU menu_to_clear)
 
 MENULIB_API void clear_option(MENU used_menu, MENU_ITEM option_to_clear)
 {
-    MENU_ITEM* o = used_menu->options;
-    for (int i = 0; i < used_menu->count; i++)
-        if (o[i] == option_to_clear)
-            {
-                free(o[i]->text);
-                free(o[i]);
-                used_menu->count--;
-
-                size_t elements_to_move = used_menu->count - i;
-                if (elements_to_move > 0) memmove(&o[i], &o[i+1], elements_to_move * sizeof(MENU_ITEM));
+    if (_remove_option(used_menu, option_to_clear) && used_menu->count <= 0) clear_menu(used_menu);
+}
 
-                if (used_menu->selected_index >= used_menu->count) used_menu->selected_index--;
-                _get_menu_size(used_menu);
+MENULIB_API int update_option_text(MENU used_menu, MENU_ITEM item, const char* text)
+{
+    if (!used_menu || !item || !_is_menu_option(used_menu, item)) return 1; // an item of another menu would corrupt this one's widths
+    if (!text) text = DEFAULT_MENU_TEXT;
 
-                if (used_menu->count <= 0) clear_menu(used_menu);
-                else
-                    {
-                        // try to shrink the allocation and if it fails we keep the oversized buffer
-                        MENU_ITEM* new_options = (MENU_ITEM*)_safe_realloc((void*)used_menu->options, used_menu->count * sizeof(MENU_ITEM));
-                        if (new_options)
-                            {
-                                used_menu->options = new_options;
-                                used_menu->capacity = used_menu->count;
-                            }
-                    }
+    size_t text_bytes = strlen(text);
+    char* copy = _safe_malloc(text_bytes + 1);
+    if (!copy) return 1;
+    memcpy(copy, text, text_bytes + 1);
 
-                used_menu->full_redraw = TRUE;
-                break;
-            }
+    return _set_option_text(used_menu, item, copy, text_bytes); // only this row is repainted unless the menu gets wider
 }
 
-MENULIB_API void clear_menu(MENU menu_to_clear)
+MENULIB_API size_t set_menu_filter(MENU used_menu, const char* query)
 {
-    for (int i = 0; i < menus_amount; i++)
-        if (menus_array[i] == menu_to_clear)
-            {
-                MENU m = menus_array[i];
-                if (m->options != NULL && m->count > 0)
-                    {
-                        for (int j = 0; j < m->count; j++)
-                            {
-                                free(m->options[j]->text);
-                                free(m->options[j]);
-                            }
-
-                        free(m->options);
-                        m->options = NULL;
-                    }
+    size_t common = 0;
 
-                // free(m->color_object);
-                free(m->formatted_header);
-                free(m->formatted_footer);
-                free(m->header);
-                free(m->footer);
+    if (!used_menu) return 0;
+    if (!query) query = "";
 
-                if (m->hBuffer[0] != INVALID_HANDLE_VALUE) CloseHandle(m->hBuffer[0]);
-                if (m->hBuffer[1] != INVALID_HANDLE_VALUE) CloseHandle(m->hBuffer[1]);
-                m->running = FALSE;
-
-                menus_array[i] = NULL;
-                menus_amount--;
+    // the prefix shared with the current query keeps its results, only the rest is typed again
+    if (used_menu->filter)
+        {
+            while (common < used_menu->filter->length && query[common] && _fold_char((unsigned char)query[common]) == (unsigned char)used_menu->filter->query[common])
+                common++;
+            while (used_menu->filter->length > common) _filter_pop(used_menu);
+        }
+    for (query += common; *query; query++)
+        if (!_filter_push(used_menu, *query)) break;
+    return _filter_reach(used_menu, FILTER_UNLIMITED); // keystrokes only look as far as the screen, the caller gets every match
+}
 
-                size_t elements_to_move = menus_amount - i;
-                if (elements_to_move > 0) memmove(&menus_array[i], &menus_array[i+1], elements_to_move * sizeof(MENU));
+/* ----- Cross-thread Functions ----- */
+MENULIB_API int post_add_option(MENU used_menu, MENU_ITEM item)
+{
+    if (!item) return 1;
+    return _post_command(used_menu, COMMAND_ADD_OPTION, item, NULL, NULL, NULL);
+}
 
-                if (menus_amount <= 0)
-                    {
-                        free(menus_array);
-                        menus_array = NULL;
-                        _setConsoleActiveScreenBuffer(hConsole);
-                    }
-                else
-                    {
-                        MENU* new_array = (MENU*)_safe_realloc((void*)menus_array, menus_amount * sizeof(MENU));
-                        if (new_array)
-                            {
-                                menus_array = new_array;
-                                menus_capacity = menus_amount;
-                            }
-                        menus_array[0]->running = TRUE; // in case so we always have something to hold our back
-                    }
-                break;
-            }
+MENULIB_API int post_clear_option(MENU used_menu, MENU_ITEM option_to_clear)
+{
+    if (!option_to_clear) return 1;
+    return _post_command(used_menu, COMMAND_CLEAR_OPTION, option_to_clear, NULL, NULL, NULL);
+}
+
+MENULIB_API int post_option_text(MENU used_menu, MENU_ITEM item, const char* text)
+{
+    if (!item) return 1;
+    char* copy = strdup(text ? text : DEFAULT_MENU_TEXT); // the caller's buffer may be gone by the time we apply it
+    if (!copy) return 1;
+    if (_post_command(used_menu, COMMAND_OPTION_TEXT, item, copy, NULL, NULL))
+        {
+            free(copy);
+            return 1;
+        }
+    return 0;
+}
+
+MENULIB_API int post_menu_task(MENU used_menu, __menu_callback task, void* task_data)
+{
+    if (!task) return 1;
+    return _post_command(used_menu, COMMAND_TASK, NULL, NULL, task, task_data);
+}
+
+/* ----- Async Callback Functions ----- */
+MENULIB_API void set_option_async(MENU_ITEM item, int enabled, DWORD timeout)
+{
+    if (!item) return;
+    item->__async = !!enabled;
+    item->__async_timeout = timeout;
+}
+
+MENULIB_API void cancel_option_callback(MENU used_menu, MENU_ITEM item)
+{
+    if (!used_menu || !item || !item->__job) return;
+    _abandon_async_job(used_menu, item->__job);
+}
+
+MENULIB_API int menu_callback_cancelled()
+{
+    return async_current_job ? MENU_ATOMIC_LOAD_INT(&async_current_job->cancelled) : FALSE;
+}
+
+/* ----- Submenu Functions ----- */
+MENULIB_API int set_option_submenu(MENU_ITEM item, __menu_callback populate, void* populate_data)
+{
+    if (!item) return 1;
+
+    // a new populate callback makes whatever was built before worthless
+    if (item->__submenu) _release_submenu(item->__submenu);
+    item->__submenu = NULL;
+    if (!populate) return 0; // plain option again
+
+    struct __menu_submenu* submenu = _safe_malloc(sizeof(struct __menu_submenu));
+    if (!submenu) return 1;
+    memset(submenu, 0, sizeof(struct __menu_submenu));
+    submenu->populate = populate;
+    submenu->populate_data = populate_data;
+    item->__submenu = submenu;
+    return 0;
+}
+
+MENULIB_API MENU get_option_submenu(MENU_ITEM item)
+{
+    if (!item || !item->__submenu || item->__submenu->prefetch || !item->__submenu->populated) return NULL;
+    return _find_menu_anywhere(item->__submenu->child_id);
+}
+
+MENULIB_API void invalidate_submenu(MENU_ITEM item)
+{
+    if (!item || !item->__submenu) return;
+    struct __menu_submenu* submenu = item->__submenu;
+
+    if (submenu->prefetch) _orphan_prefetch(submenu);
+    submenu->populated = FALSE; // rebuilt the next time it is opened
+}
+
+/* ----- Timer Functions ----- */
+MENULIB_API MENU_TIMER menu_add_timer(MENU used_menu, DWORD interval, __menu_callback callback, void* callback_data)
+{
+    if (!used_menu || !callback) return NULL;
+
+    if (!used_menu->timers)
+        {
+            used_menu->timers = _safe_malloc(sizeof(struct __menu_timer_wheel));
+            if (!used_menu->timers) return NULL;
+        }
+    struct __menu_timer_wheel* wheel = used_menu->timers;
+
+    MENU_TIMER timer = _safe_malloc(sizeof(struct __menu_timer));
+    if (!timer) return NULL;
+
+    if (!wheel->count) wheel->now = (unsigned long long)(tick() * 1000.0); // nothing to catch up on
+    timer->interval = interval ? interval : 1;
+    timer->expires = (unsigned long long)(tick() * 1000.0) + timer->interval;
+    timer->callback = callback;
+    timer->callback_data = callback_data;
+    _timer_insert(wheel, timer);
+    wheel->count++;
+    return timer;
+}
+
+MENULIB_API void menu_remove_timer(MENU used_menu, MENU_TIMER timer)
+{
+    struct __menu_timer_wheel* wheel = used_menu ? used_menu->timers : NULL;
+    if (!wheel || !timer) return;
+
+    wheel->count--;
+    if (timer == wheel->running) wheel->running_removed = TRUE; // freed once its callback returns
+    else
+        {
+            _timer_unlink(wheel, timer);
+            free(timer);
+        }
+}
+
+MENULIB_API void clear_menu(MENU menu_to_clear)
+{
+    if (!menu_to_clear || _find_menu_anywhere(menu_to_clear->__ID) != menu_to_clear) return; // already cleared
+    MENU m = menu_to_clear;
+
+    // a worker is still adding options, the job clears it once it is handed back
+    if (m->__populating)
+        {
+            _cancel_prefetch(m->__populating);
+            return;
+        }
+
+    if (m->options != NULL && m->count > 0)
+        {
+            for (size_t j = 0; j < m->count; j++)
+                _free_menu_item(m->options[j]);
+
+            free(m->options);
+            m->options = NULL;
+        }
+    _arena_release(&m->arena);
+
+    // free(m->color_object);
+    free(m->formatted_header);
+    free(m->formatted_footer);
+    free(m->width_histogram);
+    free(m->hit_columns);
+    _filter_destroy(m->filter);
+    _destroy_option_set(m);
+    free(m->dirty_options);
+    free(m->header);
+    free(m->footer);
+
+    if (!m->session) _release_render_buffers(m); // a shown menu gives them back when its session ends
+    _close_command_queue(m->commands); // whatever was still queued is dropped, the queue itself lives as long as m
+    _destroy_timer_wheel(m->timers);
+    m->timers = NULL;
+    m->running = FALSE;
+
+    // the handle goes stale right here, whoever saved it finds out in O(1)
+    _release_menu_slot(m);
+    _unlink_shown(m);
+    if (m->__older) m->__older->__newer = m->__newer;
+    else oldest_menu = m->__newer;
+    if (m->__newer) m->__newer->__older = m->__older;
+    else newest_menu = m->__older;
+    m->__older = m->__newer = NULL;
+    menus_amount--;
+
+    if (menus_amount <= 0) _setConsoleActiveScreenBuffer(hConsole);
+    else
+        {
+            oldest_menu->running = TRUE; // in case so we always have something to hold our back
+            if (!oldest_menu->__shown) _push_shown(oldest_menu, FALSE);
+        }
+
+    // cleared between two menu_poll() steps, nobody else is going to give the terminal back
+    if (m->session && !m->session->stepping) _end_menu_session(m);
 }
 
 MENULIB_API void clear_menus()
 {
-    while(menus_amount > 0)
-        clear_menu(menus_array[0]);
+    MENU menu;
+
+    // children still being populated are waited for, none of them would ever leave the list otherwise
+    for (menu = oldest_menu; menu; menu = menu->__newer)
+        if (menu->__populating) _finish_prefetch(menu->__populating);
+    _apply_async_completions();
+
+    while(oldest_menu)
+        clear_menu(oldest_menu);
 }
 
 MENULIB_API void clear_menus_and_exit()
@@ -590,10 +1597,157 @@ MENULIB_API void clear_menus_and_exit()
     exit(0);
 }
 
+/* ----- Headless Surface Functions ----- */
+MENULIB_API MENU_SURFACE create_headless_surface(int width, int height)
+{
+    MENU_SURFACE surface = (MENU_SURFACE)_safe_malloc(sizeof(struct __menu_surface));
+    if (!surface) return NULL;
+
+    surface->cursor_visible = TRUE;
+    _surface_resize(surface, (COORD)
+    {
+        width, height
+    });
+    if (!surface->cells)
+        {
+            free(surface);
+            return NULL;
+        }
+
+    surface->next = surfaces_list;
+    surfaces_list = surface;
+    return surface;
+}
+
+MENULIB_API void destroy_surface(MENU_SURFACE surface)
+{
+    if (!surface) return;
+
+    // menus that still render into it fall back to the console
+    for (MENU menu = oldest_menu; menu; menu = menu->__newer)
+        if (menu->surface == surface) set_menu_surface(menu, NULL);
+    if (hCurrent == (HANDLE)surface) hCurrent = hConsole;
+
+    MENU_SURFACE* link = &surfaces_list;
+    while (*link && *link != surface) link = &(*link)->next;
+    if (*link) *link = surface->next;
+
+    free(surface->cells);
+    free(surface->row_text);
+    free(surface->events);
+    free(surface->output);
+    free(surface);
+}
+
+MENULIB_API void set_menu_surface(MENU menu, MENU_SURFACE surface)
+{
+    if (!menu || menu->surface == surface) return;
+
+    _release_screen(menu);
+    menu->surface = surface;
+    if (surface)
+        {
+            menu->hBuffer = (HANDLE)surface;
+            _toggle_cursor((HANDLE)surface, FALSE);
+        }
+    else if (menu->session) _acquire_screen(menu); // shown right now, back on the console
+
+    _invalidate_screen(menu);
+}
+
+MENULIB_API void surface_push_key(MENU_SURFACE surface, WORD virtual_key, char ascii)
+{
+    INPUT_RECORD record;
+    memset(&record, 0, sizeof(INPUT_RECORD));
+    record.EventType = KEY_EVENT;
+    record.Event.KeyEvent.bKeyDown = TRUE;
+    record.Event.KeyEvent.wRepeatCount = 1;
+    record.Event.KeyEvent.wVirtualKeyCode = virtual_key;
+    record.Event.KeyEvent.uChar.AsciiChar = ascii;
+    _surface_push_event(surface, &record);
+}
+
+MENULIB_API void surface_push_mouse(MENU_SURFACE surface, int x, int y, DWORD button_state, DWORD event_flags)
+{
+    INPUT_RECORD record;
+    memset(&record, 0, sizeof(INPUT_RECORD));
+    record.EventType = MOUSE_EVENT;
+    record.Event.MouseEvent.dwMousePosition = (COORD)
+    {
+        x, y
+    };
+    record.Event.MouseEvent.dwButtonState = button_state;
+    record.Event.MouseEvent.dwEventFlags = event_flags;
+    _surface_push_event(surface, &record);
+}
+
+MENULIB_API void surface_push_resize(MENU_SURFACE surface, int width, int height)
+{
+    INPUT_RECORD record;
+    memset(&record, 0, sizeof(INPUT_RECORD));
+    record.EventType = WINDOW_BUFFER_SIZE_EVENT;
+    record.Event.WindowBufferSizeEvent.dwSize = (COORD)
+    {
+        width, height
+    };
+    _surface_push_event(surface, &record);
+}
+
+MENULIB_API void surface_record_output(MENU_SURFACE surface, int enabled)
+{
+    surface->recording = !!enabled;
+}
+
+MENULIB_API const char* surface_get_output(MENU_SURFACE surface, size_t* size)
+{
+    if (size) *size = surface->output_len;
+    return surface->output ? surface->output : "";
+}
+
+MENULIB_API const char* surface_get_row(MENU_SURFACE surface, int y)
+{
+    char* out = surface->row_text;
+    for (int x = 0; x < surface->size.X; x++)
+        {
+            SURFACE_CELL* cell = _surface_cell(surface, x, y);
+            if (!cell) break;
+            for (size_t k = 0; k < sizeof(cell->glyph) && cell->glyph[k]; k++) *out++ = cell->glyph[k];
+        }
+    *out = '\0';
+    return surface->row_text;
+}
+
+MENULIB_API unsigned int surface_get_style(MENU_SURFACE surface, int x, int y)
+{
+    SURFACE_CELL* cell = _surface_cell(surface, x, y);
+    return cell ? cell->style : 0;
+}
+
+MENULIB_API COORD surface_get_cursor(MENU_SURFACE surface)
+{
+    return surface->cursor;
+}
+
+MENULIB_API COORD surface_get_size(MENU_SURFACE surface)
+{
+    return surface->size;
+}
+
+MENULIB_API MENU_SURFACE_STATS surface_get_stats(MENU_SURFACE surface)
+{
+    return surface->stats;
+}
+
+MENULIB_API void surface_reset_stats(MENU_SURFACE surface)
+{
+    memset(&surface->stats, 0, sizeof(MENU_SURFACE_STATS));
+    surface->output_len = 0;
+}
+
 /* ============== INTERNAL FUNCTIONS ============== */
 
 /* ----- Memory Management ----- */
-#ifdef DEBUG
+#if defined(DEBUG) && defined(_WIN32)
 static void _print_memory_info(HANDLE hBuffer)
 {
     static size_t _s_t = 1024 * 1024;
@@ -644,6 +1798,149 @@ static void* _safe_realloc(void* ptr, size_t _size)
     return new_ptr;
 }
 
+static MENU_ITEM _create_menu_item_with_label(char* text, size_t text_bytes, int label_kind, __menu_callback callback, void* callback_data)
+{
+    MENU_ITEM item = (MENU_ITEM)_safe_malloc(sizeof(struct __menu_item));
+    if (!item) return NULL;
+
+    item->text = text;
+    item->text_bytes = text_bytes;
+    item->__label_kind = label_kind;
+    item->text_len = _display_width_n(item->text, text_bytes);
+    item->boundaries = (COORD)
+    {
+        item->text_len, 0
+    };
+    item->callback = callback; //
+    item->data_chunk = callback_data;
+    item->__arena_owner = NULL;
+    item->__cells = NULL;
+    item->__dirty = FALSE;
+    item->__async = FALSE;
+    item->__async_timeout = 0;
+    item->__job = NULL;
+    item->__filter_id = 0;
+    item->__submenu = NULL;
+    item->__serial = MENU_ATOMIC_NEXT_SERIAL(&item_serial);
+    return item;
+}
+
+// clear_option without closing the menu once it runs empty, returns TRUE if the option was found
+static int _remove_option(MENU used_menu, MENU_ITEM option_to_clear)
+{
+    MENU_ITEM* o = used_menu->options;
+    for (size_t i = 0; i < used_menu->count; i++)
+        if (o[i] == option_to_clear)
+            {
+                _untrack_option_width(used_menu, o[i]->text_len);
+                if (o[i]->__dirty)
+                    for (size_t j = 0; j < used_menu->dirty_count; j++)
+                        if (used_menu->dirty_options[j] == o[i])
+                            {
+                                used_menu->dirty_options[j] = used_menu->dirty_options[--used_menu->dirty_count];
+                                break;
+                            }
+                used_menu->count--;
+
+                size_t elements_to_move = used_menu->count - i;
+                if (elements_to_move > 0) memmove(&o[i], &o[i+1], elements_to_move * sizeof(MENU_ITEM));
+
+                // a typed query keeps the selection inside its matches
+                if (used_menu->filter) _filter_option_removed(used_menu, option_to_clear);
+                if (used_menu->option_set) _option_set_removed(used_menu, option_to_clear);
+                if (!used_menu->filter || !used_menu->filter->length)
+                    if (used_menu->selected_index >= 0 && (size_t)used_menu->selected_index >= used_menu->count) used_menu->selected_index--;
+                _free_menu_item(option_to_clear); // arena items stay allocated until the menu is cleared
+                _get_menu_size(used_menu);
+
+                if (used_menu->count > 0)
+                    {
+                        // shrink only once the buffer is mostly empty, so add/remove cycles dont realloc every time
+                        if (used_menu->count < used_menu->capacity / 4 && used_menu->capacity / 2 >= CAPACITY_MIN)
+                            {
+                                // if it fails we keep the oversized buffer
+                                MENU_ITEM* new_options = (MENU_ITEM*)_safe_realloc((void*)used_menu->options, used_menu->capacity / 2 * sizeof(MENU_ITEM));
+                                if (new_options)
+                                    {
+                                        used_menu->options = new_options;
+                                        used_menu->capacity /= 2;
+                                    }
+                            }
+                    }
+
+                used_menu->full_redraw = TRUE;
+                return TRUE;
+            }
+    return FALSE;
+}
+
+// the item takes over text, the old label is released according to its kind; 1 (and text freed) when the new width cant be counted
+static int _set_option_text(MENU menu, MENU_ITEM item, char* text, size_t text_bytes)
+{
+    size_t width = _display_width_n(text, text_bytes);
+
+    if (width != (size_t)item->text_len && _track_option_width(menu, width))
+        {
+            free(text);
+            return 1;
+        }
+
+    if (item->__label_kind == LABEL_OWNED) free(item->text);
+    item->text = text;
+    item->text_bytes = text_bytes;
+    item->__label_kind = LABEL_OWNED; // heap copy even for arena items, _free_menu_item takes care of it
+
+    free(item->__cells);
+    item->__cells = NULL;
+    if (menu->filter) _filter_option_relabeled(menu, item); // the label may enter or leave the matches
+
+    if (width != (size_t)item->text_len)
+        {
+            SHORT old_width = menu->menu_size.X;
+            size_t old_slot = menu->max_option_width;
+            _untrack_option_width(menu, item->text_len);
+            item->text_len = (int)width;
+            _get_menu_size(menu);
+
+            // a wider or narrower menu (or grid slot) moves every row, otherwise the label stays in its slot
+            if (menu->menu_size.X != old_width || (menu->layout_columns > 1 && menu->max_option_width != old_slot))
+                {
+                    menu->full_redraw = TRUE;
+                    return 0;
+                }
+        }
+    _mark_option_dirty(menu, item);
+    return 0;
+}
+
+static void _mark_option_dirty(MENU menu, MENU_ITEM item)
+{
+    if (item->__dirty) return; // already waiting, the repaint picks up the latest text
+
+    if (menu->dirty_count == menu->dirty_capacity)
+        {
+            size_t new_capacity = menu->dirty_capacity ? menu->dirty_capacity * 2 : CAPACITY_MIN;
+            MENU_ITEM* new_dirty = _safe_realloc(menu->dirty_options, new_capacity * sizeof(MENU_ITEM));
+            if (!new_dirty)
+                {
+                    menu->full_redraw = TRUE; // a full redraw picks the label up as well
+                    return;
+                }
+            menu->dirty_options = new_dirty;
+            menu->dirty_capacity = new_capacity;
+        }
+
+    menu->dirty_options[menu->dirty_count++] = item;
+    item->__dirty = TRUE;
+}
+
+static void _clear_dirty_options(MENU menu)
+{
+    for (size_t i = 0; i < menu->dirty_count; i++)
+        menu->dirty_options[i]->__dirty = FALSE;
+    menu->dirty_count = 0;
+}
+
 /* ----- Initialization ----- */
 static MENU_COLOR _create_default_color()
 {
@@ -674,6 +1971,12 @@ static MENU_SETTINGS _create_default_settings()
     settings.footer_enabled = DEFAULT_FOOTER_SETTING;
     settings.double_width_enabled = DEFAULT_WIDTH_SETTING;
     settings.force_legacy_mode = DEFAULT_LEGACY_SETTING;
+    settings.max_frame_rate = DEFAULT_FRAME_RATE_SETTING;
+    settings.grid_layout = DEFAULT_GRID_SETTING;
+    settings.filter_enabled = DEFAULT_FILTER_SETTING;
+    settings.filter_fuzzy = DEFAULT_FUZZY_SETTING;
+    settings.filter_threads = DEFAULT_FILTER_THREADS_SETTING;
+    settings.submenu_prefetch = DEFAULT_PREFETCH_SETTING;
     settings.menu_center = (MENU_COORD)
     {
         0, 0
@@ -684,6 +1987,10 @@ static MENU_SETTINGS _create_default_settings()
 
 inline static HANDLE _createConsoleScreenBuffer()
 {
+#ifndef _WIN32
+    // every menu shares the alternate screen, buffering is done on our side
+    return (HANDLE)&posix_alternate_screen;
+#else
     HANDLE hBuffer = CreateConsoleScreenBuffer(
                          GENERIC_READ | GENERIC_WRITE,
                          FILE_SHARE_READ | FILE_SHARE_WRITE,
@@ -697,16 +2004,22 @@ inline static HANDLE _createConsoleScreenBuffer()
             exit(BAD_HANDLE);
         }
     return hBuffer;
+#endif
 }
 
 static WORD _check_if_supports_vt100()
 {
+#ifndef _WIN32
+    // every terminal we can run on speaks vt
+    return 1;
+#else
     DWORD tdwmode;
     HANDLE tConsole = GetStdHandle(STD_OUTPUT_HANDLE);
     GetConsoleMode(tConsole, &tdwmode);
 
     if (tdwmode & ENABLE_VIRTUAL_TERMINAL_PROCESSING) return 1;
     return 0;
+#endif
 }
 
 static void _init_wrapper_functions()
@@ -723,30 +2036,36 @@ static void _init_wrapper_functions()
             _ldraw_at_position = _ldraw_at_position_legacy;
             _clear_buffer_func = _clear_buffer_legacy;
             _draw_at_position = _draw_at_position_legacy;
+#ifdef _WIN32
             _toggle_cursor = _toggle_cursor_legacy;
+#endif
         }
+
+#ifndef _WIN32
+    // there is one cursor for the whole terminal, visibility is tracked per screen
+    _toggle_cursor = _toggle_cursor_posix;
+#endif
 }
 
 // this function runs once for the entire program cycle
 static void _init_menu_system()
 {
+#ifdef _WIN32
     hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
     hConsoleError = GetStdHandle(STD_ERROR_HANDLE);
     hStdin = GetStdHandle(STD_INPUT_HANDLE);
-    hCurrent = hConsole;
-    _init_hError();
 
     input.type = INPUT_MOUSE;
     input.mi.dwFlags = MOUSEEVENTF_LEFTUP;
-
-    CONSOLE_SCREEN_BUFFER_INFO icsbi;
-    GetConsoleScreenBufferInfo(hConsole, &icsbi);
-
-    cached_size = (COORD)
-    {
-        icsbi.srWindow.Right - icsbi.srWindow.Left + 1,
-                             icsbi.srWindow.Bottom - icsbi.srWindow.Top + 1
-    };
+    wakeup_event = CreateEvent(NULL, FALSE, FALSE, NULL); // auto reset, one wakeup per set
+#else
+    hConsole = (HANDLE)&posix_main_screen;
+    hConsoleError = (HANDLE)&posix_error_screen;
+    hStdin = (HANDLE)(intptr_t)STDIN_FILENO;
+    _init_posix_terminal();
+#endif
+    hCurrent = hConsole;
+    // the error screen and the console size are only looked up once a menu needs them
 
     if (menu_settings_initialized ^ 1)
         set_default_menu_settings(_create_default_settings());
@@ -760,8 +2079,6 @@ static void _init_menu_system()
 
     // after check initializing all the wrapper functions
     _init_wrapper_functions();
-
-    srand(time(NULL));
 }
 
 inline static void _init_hError()
@@ -786,7 +2103,7 @@ static void _ldraw_at_position_vt(HANDLE hDestination, SHORT x, SHORT y, const c
 
 inline static void _ldraw_at_position_legacy(HANDLE hDestination, SHORT x, SHORT y, const char* text)
 {
-    SetConsoleCursorPosition(hDestination, (COORD)
+    _set_cursor_position(hDestination, (COORD)
     {
         x, y
     });
@@ -812,7 +2129,7 @@ static void _draw_at_position_legacy(HANDLE hDestination, SHORT x, SHORT y, cons
 {
     va_list args;
     va_start(args, text);
-    SetConsoleCursorPosition(hDestination, (COORD)
+    _set_cursor_position(hDestination, (COORD)
     {
         x, y
     });
@@ -829,89 +2146,559 @@ static void _vwrite_string(HANDLE hDestination, const char* text, va_list args)
 
 inline static void _lwrite_string(HANDLE hDestination, const char* text)
 {
-    WriteConsoleA(hDestination, text, (DWORD)strlen(text), &written, NULL);
+    _write_bytes(hDestination, text, strlen(text));
 }
 
-/* ---- Other Utilities ---- */
-// counts the number of visible characters in a UTF-8 encoded string
-static size_t _count_utf8_chars(const char* s)
+inline static void _write_bytes(HANDLE hDestination, const char* data, size_t size)
 {
-    size_t count = 0;
-    while (*s)
+    MENU_SURFACE surface = _as_surface(hDestination);
+    if (surface)
         {
-            // in UTF-8, only the first byte of a multi-byte sequence does not start with binary '10'xxxxx
-            if ((*s & 0xC0) != 0x80)
-                count++;
-            s++;
+            _surface_write(surface, data, size);
+            return;
         }
-    return count;
+
+#ifdef _WIN32
+    WriteConsoleA(hDestination, data, (DWORD)size, &written, NULL);
+#else
+    int fd = ((struct __posix_screen*)hDestination)->fd;
+    while (size > 0)
+        {
+            ssize_t result = write(fd, data, size);
+            if (result < 0)
+                {
+                    if (errno == EINTR) continue;
+                    return;
+                }
+            data += result;
+            size -= (size_t)result;
+        }
+#endif
 }
 
-inline static void _clamp_center_coord(MENU_COORD* coord)
+/* ---- Other Utilities ---- */
+/* ----- Text Width ----- */
+
+// zero width code points (combining marks, joiners, variation selectors...), sorted ranges
+static const unsigned int zero_width_table[][2] =
 {
-    // x
-    if (coord->X > 1.0f) coord->X = 1.0f;
-    else if (coord->X < -1.0f) coord->X = -1.0f;
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF}, {0x05C1, 0x05C2},
+    {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A}, {0x064B, 0x065F}, {0x0670, 0x0670},
+    {0x06D6, 0x06DC}, {0x06DF, 0x06E4}, {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711},
+    {0x0730, 0x074A}, {0x07A6, 0x07B0}, {0x07EB, 0x07F3}, {0x0816, 0x0819}, {0x081B, 0x0823},
+    {0x0825, 0x0827}, {0x0829, 0x082D}, {0x0859, 0x085B}, {0x08D3, 0x08E1}, {0x08E3, 0x0902},
+    {0x093A, 0x093A}, {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+    {0x0962, 0x0963}, {0x0981, 0x0981}, {0x09BC, 0x09BC}, {0x09C1, 0x09C4}, {0x09CD, 0x09CD},
+    {0x09E2, 0x09E3}, {0x0A01, 0x0A02}, {0x0A3C, 0x0A3C}, {0x0A41, 0x0A51}, {0x0A70, 0x0A71},
+    {0x0A75, 0x0A75}, {0x0A81, 0x0A82}, {0x0ABC, 0x0ABC}, {0x0AC1, 0x0AC8}, {0x0ACD, 0x0ACD},
+    {0x0AE2, 0x0AE3}, {0x0B01, 0x0B01}, {0x0B3C, 0x0B3C}, {0x0B3F, 0x0B3F}, {0x0B41, 0x0B44},
+    {0x0B4D, 0x0B4D}, {0x0B56, 0x0B56}, {0x0B62, 0x0B63}, {0x0B82, 0x0B82}, {0x0BC0, 0x0BC0},
+    {0x0BCD, 0x0BCD}, {0x0C3E, 0x0C40}, {0x0C46, 0x0C56}, {0x0C62, 0x0C63}, {0x0CBC, 0x0CBC},
+    {0x0CCC, 0x0CCD}, {0x0CE2, 0x0CE3}, {0x0D41, 0x0D44}, {0x0D4D, 0x0D4D}, {0x0DCA, 0x0DCA},
+    {0x0DD2, 0x0DD6}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x0EB1, 0x0EB1},
+    {0x0EB4, 0x0EBC}, {0x0EC8, 0x0ECD}, {0x0F18, 0x0F19}, {0x0F35, 0x0F35}, {0x0F37, 0x0F37},
+    {0x0F39, 0x0F39}, {0x0F71, 0x0F7E}, {0x0F80, 0x0F84}, {0x0F86, 0x0F87}, {0x0F8D, 0x0FBC},
+    {0x0FC6, 0x0FC6}, {0x102D, 0x1030}, {0x1032, 0x1037}, {0x1039, 0x103A}, {0x103D, 0x103E},
+    {0x1058, 0x1059}, {0x105E, 0x1060}, {0x1071, 0x1074}, {0x1082, 0x1082}, {0x1085, 0x1086},
+    {0x108D, 0x108D}, {0x109D, 0x109D}, {0x1160, 0x11FF}, {0x135D, 0x135F}, {0x1712, 0x1714},
+    {0x1732, 0x1734}, {0x1752, 0x1753}, {0x1772, 0x1773}, {0x17B4, 0x17B5}, {0x17B7, 0x17BD},
+    {0x17C6, 0x17C6}, {0x17C9, 0x17D3}, {0x17DD, 0x17DD}, {0x180B, 0x180F}, {0x18A9, 0x18A9},
+    {0x1920, 0x1922}, {0x1927, 0x1928}, {0x1932, 0x1932}, {0x1939, 0x193B}, {0x1A17, 0x1A18},
+    {0x1A1B, 0x1A1B}, {0x1AB0, 0x1AFF}, {0x1B00, 0x1B03}, {0x1B34, 0x1B34}, {0x1B36, 0x1B3A},
+    {0x1B3C, 0x1B3C}, {0x1B42, 0x1B42}, {0x1B6B, 0x1B73}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F},
+    {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20F0}, {0x2CEF, 0x2CF1}, {0x2DE0, 0x2DFF},
+    {0x302A, 0x302D}, {0x3099, 0x309A}, {0xA66F, 0xA672}, {0xA674, 0xA67D}, {0xA69E, 0xA69F},
+    {0xA6F0, 0xA6F1}, {0xA802, 0xA802}, {0xA806, 0xA806}, {0xA80B, 0xA80B}, {0xA825, 0xA826},
+    {0xA8C4, 0xA8C5}, {0xA8E0, 0xA8F1}, {0xA926, 0xA92D}, {0xA947, 0xA951}, {0xFB1E, 0xFB1E},
+    {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0x101FD, 0x101FD}, {0x1D167, 0x1D169},
+    {0x1D17B, 0x1D182}, {0x1D185, 0x1D18B}, {0x1D1AA, 0x1D1AD}, {0x1F3FB, 0x1F3FF}, {0xE0001, 0xE0001},
+    {0xE0020, 0xE007F}, {0xE0100, 0xE01EF}
+};
 
-    // y
-    if (coord->Y > 1.0f) coord->Y = 1.0f;
-    else if (coord->Y < -1.0f) coord->Y = -1.0f;
-}
+// east asian wide / fullwidth and emoji presentation code points, sorted ranges
+static const unsigned int wide_table[][2] =
+{
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0},
+    {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F},
+    {0x2693, 0x2693}, {0x26A1, 0x26A1}, {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728},
+    {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+    {0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55},
+    {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+    {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F},
+    {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4}, {0x17000, 0x18CFF}, {0x1AFF0, 0x1B2FF},
+    {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F202},
+    {0x1F210, 0x1F23B}, {0x1F240, 0x1F248}, {0x1F250, 0x1F251}, {0x1F260, 0x1F265}, {0x1F300, 0x1F320},
+    {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA}, {0x1F3CF, 0x1F3D3},
+    {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F43E}, {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC},
+    {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E}, {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596},
+    {0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2},
+    {0x1F6D5, 0x1F6D7}, {0x1F6DC, 0x1F6DF}, {0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB},
+    {0x1F7F0, 0x1F7F0}, {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+    {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+};
 
-inline static unsigned long long _random_uint64_t()
+static int _in_width_table(unsigned int code_point, const unsigned int (*table)[2], size_t size)
 {
-    return ((unsigned long long)rand() << 32) | rand();
+    size_t low = 0, high = size;
+    if (code_point < table[0][0] || code_point > table[size - 1][1]) return FALSE;
+    while (low < high)
+        {
+            size_t middle = (low + high) / 2;
+            if (code_point > table[middle][1]) low = middle + 1;
+            else if (code_point < table[middle][0]) high = middle;
+            else return TRUE;
+        }
+    return FALSE;
 }
 
-static MENU _find_menu_by_id(unsigned long long saved_id)
+// terminal columns taken by one code point: 0, 1 or 2
+static int _codepoint_width(unsigned int code_point)
 {
-    for (int i = 0; i < menus_amount; i++)
-        if (menus_array[i] &&
-                menus_array[i]->__ID == saved_id &&
-                menus_array[i]->running) return menus_array[i];
-    return NULL;
+    if (code_point < 0x300) return 1;
+    if (_in_width_table(code_point, zero_width_table, sizeof(zero_width_table) / sizeof(zero_width_table[0]))) return 0;
+    if (code_point < 0x1100) return 1;
+    return _in_width_table(code_point, wide_table, sizeof(wide_table) / sizeof(wide_table[0])) ? 2 : 1;
 }
 
-static HANDLE _find_first_active_menu_buffer()
+// decodes one utf-8 sequence, broken ones come back as a single byte
+static size_t _decode_utf8(const unsigned char* p, unsigned int* code_point)
 {
-    for (int i = menus_amount - 1; i >= 0; i--)
+    size_t length = (*p >= 0xF0) ? 4 : (*p >= 0xE0) ? 3 : (*p >= 0xC0) ? 2 : 1;
+    unsigned int value = (length == 1) ? *p : (length == 2) ? (*p & 0x1F) : (length == 3) ? (*p & 0x0F) : (*p & 0x07);
+
+    for (size_t i = 1; i < length; i++)
         {
-            if (menus_array[i]->running)
-                return menus_array[i]->hBuffer[menus_array[i]->active_buffer];
+            if ((p[i] & 0xC0) != 0x80)
+                {
+                    *code_point = *p;
+                    return 1;
+                }
+            value = (value << 6) | (p[i] & 0x3F);
         }
-    exit(BAD_MENU);
+    *code_point = value;
+    return length;
 }
 
-/* ----- Console Management ----- */
-inline static void _toggle_cursor_vt(HANDLE hBuffer, int flag)
+inline static unsigned int _lowest_bit(unsigned int mask)
 {
-    _lwrite_string(hBuffer, flag ? SHOW_CURSOR : HIDE_CURSOR);
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned int)index;
+#else
+    return (unsigned int)__builtin_ctz(mask);
+#endif
 }
 
-static void _toggle_cursor_legacy(HANDLE hBuffer, int flag)
+inline static unsigned int _lowest_bit64(unsigned long long mask)
 {
-    CONSOLE_CURSOR_INFO cursorInfo;
-    GetConsoleCursorInfo(hBuffer, &cursorInfo);
-    cursorInfo.bVisible = flag;
-    SetConsoleCursorInfo(hBuffer, &cursorInfo);
+    unsigned int low = (unsigned int)mask;
+    return low ? _lowest_bit(low) : 32 + _lowest_bit((unsigned int)(mask >> 32));
 }
 
+// column width of the first bytes of a utf-8 string, ascii runs are skipped a vector at a time
+static size_t _display_width_n(const char* text, size_t bytes)
+{
+    const unsigned char* p = (const unsigned char*)text;
+    const unsigned char* end = p + bytes;
+    size_t width = 0;
+    unsigned int code_point, mask;
+
+    while (p < end)
+        {
+#if defined(MENU_SIMD_AVX2)
+            while (end - p >= 32)
+                {
+                    mask = (unsigned int)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)p));
+                    if (mask)
+                        {
+                            width += _lowest_bit(mask);
+                            p += _lowest_bit(mask);
+                            break;
+                        }
+                    width += 32;
+                    p += 32;
+                }
+#endif
+#if defined(MENU_SIMD_AVX2) || defined(MENU_SIMD_SSE2)
+            while (end - p >= 16)
+                {
+                    mask = (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)p));
+                    if (mask)
+                        {
+                            width += _lowest_bit(mask);
+                            p += _lowest_bit(mask);
+                            break;
+                        }
+                    width += 16;
+                    p += 16;
+                }
+#else
+            (void)mask;
+#endif
+            if (p >= end) break;
+
+            // scalar tail and everything that is not ascii
+            if (*p < 0x80)
+                {
+                    width++;
+                    p++;
+                    continue;
+                }
+            p += _decode_utf8(p, &code_point);
+            width += _codepoint_width(code_point);
+        }
+    return width;
+}
+
+inline static size_t _display_width(const char* text)
+{
+    return _display_width_n(text, strlen(text));
+}
+
+MENULIB_API size_t menu_text_width(const char* text)
+{
+    return text ? _display_width(text) : 0;
+}
+
+inline static void _clamp_center_coord(MENU_COORD* coord)
+{
+    // x
+    if (coord->X > 1.0f) coord->X = 1.0f;
+    else if (coord->X < -1.0f) coord->X = -1.0f;
+
+    // y
+    if (coord->Y > 1.0f) coord->Y = 1.0f;
+    else if (coord->Y < -1.0f) coord->Y = -1.0f;
+}
+
+/* ----- Menu Slots ----- */
+// O(1) amortized, the table doubles when no released slot is left
+static int _acquire_menu_slot(MENU menu)
+{
+    unsigned int slot;
+
+    if (menu_free_slot == NO_FREE_SLOT)
+        {
+            unsigned int new_capacity = menu_slots_capacity ? menu_slots_capacity * 2 : MENU_SLOTS_MIN;
+            struct __menu_slot* new_slots = _safe_realloc(menu_slots, new_capacity * sizeof(struct __menu_slot));
+            if (!new_slots) return 1;
+
+            // new slots go on the free list lowest first
+            for (unsigned int i = menu_slots_capacity; i < new_capacity; i++)
+                {
+                    new_slots[i].menu = NULL;
+                    new_slots[i].generation = 1; // an __ID is never 0
+                    new_slots[i].next_free = i + 1 < new_capacity ? i + 1 : NO_FREE_SLOT;
+                }
+            menu_free_slot = menu_slots_capacity;
+            menu_slots = new_slots;
+            menu_slots_capacity = new_capacity;
+        }
+
+    slot = menu_free_slot;
+    menu_free_slot = menu_slots[slot].next_free;
+    menu_slots[slot].menu = menu;
+    menu->__ID = ((unsigned long long)menu_slots[slot].generation << 32) | slot;
+    return 0;
+}
+
+static void _release_menu_slot(MENU menu)
+{
+    unsigned int slot = (unsigned int)menu->__ID;
+
+    menu_slots[slot].menu = NULL;
+    if (++menu_slots[slot].generation == 0) menu_slots[slot].generation = 1;
+    menu_slots[slot].next_free = menu_free_slot;
+    menu_free_slot = slot;
+}
+
+// running menus only, a disabled or cleared menu's handle does not validate
+static MENU _find_menu_by_id(unsigned long long saved_id)
+{
+    MENU menu = _find_menu_anywhere(saved_id);
+    return menu && menu->running ? menu : NULL;
+}
+
+// cached submenus are not running, _find_menu_by_id() would skip them
+static MENU _find_menu_anywhere(unsigned long long saved_id)
+{
+    unsigned int slot = (unsigned int)saved_id;
+    if (slot >= menu_slots_capacity || !menu_slots[slot].menu || menu_slots[slot].menu->__ID != saved_id) return NULL;
+    return menu_slots[slot].menu;
+}
+
+static void _push_shown(MENU menu, int on_top)
+{
+    if (menu->__shown) _unlink_shown(menu);
+    menu->__shown = TRUE;
+    if (on_top)
+        {
+            menu->__shown_below = shown_top;
+            menu->__shown_above = NULL;
+            if (shown_top) shown_top->__shown_above = menu;
+            else shown_bottom = menu;
+            shown_top = menu;
+        }
+    else
+        {
+            menu->__shown_above = shown_bottom;
+            menu->__shown_below = NULL;
+            if (shown_bottom) shown_bottom->__shown_below = menu;
+            else shown_top = menu;
+            shown_bottom = menu;
+        }
+}
+
+static void _unlink_shown(MENU menu)
+{
+    if (!menu->__shown) return;
+    if (menu->__shown_below) menu->__shown_below->__shown_above = menu->__shown_above;
+    else shown_bottom = menu->__shown_above;
+    if (menu->__shown_above) menu->__shown_above->__shown_below = menu->__shown_below;
+    else shown_top = menu->__shown_below;
+    menu->__shown_below = menu->__shown_above = NULL;
+    menu->__shown = FALSE;
+}
+
+// menus stopped since they were pushed are dropped on the way, each one once
+static HANDLE _find_first_active_menu_buffer()
+{
+    while (shown_top && (!shown_top->running || !shown_top->hBuffer)) _unlink_shown(shown_top);
+    return shown_top ? shown_top->hBuffer : hConsole; // every menu was disabled, hand the screen back
+}
+
+/* ----- Console Management ----- */
+inline static void _toggle_cursor_vt(HANDLE hBuffer, int flag)
+{
+    _lwrite_string(hBuffer, flag ? SHOW_CURSOR : HIDE_CURSOR);
+}
+
+#ifdef _WIN32
+static void _toggle_cursor_legacy(HANDLE hBuffer, int flag)
+{
+    if (_as_surface(hBuffer))
+        {
+            _toggle_cursor_vt(hBuffer, flag);
+            return;
+        }
+
+    CONSOLE_CURSOR_INFO cursorInfo;
+    GetConsoleCursorInfo(hBuffer, &cursorInfo);
+    cursorInfo.bVisible = flag;
+    SetConsoleCursorInfo(hBuffer, &cursorInfo);
+}
+#else
+// the terminal has one cursor, so we remember the state per screen and apply it when that screen is shown
+static void _toggle_cursor_posix(HANDLE hBuffer, int flag)
+{
+    if (_as_surface(hBuffer))
+        {
+            _toggle_cursor_vt(hBuffer, flag);
+            return;
+        }
+
+    struct __posix_screen* screen = (struct __posix_screen*)hBuffer;
+    screen->cursor_visible = flag;
+    if (screen->alternate == posix_alternate_active)
+        _toggle_cursor_vt(hBuffer, flag);
+}
+#endif
+
 inline static void _setConsoleActiveScreenBuffer(HANDLE hBuffer)
 {
-    SetConsoleActiveScreenBuffer(hBuffer);
+    // a headless surface is always "shown", the console stays as it is
+    if (!_as_surface(hBuffer))
+        {
+#ifdef _WIN32
+            SetConsoleActiveScreenBuffer(hBuffer);
+#else
+            struct __posix_screen* next = (struct __posix_screen*)hBuffer;
+            if (next->alternate != posix_alternate_active)
+                {
+                    posix_alternate_active = next->alternate;
+                    _lwrite_string(hBuffer, next->alternate ? ENTER_ALTERNATE_SCREEN : LEAVE_ALTERNATE_SCREEN);
+                    _toggle_cursor_vt(hBuffer, next->cursor_visible);
+                }
+#endif
+        }
     hCurrent = hBuffer;
 }
 
-static void _get_menu_size(MENU menu)
+static void* _arena_alloc(struct __menu_arena_chunk** arena, size_t size)
+{
+    struct __menu_arena_chunk* chunk = *arena;
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    if (!chunk || chunk->used + size > chunk->size)
+        {
+            // oversized requests get a chunk of their own
+            size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+            chunk = (struct __menu_arena_chunk*)malloc(sizeof(struct __menu_arena_chunk) + chunk_size);
+            if (!chunk)
+                {
+                    _lwrite_string(hConsoleError, "Fatal: Memory allocation failed\n");
+                    return NULL;
+                }
+            chunk->size = chunk_size;
+            chunk->used = 0;
+            chunk->next = *arena;
+            *arena = chunk;
+        }
+
+    void* memory = chunk->data + chunk->used;
+    chunk->used += size;
+    return memory;
+}
+
+static void _arena_release(struct __menu_arena_chunk** arena)
+{
+    struct __menu_arena_chunk* chunk = *arena;
+    while (chunk)
+        {
+            struct __menu_arena_chunk* next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+    *arena = NULL;
+}
+
+inline static void _free_menu_item(MENU_ITEM item)
+{
+    // a callback still running for the item finds out through menu_callback_cancelled()
+    if (item->__job)
+        {
+            MENU_ATOMIC_XCHG_INT(&item->__job->cancelled, TRUE);
+            item->__job->item = NULL;
+        }
+
+    if (item->__submenu) _release_submenu(item->__submenu);
+
+    // cells and relabeled texts are heap memory even for arena items
+    free(item->__cells);
+    if (item->__label_kind == LABEL_OWNED) free(item->text);
+    if (!item->__arena_owner) free(item);
+}
+
+inline static size_t _hash_label(const char* text, size_t length)
+{
+    // FNV-1a
+    size_t hash = (size_t)14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++)
+        {
+            hash ^= (unsigned char)text[i];
+            hash *= (size_t)1099511628211ULL;
+        }
+    return hash;
+}
+
+static int _intern_table_grow()
+{
+    size_t new_capacity = intern_table.capacity ? intern_table.capacity * 2 : INTERN_TABLE_MIN;
+    const char** new_slots = _safe_malloc(new_capacity * sizeof(const char*));
+    size_t* new_hashes = _safe_malloc(new_capacity * sizeof(size_t));
+    if (!new_slots || !new_hashes)
+        {
+            free(new_slots);
+            free(new_hashes);
+            return 1;
+        }
+
+    // rehash, the strings themselves dont move
+    for (size_t i = 0; i < intern_table.capacity; i++)
+        if (intern_table.slots[i])
+            {
+                size_t slot = intern_table.hashes[i] & (new_capacity - 1);
+                while (new_slots[slot]) slot = (slot + 1) & (new_capacity - 1);
+                new_slots[slot] = intern_table.slots[i];
+                new_hashes[slot] = intern_table.hashes[i];
+            }
+
+    free(intern_table.slots);
+    free(intern_table.hashes);
+    intern_table.slots = new_slots;
+    intern_table.hashes = new_hashes;
+    intern_table.capacity = new_capacity;
+    return 0;
+}
+
+static const char* _intern_label(const char* text, size_t length)
+{
+    // load factor stays under 3/4
+    if ((intern_table.count + 1) * 4 > intern_table.capacity * 3 && _intern_table_grow()) return NULL;
+
+    size_t hash = _hash_label(text, length);
+    size_t slot = hash & (intern_table.capacity - 1);
+    while (intern_table.slots[slot])
+        {
+            if (intern_table.hashes[slot] == hash && !strncmp(intern_table.slots[slot], text, length) && !intern_table.slots[slot][length])
+                return intern_table.slots[slot];
+            slot = (slot + 1) & (intern_table.capacity - 1);
+        }
+
+    char* copy = _arena_alloc(&intern_table.chunks, length + 1);
+    if (!copy) return NULL;
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+
+    intern_table.slots[slot] = copy;
+    intern_table.hashes[slot] = hash;
+    intern_table.count++;
+    return copy;
+}
+
+// geometric growth, so n single adds cost O(log n) reallocs
+static int _reserve_options(MENU menu, size_t needed)
 {
-    size_t max_width = 0;
+    if (needed <= menu->capacity && menu->options) return 0;
+
+    size_t new_capacity = menu->capacity * 2;
+    if (new_capacity < needed) new_capacity = needed;
+    if (new_capacity < CAPACITY_MIN) new_capacity = CAPACITY_MIN;
+
+    MENU_ITEM* new_options = (MENU_ITEM*)_safe_realloc(menu->options, new_capacity * sizeof(MENU_ITEM));
+    if (!new_options) return 1;
+    menu->options = new_options;
+    menu->capacity = new_capacity;
+    return 0;
+}
 
-    // check width of all options
-    for (int i = 0; i < menu->count; i++)
+// returns 1 when the histogram could not grow, nothing is counted then
+static int _track_option_width(MENU menu, size_t width)
+{
+    if (width >= menu->width_histogram_len)
         {
-            size_t current_width = menu->options[i]->text_len;
-            if (current_width > max_width) max_width = current_width;
+            size_t new_len = menu->width_histogram_len ? menu->width_histogram_len : WIDTH_HISTOGRAM_MIN;
+            while (new_len <= width) new_len *= 2;
+            size_t* new_histogram = _safe_realloc(menu->width_histogram, new_len * sizeof(size_t));
+            if (!new_histogram) return 1;
+            memset(new_histogram + menu->width_histogram_len, 0, (new_len - menu->width_histogram_len) * sizeof(size_t));
+            menu->width_histogram = new_histogram;
+            menu->width_histogram_len = new_len;
         }
+    menu->width_histogram[width]++;
+    if (width > menu->max_option_width) menu->max_option_width = width;
+    return 0;
+}
+
+static void _untrack_option_width(MENU menu, size_t width)
+{
+    if (width >= menu->width_histogram_len || !menu->width_histogram[width]) return;
+    menu->width_histogram[width]--;
+
+    // the widest label went away, walk down to the next used width
+    if (width == menu->max_option_width)
+        while (menu->max_option_width > 0 && !menu->width_histogram[menu->max_option_width])
+            menu->max_option_width--;
+}
+
+// O(1): the widest label comes from the histogram instead of a scan over all options
+static void _get_menu_size(MENU menu)
+{
+    size_t max_width = menu->max_option_width;
+    SHORT old_width = menu->menu_size.X;
 
     // also check header and footer width to ensure menu is wide enough
     if (menu->menu_settings.header_enabled)
@@ -926,7 +2713,8 @@ static void _get_menu_size(MENU menu)
         }
 
     menu->menu_size.X = max_width + 4; // adding padding for " [ text ] " style
-    menu->menu_size.Y = menu->count + 2; // base height: options + top/bottom borders
+    // base height: options + top/bottom borders, long menus scroll so they only ask for a few rows
+    menu->menu_size.Y = (menu->count > VIEWPORT_MIN_ROWS ? VIEWPORT_MIN_ROWS : menu->count) + 2;
 
     if (menu->menu_settings.header_enabled) menu->menu_size.Y += 2; // add space for header and a blank line
     if (menu->menu_settings.footer_enabled) menu->menu_size.Y += 2; // add space for footer and a blank line
@@ -934,28 +2722,25 @@ static void _get_menu_size(MENU menu)
     menu->halt_size.X = menu->menu_size.X / 2;
     menu->halt_size.Y = menu->menu_size.Y / 2;
 
-    _update_formatted_strings(menu);
+    // padding depends on the width, the strings themselves are formatted on the next full redraw
+    if (menu->menu_size.X != old_width) menu->header_dirty = menu->footer_dirty = TRUE;
+    menu->layout_dirty = TRUE;
 }
 
 static int _size_check(MENU menu)
 {
-    GetConsoleScreenBufferInfo(hConsole, &hBack_csbi);
-    int screen_width = hBack_csbi.srWindow.Right - hBack_csbi.srWindow.Left + 1;
-    int screen_height = hBack_csbi.srWindow.Bottom - hBack_csbi.srWindow.Top + 1;
-
-    cached_size = (COORD)
-    {
-        screen_width, screen_height
-    };
-    return (screen_width < menu->menu_size.X) | (screen_height < menu->menu_size.Y);
+    cached_size = _get_console_size(menu->surface ? (HANDLE)menu->surface : hConsole);
+    return (cached_size.X < menu->menu_size.X) | (cached_size.Y < menu->menu_size.Y);
 }
 
+#ifdef _WIN32
 inline static void _initWindow(SMALL_RECT* window, COORD size)
 {
     window->Top = window->Left = 0;
     window->Right = size.X - 1;
     window->Bottom = size.Y - 1;
 }
+#endif
 
 inline static void _clear_buffer(HANDLE hBuffer)
 {
@@ -965,6 +2750,16 @@ inline static void _clear_buffer(HANDLE hBuffer)
 // for non vt consoles
 static void _clear_buffer_legacy(HANDLE hBuffer)
 {
+#ifdef _WIN32
+    if (_as_surface(hBuffer))
+#endif
+        {
+            // no fill calls outside the windows console, plain vt clear does the same job
+            _set_text_attribute(hBuffer, reset_color_attribute);
+            _clear_buffer(hBuffer);
+            return;
+        }
+#ifdef _WIN32
     static COORD saved_buffer_size =
     {
         0, 0
@@ -989,6 +2784,7 @@ static void _clear_buffer_legacy(HANDLE hBuffer)
             FillConsoleOutputCharacter(hBuffer, ' ', calculated_size, zero_point, &swritten);
             FillConsoleOutputAttribute(hBuffer, reset_color_attribute, calculated_size, zero_point, &swritten);
         }
+#endif
 }
 
 // implementation of the disabled mouse handler
@@ -1010,13 +2806,27 @@ static int _handle_mouse_event_enabled(MENU used_menu, const MOUSE_EVENT_RECORD*
     COORD mouse_pos = event->dwMousePosition;
     int current_hover_index = DISABLED; // we assume mouse is not over any option by default
 
+    // wheel delta lives in the high word, positive means away from the user (scroll up)
+    if (event->dwEventFlags & MOUSE_WHEELED)
+        {
+            if (_scroll_viewport(used_menu, ((SHORT)(event->dwButtonState >> 16) > 0) ? -WHEEL_SCROLL_STEP : WHEEL_SCROLL_STEP))
+                {
+                    used_menu->need_redraw = TRUE;
+                    used_menu->full_redraw = TRUE;
+                }
+        }
+
     // determine which option, if any, the mouse is currently hovering over
-    if (mouse_pos.Y < y_max && mouse_pos.Y >= y_min && mouse_pos.X >= x && mouse_pos.X <= x_max)
+    if (mouse_pos.Y < y_max && mouse_pos.Y >= y_min && mouse_pos.X >= x && mouse_pos.X <= x_max &&
+            mouse_pos.X - x < used_menu->layout_width - 4 && used_menu->hit_columns)
         {
-            int potential_index = mouse_pos.Y - y_min;
-            // also check if the X coordinate is within the specific option's text boundaries
-            if (potential_index >= 0 && potential_index < used_menu->count &&
-                    mouse_pos.X <= used_menu->options[potential_index]->boundaries.X)
+            // O(1) through the hit index: the row comes from y, the column from a table over x
+            int column = used_menu->hit_columns[mouse_pos.X - x];
+            int potential_index = used_menu->scroll_offset + (mouse_pos.Y - y_min) * used_menu->layout_columns + column;
+            int slot_x = x + column * (used_menu->layout_cell_width + GRID_COLUMN_GAP);
+            // also check if the X coordinate is within the specific option's text (boundaries of freshly scrolled rows are not set yet)
+            if (column != DISABLED && (size_t)potential_index < _shown_count(used_menu) &&
+                    mouse_pos.X < slot_x + (int)_shown_option(used_menu, potential_index)->text_len)
                 current_hover_index = potential_index;
         }
 
@@ -1085,21 +2895,3137 @@ static int _handle_mouse_event_enabled(MENU used_menu, const MOUSE_EVENT_RECORD*
 }
 
 
-/* ----- Input Handling ----- */
-inline static void _block_input(DWORD* oldMode)
-{
-    GetConsoleMode(hStdin, oldMode);
-    DWORD newMode = *oldMode;
-    newMode |= ENABLE_EXTENDED_FLAGS;
-    newMode &= ~(ENABLE_QUICK_EDIT_MODE | ENABLE_ECHO_INPUT | ENABLE_LINE_INPUT);
-    newMode |= (ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT);
-    if (vt100_support) newMode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
-    SetConsoleMode(hStdin, newMode);
+/* ----- Input Handling ----- */
+inline static void _block_input(CONSOLE_INPUT_MODE* oldMode)
+{
+#ifdef _WIN32
+    GetConsoleMode(hStdin, oldMode);
+    DWORD newMode = *oldMode;
+    newMode |= ENABLE_EXTENDED_FLAGS;
+    newMode &= ~(ENABLE_QUICK_EDIT_MODE | ENABLE_ECHO_INPUT | ENABLE_LINE_INPUT);
+    newMode |= (ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT);
+    if (vt100_support) newMode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
+    SetConsoleMode(hStdin, newMode);
+#else
+    if (!posix_tty_input) return;
+    tcgetattr(STDIN_FILENO, oldMode);
+
+    // raw mode but keeping signals (ctrl+c) and output processing for callbacks
+    struct termios newMode = *oldMode;
+    newMode.c_iflag &= ~(IXON | ICRNL | INLCR | IGNCR);
+    newMode.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+    newMode.c_cc[VMIN] = 1;
+    newMode.c_cc[VTIME] = 0;
+    posix_raw_mode = newMode;
+    tcsetattr(STDIN_FILENO, TCSANOW, &newMode);
+    _lwrite_string(hConsole, MOUSE_TRACKING_ON);
+    posix_input_blocked = TRUE;
+#endif
+}
+
+inline static void _restore_input(const CONSOLE_INPUT_MODE* oldMode)
+{
+#ifdef _WIN32
+    SetConsoleMode(hStdin, *oldMode);
+#else
+    if (!posix_tty_input) return;
+    _lwrite_string(hConsole, MOUSE_TRACKING_OFF);
+    tcsetattr(STDIN_FILENO, TCSANOW, oldMode);
+    posix_input_blocked = FALSE;
+#endif
+}
+
+inline static void _reset_mouse_state()
+{
+#ifdef _WIN32
+    SendInput(1, &input, sizeof(INPUT));
+#endif
+}
+
+/* ----- Platform Layer ----- */
+static void _set_cursor_position_vt(HANDLE hBuffer, COORD pos)
+{
+    char sequence[32];
+    int length = snprintf(sequence, sizeof(sequence), "\x1b[%d;%dH", pos.Y + 1, pos.X + 1);
+    _write_bytes(hBuffer, sequence, (size_t)length);
+}
+
+// maps console attribute bits to sgr, windows has bgr order while vt has rgb
+static void _set_text_attribute_vt(HANDLE hBuffer, WORD attribute)
+{
+    static const int bgr_to_rgb[8] = {0, 4, 2, 6, 1, 5, 3, 7};
+    char sequence[32];
+    int fg = bgr_to_rgb[attribute & 0x7] + ((attribute & FOREGROUND_INTENSITY) ? 90 : 30);
+    int bg = bgr_to_rgb[(attribute >> 4) & 0x7] + ((attribute & BACKGROUND_INTENSITY) ? 100 : 40);
+    int length = snprintf(sequence, sizeof(sequence), "\x1b[0;%d;%dm", fg, bg);
+    _write_bytes(hBuffer, sequence, (size_t)length);
+}
+
+#ifdef _WIN32
+static COORD _get_console_size(HANDLE hBuffer)
+{
+    MENU_SURFACE surface = _as_surface(hBuffer);
+    if (surface) return surface->size;
+
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    GetConsoleScreenBufferInfo(hBuffer, &csbi);
+    return (COORD)
+    {
+        csbi.srWindow.Right - csbi.srWindow.Left + 1, csbi.srWindow.Bottom - csbi.srWindow.Top + 1
+    };
+}
+
+static void _resize_screen_buffer(HANDLE hBuffer, COORD size)
+{
+    MENU_SURFACE surface = _as_surface(hBuffer);
+    if (surface)
+        {
+            _surface_resize(surface, size);
+            return;
+        }
+
+    SMALL_RECT window;
+    _initWindow(&window, size);
+    SetConsoleScreenBufferSize(hBuffer, size);
+    SetConsoleWindowInfo(hBuffer, TRUE, &window);
+}
+
+inline static void _close_screen_buffer(HANDLE hBuffer)
+{
+    // surfaces belong to the caller
+    if (hBuffer != INVALID_HANDLE_VALUE && !_as_surface(hBuffer)) CloseHandle(hBuffer);
+}
+
+inline static void _flush_input()
+{
+    FlushConsoleInputBuffer(hStdin);
+}
+
+static int _wait_input_events(HANDLE hSource, INPUT_RECORD* records, DWORD max_records, DWORD* numEvents, DWORD timeout)
+{
+    MENU_SURFACE surface = _as_surface(hSource);
+    if (surface) return _surface_pop_events(surface, records, max_records, numEvents);
+
+    // a posting thread ends the wait early, the loop then applies its commands
+    HANDLE handles[2] = {hStdin, wakeup_event};
+    *numEvents = 0;
+    if (WaitForMultipleObjects(wakeup_event ? 2 : 1, handles, FALSE, timeout) != WAIT_OBJECT_0) return FALSE;
+    if (!GetNumberOfConsoleInputEvents(hStdin, numEvents)) return FALSE;
+    ReadConsoleInput(hStdin, records, min(max_records, *numEvents), numEvents);
+    return TRUE;
+}
+
+static void _wake_render_loop()
+{
+    if (wakeup_event) SetEvent(wakeup_event);
+}
+
+inline static void _set_cursor_position(HANDLE hBuffer, COORD pos)
+{
+    if (_as_surface(hBuffer)) _set_cursor_position_vt(hBuffer, pos);
+    else SetConsoleCursorPosition(hBuffer, pos);
+}
+
+inline static void _set_text_attribute(HANDLE hBuffer, WORD attribute)
+{
+    if (_as_surface(hBuffer)) _set_text_attribute_vt(hBuffer, attribute);
+    else SetConsoleTextAttribute(hBuffer, attribute);
+}
+#else
+static void _posix_signal_handler(int signal_number)
+{
+    int saved_errno = errno;
+    char byte = (char)signal_number;
+    if (write(posix_signal_pipe[1], &byte, 1) < 0) { /* pipe full, a wakeup is already pending */ }
+    errno = saved_errno;
+}
+
+// same pipe as SIGWINCH, the zero byte tells the two apart
+static void _wake_render_loop()
+{
+    char byte = POSIX_WAKEUP_BYTE;
+    if (posix_signal_pipe[1] == -1) return;
+    if (write(posix_signal_pipe[1], &byte, 1) < 0) { /* pipe full, a wakeup is already pending */ }
+}
+
+// only undoes what we actually changed, headless programs leave the tty untouched
+static void _posix_restore_terminal()
+{
+    if (posix_alternate_active)
+        {
+            _lwrite_string(hConsole, LEAVE_ALTERNATE_SCREEN);
+            _lwrite_string(hConsole, SHOW_CURSOR);
+        }
+    if (posix_input_blocked)
+        {
+            _lwrite_string(hConsole, MOUSE_TRACKING_OFF);
+            tcsetattr(STDIN_FILENO, TCSANOW, &posix_startup_mode);
+        }
+}
+
+// ctrl+c, kill and hangup: the terminal goes back to the user, then the signal does what it would have done
+static void _posix_fatal_signal_handler(int signal_number)
+{
+    _posix_restore_terminal();
+    signal(signal_number, SIG_DFL);
+    raise(signal_number); // delivered as soon as the handler returns
+}
+
+// ctrl+z: cooked mode and the normal screen while we are stopped
+static void _posix_suspend_handler(int signal_number)
+{
+    int saved_errno = errno;
+    sigset_t suspend;
+    (void)signal_number;
+
+    _posix_restore_terminal();
+    posix_screen_lost = FALSE; // set again by SIGCONT if we really were stopped
+    signal(SIGTSTP, SIG_DFL);
+    raise(SIGTSTP);
+    sigemptyset(&suspend);
+    sigaddset(&suspend, SIGTSTP);
+    pthread_sigmask(SIG_UNBLOCK, &suspend, NULL); // stops right here until SIGCONT
+
+    // an orphaned process group is never stopped, and then no SIGCONT comes either
+    _posix_catch_signal(SIGTSTP, _posix_suspend_handler, TRUE);
+    if (!posix_screen_lost) _posix_resume_handler(SIGCONT);
+    errno = saved_errno;
+}
+
+// fg (or SIGCONT after any stop): raw mode, mouse and screen the way we left them
+static void _posix_resume_handler(int signal_number)
+{
+    int saved_errno = errno;
+    if (posix_input_blocked)
+        {
+            tcsetattr(STDIN_FILENO, TCSANOW, &posix_raw_mode);
+            _lwrite_string(hConsole, MOUSE_TRACKING_ON);
+        }
+    if (posix_alternate_active)
+        {
+            _lwrite_string(hConsole, ENTER_ALTERNATE_SCREEN);
+            _toggle_cursor_vt(hConsole, posix_alternate_screen.cursor_visible);
+        }
+    posix_screen_lost = TRUE;
+    errno = saved_errno;
+    _posix_signal_handler(signal_number); // wakes the loop up like a resize
+}
+
+// signals the application handles (or ignores) itself are left alone
+static void _posix_catch_signal(int signal_number, void (*handler)(int), int replace)
+{
+    struct sigaction action, previous;
+
+    if (!replace && (sigaction(signal_number, NULL, &previous) != 0 || (previous.sa_flags & SA_SIGINFO) || previous.sa_handler != SIG_DFL)) return;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(signal_number, &action, NULL);
+}
+
+static void _init_posix_terminal()
+{
+    if (posix_signal_pipe[0] != -1) return; // already done
+
+    posix_tty_input = isatty(STDIN_FILENO);
+    if (posix_tty_input) tcgetattr(STDIN_FILENO, &posix_startup_mode);
+
+    // self-pipe so SIGWINCH (and posting threads) wake up the same poll() that waits for input
+    if (pipe(posix_signal_pipe) == 0)
+        {
+            fcntl(posix_signal_pipe[0], F_SETFL, fcntl(posix_signal_pipe[0], F_GETFL) | O_NONBLOCK);
+            fcntl(posix_signal_pipe[1], F_SETFL, fcntl(posix_signal_pipe[1], F_GETFL) | O_NONBLOCK);
+            fcntl(posix_signal_pipe[0], F_SETFD, FD_CLOEXEC);
+            fcntl(posix_signal_pipe[1], F_SETFD, FD_CLOEXEC);
+
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = _posix_signal_handler;
+            sigemptyset(&action.sa_mask);
+            action.sa_flags = SA_RESTART;
+            sigaction(SIGWINCH, &action, NULL);
+        }
+
+    // atexit handlers do not run when a signal ends the process
+    atexit(_posix_restore_terminal);
+    _posix_catch_signal(SIGINT, _posix_fatal_signal_handler, FALSE);
+    _posix_catch_signal(SIGTERM, _posix_fatal_signal_handler, FALSE);
+    _posix_catch_signal(SIGHUP, _posix_fatal_signal_handler, FALSE);
+    _posix_catch_signal(SIGTSTP, _posix_suspend_handler, FALSE);
+    _posix_catch_signal(SIGCONT, _posix_resume_handler, FALSE);
+}
+
+static COORD _get_console_size(HANDLE hBuffer)
+{
+    MENU_SURFACE surface = _as_surface(hBuffer);
+    if (surface) return surface->size;
+
+    struct winsize ws;
+    if (ioctl(((struct __posix_screen*)hBuffer)->fd, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0)
+        return (COORD)
+    {
+        ws.ws_col, ws.ws_row
+    };
+    return (COORD)
+    {
+        POSIX_DEFAULT_WIDTH, POSIX_DEFAULT_HEIGHT
+    };
+}
+
+inline static void _resize_screen_buffer(HANDLE hBuffer, COORD size)
+{
+    // the terminal owns its size, only surfaces follow the loop
+    MENU_SURFACE surface = _as_surface(hBuffer);
+    if (surface) _surface_resize(surface, size);
+}
+
+inline static void _close_screen_buffer(HANDLE hBuffer)
+{
+    // screens are static and surfaces belong to the caller, nothing to close
+}
+
+inline static void _flush_input()
+{
+    if (posix_tty_input) tcflush(STDIN_FILENO, TCIFLUSH);
+    posix_input_len = 0;
+}
+
+inline static void _set_cursor_position(HANDLE hBuffer, COORD pos)
+{
+    _set_cursor_position_vt(hBuffer, pos);
+}
+
+inline static void _set_text_attribute(HANDLE hBuffer, WORD attribute)
+{
+    _set_text_attribute_vt(hBuffer, attribute);
+}
+
+inline static void _fill_key_record(INPUT_RECORD* record, WORD vk, char ascii)
+{
+    memset(record, 0, sizeof(INPUT_RECORD));
+    record->EventType = KEY_EVENT;
+    record->Event.KeyEvent.bKeyDown = TRUE;
+    record->Event.KeyEvent.wRepeatCount = 1;
+    record->Event.KeyEvent.wVirtualKeyCode = vk;
+    record->Event.KeyEvent.uChar.AsciiChar = ascii;
+}
+
+// parses "\x1b[<b;x;yM" (sgr mouse), returns consumed bytes or 0 if incomplete
+static size_t _posix_decode_mouse(const unsigned char* p, size_t left, INPUT_RECORD* record)
+{
+    int values[3] = {0, 0, 0}, field = 0;
+    size_t i;
+
+    for (i = 3; i < left; i++)
+        {
+            unsigned char c = p[i];
+            if (c >= '0' && c <= '9') values[field] = values[field] * 10 + (c - '0');
+            else if (c == ';' && field < 2) field++;
+            else if (c == 'M' || c == 'm')
+                {
+                    int button = values[0];
+                    MOUSE_EVENT_RECORD* mouse = &record->Event.MouseEvent;
+
+                    memset(record, 0, sizeof(INPUT_RECORD));
+                    record->EventType = MOUSE_EVENT;
+                    mouse->dwMousePosition = (COORD)
+                    {
+                        values[1] - 1, values[2] - 1
+                    };
+
+                    if (button & 64)
+                        {
+                            // wheel, delta goes into the high word like on windows
+                            mouse->dwEventFlags = MOUSE_WHEELED;
+                            mouse->dwButtonState = (button & 1) ? 0xFF880000u : 0x00780000u;
+                        }
+                    else
+                        {
+                            if (button & 32) mouse->dwEventFlags = MOUSE_MOVED;
+                            if (c == 'M' && (button & 3) == 0) mouse->dwButtonState = FROM_LEFT_1ST_BUTTON_PRESSED;
+                        }
+                    return i + 1;
+                }
+            else return i + 1; // malformed, drop it
+        }
+    return 0;
+}
+
+// decodes one key/mouse sequence, returns consumed bytes or 0 if the sequence is incomplete
+static size_t _posix_decode_input(const unsigned char* p, size_t left, INPUT_RECORD* record)
+{
+    record->EventType = 0;
+
+    if (p[0] == 0x1b)
+        {
+            if (left == 1) return 0;
+            if (p[1] != '[' && p[1] != 'O')
+                {
+                    // alt+key or a lone escape followed by typing
+                    _fill_key_record(record, VK_ESCAPE, 0x1b);
+                    return 1;
+                }
+            if (left == 2) return 0;
+            if (p[1] == '[' && p[2] == '<') return _posix_decode_mouse(p, left, record);
+
+            size_t i;
+            int parameter = 0;
+            for (i = 2; i < left; i++)
+                {
+                    unsigned char c = p[i];
+                    if (c >= '0' && c <= '9') parameter = parameter * 10 + (c - '0');
+                    else if (c >= 0x40 && c <= 0x7E)
+                        {
+                            WORD vk = 0;
+                            switch (c)
+                                {
+                                    case 'A': vk = VK_UP; break;
+                                    case 'B': vk = VK_DOWN; break;
+                                    case 'C': vk = VK_RIGHT; break;
+                                    case 'D': vk = VK_LEFT; break;
+                                    case 'H': vk = VK_HOME; break;
+                                    case 'F': vk = VK_END; break;
+                                    case '~':
+                                        if (parameter == 3) vk = VK_DELETE;
+                                        else if (parameter == 5) vk = VK_PRIOR;
+                                        else if (parameter == 6) vk = VK_NEXT;
+                                        break;
+                                }
+                            if (vk) _fill_key_record(record, vk, 0);
+                            return i + 1;
+                        }
+                }
+            return 0;
+        }
+
+    switch (p[0])
+        {
+            case '\r':
+            case '\n':
+                _fill_key_record(record, VK_RETURN, '\r');
+                return 1;
+            case 0x7f:
+            case 0x08:
+                _fill_key_record(record, VK_BACK, 0x08);
+                return 1;
+            case '\t':
+                _fill_key_record(record, VK_TAB, '\t');
+                return 1;
+        }
+
+    if (p[0] >= 0x80)
+        {
+            // utf-8 text, consumed as one key without a virtual key code
+            size_t length = (p[0] >= 0xF0) ? 4 : (p[0] >= 0xE0) ? 3 : (p[0] >= 0xC0) ? 2 : 1;
+            if (length > left) return 0;
+            _fill_key_record(record, 0, 0);
+            return length;
+        }
+
+    // letters and digits share their ascii codes with the windows virtual keys
+    unsigned char c = p[0];
+    WORD vk = (c >= 'a' && c <= 'z') ? (WORD)(c - 'a' + 'A') : (WORD)c;
+    _fill_key_record(record, vk, (char)c);
+    return 1;
+}
+
+static DWORD _posix_parse_input(INPUT_RECORD* records, DWORD max_records, int flush_partial)
+{
+    DWORD count = 0;
+    size_t position = 0;
+
+    while (position < posix_input_len && count < max_records)
+        {
+            size_t used = _posix_decode_input(posix_input + position, posix_input_len - position, &records[count]);
+            if (used == 0)
+                {
+                    if (!flush_partial) break;
+                    // nothing else arrived, so a pending escape was the key itself
+                    if (posix_input[position] == 0x1b) _fill_key_record(&records[count], VK_ESCAPE, 0x1b);
+                    used = 1;
+                }
+            position += used;
+            if (records[count].EventType) count++;
+        }
+
+    posix_input_len -= position;
+    if (posix_input_len > 0) memmove(posix_input, posix_input + position, posix_input_len);
+    return count;
+}
+
+static int _posix_read_input()
+{
+    ssize_t result = read(STDIN_FILENO, posix_input + posix_input_len, POSIX_INPUT_CAPACITY - posix_input_len);
+    if (result > 0)
+        {
+            posix_input_len += (size_t)result;
+            return TRUE;
+        }
+    if (result == 0) posix_input_closed = TRUE;
+    return FALSE;
+}
+
+// one blocking poll per batch: stdin and the SIGWINCH/wakeup pipe
+static int _wait_input_events(HANDLE hSource, INPUT_RECORD* records, DWORD max_records, DWORD* numEvents, DWORD timeout)
+{
+    struct pollfd fds[2];
+    int resized = FALSE;
+
+    MENU_SURFACE surface = _as_surface(hSource);
+    if (surface) return _surface_pop_events(surface, records, max_records, numEvents);
+
+    *numEvents = 0;
+    if (posix_input_closed)
+        {
+            // stdin is gone, close the menu instead of spinning on it
+            _fill_key_record(&records[0], VK_ESCAPE, 0x1b);
+            *numEvents = 1;
+            return TRUE;
+        }
+
+    if (posix_input_len == 0)
+        {
+            fds[0] = (struct pollfd)
+            {
+                STDIN_FILENO, POLLIN, 0
+            };
+            fds[1] = (struct pollfd)
+            {
+                posix_signal_pipe[0], POLLIN, 0
+            };
+
+            if (poll(fds, 2, timeout >= INT_MAX ? -1 : (int)timeout) <= 0) return FALSE;
+
+            if (fds[1].revents & POLLIN)
+                {
+                    char drain[16];
+                    ssize_t amount;
+                    while ((amount = read(posix_signal_pipe[0], drain, sizeof(drain))) > 0)
+                        for (ssize_t i = 0; i < amount; i++)
+                            if (drain[i] != POSIX_WAKEUP_BYTE) resized = TRUE;
+                }
+            if (fds[0].revents & (POLLIN | POLLHUP)) _posix_read_input();
+        }
+
+    if (resized && max_records > 0)
+        {
+            memset(&records[0], 0, sizeof(INPUT_RECORD));
+            records[0].EventType = WINDOW_BUFFER_SIZE_EVENT;
+            records[0].Event.WindowBufferSizeEvent.dwSize = _get_console_size(hConsole);
+            *numEvents = 1;
+        }
+
+    *numEvents += _posix_parse_input(records + *numEvents, max_records - *numEvents, FALSE);
+
+    // an escape sequence was cut in half, give the rest a moment to arrive
+    if (*numEvents == 0 && posix_input_len > 0)
+        {
+            fds[0] = (struct pollfd)
+            {
+                STDIN_FILENO, POLLIN, 0
+            };
+            int more = poll(fds, 1, POSIX_ESCAPE_TIMEOUT) > 0 && _posix_read_input();
+            *numEvents = _posix_parse_input(records, max_records, !more);
+        }
+
+    return *numEvents > 0 || posix_input_closed;
+}
+#endif
+
+/* ----- Headless Surface ----- */
+inline static MENU_SURFACE _as_surface(HANDLE hBuffer)
+{
+    for (MENU_SURFACE surface = surfaces_list; surface; surface = surface->next)
+        if ((HANDLE)surface == hBuffer) return surface;
+    return NULL;
+}
+
+inline static SURFACE_CELL* _surface_cell(MENU_SURFACE surface, int x, int y)
+{
+    if (x < 0 || y < 0 || x >= surface->size.X || y >= surface->size.Y) return NULL;
+    return &surface->cells[(size_t)y * surface->size.X + x];
+}
+
+static void _surface_clear(MENU_SURFACE surface)
+{
+    size_t total = (size_t)surface->size.X * surface->size.Y;
+    for (size_t i = 0; i < total; i++)
+        {
+            memset(surface->cells[i].glyph, 0, sizeof(surface->cells[i].glyph));
+            surface->cells[i].glyph[0] = ' ';
+            surface->cells[i].style = 0;
+        }
+    surface->stats.clears++;
+}
+
+static void _surface_resize(MENU_SURFACE surface, COORD size)
+{
+    if (size.X <= 0 || size.Y <= 0) return;
+    if (size.X == surface->size.X && size.Y == surface->size.Y && surface->cells) return;
+
+    SURFACE_CELL* cells = (SURFACE_CELL*)_safe_malloc((size_t)size.X * size.Y * sizeof(SURFACE_CELL));
+    char* row_text = (char*)_safe_malloc((size_t)size.X * sizeof(((SURFACE_CELL*)0)->glyph) + 1);
+    if (!cells || !row_text)
+        {
+            free(cells);
+            free(row_text);
+            return;
+        }
+
+    free(surface->cells);
+    free(surface->row_text);
+    surface->cells = cells;
+    surface->row_text = row_text;
+    surface->size = size;
+    _surface_clear(surface);
+    surface->stats.clears--; // resizing is not a clear the renderer asked for
+}
+
+static void _surface_put_glyph(MENU_SURFACE surface, const char* glyph, size_t length)
+{
+    unsigned int code_point;
+    SURFACE_CELL* cell;
+    size_t used;
+
+    _decode_utf8((const unsigned char*)glyph, &code_point);
+    int width = _codepoint_width(code_point);
+
+    // zero width: glued to the glyph on the left like a terminal would
+    if (width == 0)
+        {
+            cell = _surface_cell(surface, surface->cursor.X - 1, surface->cursor.Y);
+            if (cell && !cell->glyph[0]) cell = _surface_cell(surface, surface->cursor.X - 2, surface->cursor.Y);
+            if (!cell) return;
+            for (used = 0; used < sizeof(cell->glyph) && cell->glyph[used]; used++);
+            if (used + length <= sizeof(cell->glyph)) memcpy(cell->glyph + used, glyph, length);
+            return;
+        }
+
+    cell = _surface_cell(surface, surface->cursor.X, surface->cursor.Y);
+    if (cell)
+        {
+            memset(cell->glyph, 0, sizeof(cell->glyph));
+            memcpy(cell->glyph, glyph, length);
+            cell->style = surface->style;
+        }
+
+    // the right half of a wide glyph stays empty, surface_get_row skips it
+    if (width == 2 && (cell = _surface_cell(surface, surface->cursor.X + 1, surface->cursor.Y)))
+        {
+            memset(cell->glyph, 0, sizeof(cell->glyph));
+            cell->style = surface->style;
+        }
+    surface->cursor.X += width;
+}
+
+// sgr parameters are folded into one number, enough to tell styled cells apart
+static void _surface_apply_sgr(MENU_SURFACE surface, const char* parameters, size_t length)
+{
+    size_t i = 0;
+    if (length == 0)
+        {
+            surface->style = 0;
+            return;
+        }
+
+    while (i < length)
+        {
+            size_t start = i;
+            while (i < length && parameters[i] != ';') i++;
+
+            if (i - start == 0 || (i - start == 1 && parameters[start] == '0')) surface->style = 0;
+            else
+                {
+                    unsigned int hash = surface->style ? surface->style : 2166136261u;
+                    for (size_t k = start; k < i; k++) hash = (hash ^ (unsigned char)parameters[k]) * 16777619u;
+                    hash = (hash ^ ';') * 16777619u;
+                    surface->style = hash ? hash : 1;
+                }
+            i++;
+        }
+}
+
+static void _surface_execute_csi(MENU_SURFACE surface, char final)
+{
+    const char* parameters = surface->sequence;
+    size_t length = surface->sequence_len;
+    int values[2] = {0, 0}, count = 0;
+
+    if (length > 0 && parameters[0] == '?')
+        {
+            // private modes, only cursor visibility matters to us
+            if (strncmp(parameters, "?25", length) == 0) surface->cursor_visible = (final == 'h');
+            return;
+        }
+
+    for (size_t i = 0; i < length && count < 2; i++)
+        {
+            if (parameters[i] >= '0' && parameters[i] <= '9') values[count] = values[count] * 10 + (parameters[i] - '0');
+            else if (parameters[i] == ';') count++;
+        }
+
+    switch (final)
+        {
+            case 'H':
+            case 'f':
+                surface->cursor.Y = (values[0] > 0 ? values[0] : 1) - 1;
+                surface->cursor.X = (values[1] > 0 ? values[1] : 1) - 1;
+                surface->stats.cursor_moves++;
+                break;
+            case 'J':
+                if (values[0] == 2) _surface_clear(surface);
+                break;
+            case 'K':
+                for (int x = surface->cursor.X; x < surface->size.X; x++)
+                    {
+                        SURFACE_CELL* cell = _surface_cell(surface, x, surface->cursor.Y);
+                        if (!cell) break;
+                        memset(cell->glyph, 0, sizeof(cell->glyph));
+                        cell->glyph[0] = ' ';
+                        cell->style = surface->style;
+                    }
+                break;
+            case 'm':
+                _surface_apply_sgr(surface, parameters, length);
+                break;
+        }
+}
+
+static void _surface_feed(MENU_SURFACE surface, unsigned char c)
+{
+    switch (surface->parser_state)
+        {
+            case SURFACE_ESCAPE:
+                surface->parser_state = (c == '[') ? SURFACE_CSI : SURFACE_GROUND;
+                surface->sequence_len = 0;
+                return;
+            case SURFACE_CSI:
+                if (c >= 0x40 && c <= 0x7E)
+                    {
+                        _surface_execute_csi(surface, (char)c);
+                        surface->parser_state = SURFACE_GROUND;
+                    }
+                else if (surface->sequence_len < SURFACE_SEQUENCE_CAPACITY)
+                    surface->sequence[surface->sequence_len++] = (char)c;
+                return;
+            case SURFACE_GROUND:
+                break;
+        }
+
+    if (surface->utf8_expected)
+        {
+            surface->utf8[surface->utf8_len++] = (char)c;
+            if (surface->utf8_len == surface->utf8_expected)
+                {
+                    _surface_put_glyph(surface, surface->utf8, surface->utf8_len);
+                    surface->utf8_expected = 0;
+                }
+            return;
+        }
+
+    switch (c)
+        {
+            case 0x1b:
+                surface->parser_state = SURFACE_ESCAPE;
+                return;
+            case '\r':
+                surface->cursor.X = 0;
+                return;
+            case '\n':
+                surface->cursor.X = 0;
+                surface->cursor.Y++;
+                return;
+        }
+
+    if (c >= 0xC0)
+        {
+            surface->utf8[0] = (char)c;
+            surface->utf8_len = 1;
+            surface->utf8_expected = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : 2;
+        }
+    else if (c >= 0x20)
+        _surface_put_glyph(surface, (const char*)&c, 1);
+}
+
+static void _surface_write(MENU_SURFACE surface, const char* data, size_t size)
+{
+    surface->stats.bytes_written += size;
+    surface->stats.write_calls++;
+
+    if (surface->recording)
+        {
+            if (surface->output_len + size > surface->output_capacity)
+                {
+                    size_t new_capacity = surface->output_capacity ? surface->output_capacity : SURFACE_OUTPUT_MIN;
+                    while (new_capacity < surface->output_len + size) new_capacity *= 2;
+                    char* new_output = (char*)_safe_realloc(surface->output, new_capacity);
+                    if (new_output)
+                        {
+                            surface->output = new_output;
+                            surface->output_capacity = new_capacity;
+                        }
+                }
+            if (surface->output_len + size <= surface->output_capacity)
+                {
+                    memcpy(surface->output + surface->output_len, data, size);
+                    surface->output_len += size;
+                }
+        }
+
+    for (size_t i = 0; i < size; i++)
+        _surface_feed(surface, (unsigned char)data[i]);
+}
+
+static void _surface_push_event(MENU_SURFACE surface, const INPUT_RECORD* record)
+{
+    if (surface->events_count == surface->events_capacity)
+        {
+            size_t new_capacity = surface->events_capacity ? surface->events_capacity * 2 : SURFACE_EVENTS_MIN;
+            INPUT_RECORD* new_events = (INPUT_RECORD*)_safe_malloc(new_capacity * sizeof(INPUT_RECORD));
+            if (!new_events) return;
+
+            // unroll the ring into the new block
+            for (size_t i = 0; i < surface->events_count; i++)
+                new_events[i] = surface->events[(surface->events_head + i) % surface->events_capacity];
+            free(surface->events);
+            surface->events = new_events;
+            surface->events_capacity = new_capacity;
+            surface->events_head = 0;
+        }
+
+    surface->events[(surface->events_head + surface->events_count) % surface->events_capacity] = *record;
+    surface->events_count++;
+}
+
+static int _surface_pop_events(MENU_SURFACE surface, INPUT_RECORD* records, DWORD max_records, DWORD* numEvents)
+{
+    *numEvents = 0;
+    if (surface->events_count == 0) return INPUT_EXHAUSTED;
+
+    while (*numEvents < max_records && surface->events_count > 0)
+        {
+            records[(*numEvents)++] = surface->events[surface->events_head];
+            surface->events_head = (surface->events_head + 1) % surface->events_capacity;
+            surface->events_count--;
+        }
+    return TRUE;
+}
+
+/* ----- Command Queue ----- */
+static struct __menu_command_queue* _create_command_queue()
+{
+    struct __menu_command_queue* queue = _safe_malloc(sizeof(struct __menu_command_queue));
+    if (!queue) return NULL;
+    queue->stub.next = NULL;
+    queue->head = queue->tail = &queue->stub;
+    queue->wakeup_pending = FALSE;
+    queue->producers = 0;
+    queue->closed = FALSE;
+    return queue;
+}
+
+static void _command_queue_push(struct __menu_command_queue* queue, struct __menu_command* command)
+{
+    command->next = NULL;
+    struct __menu_command* previous = MENU_ATOMIC_XCHG_PTR(&queue->head, command);
+    MENU_ATOMIC_STORE_PTR(&previous->next, command); // until this lands the consumer just sees a shorter queue
+}
+
+// consumer side, NULL when empty or when a producer is halfway through a push (its wakeup is still coming)
+static struct __menu_command* _command_queue_pop(struct __menu_command_queue* queue)
+{
+    struct __menu_command* tail = queue->tail;
+    struct __menu_command* next = MENU_ATOMIC_LOAD_PTR(&tail->next);
+
+    if (tail == &queue->stub)
+        {
+            if (!next) return NULL;
+            queue->tail = tail = next;
+            next = MENU_ATOMIC_LOAD_PTR(&tail->next);
+        }
+    if (next)
+        {
+            queue->tail = next;
+            return tail;
+        }
+    if (tail != MENU_ATOMIC_LOAD_PTR(&queue->head)) return NULL;
+
+    // tail is the last real node, put the stub behind it so it can be handed out
+    _command_queue_push(queue, &queue->stub);
+    next = MENU_ATOMIC_LOAD_PTR(&tail->next);
+    if (next)
+        {
+            queue->tail = next;
+            return tail;
+        }
+    return NULL;
+}
+
+inline static void _free_command(struct __menu_command* command)
+{
+    if (command->type == COMMAND_ADD_OPTION) _free_menu_item(command->item); // never made it into the menu
+    free(command->text);
+    free(command);
+}
+
+static void _destroy_command_queue(struct __menu_command_queue* queue)
+{
+    struct __menu_command* command;
+    if (!queue) return;
+    while ((command = _command_queue_pop(queue))) _free_command(command);
+    free(queue);
+}
+
+// clearing a menu refuses new posts and waits out the ones already pushing, then drops what is queued
+static void _close_command_queue(struct __menu_command_queue* queue)
+{
+    struct __menu_command* command;
+    if (!queue) return;
+
+    MENU_ATOMIC_XCHG_INT(&queue->closed, TRUE);
+    while (MENU_ATOMIC_ADD_INT(&queue->producers, 0)); // a push is a handful of instructions, nothing to sleep on
+    while ((command = _command_queue_pop(queue))) _free_command(command);
+}
+
+// safe from any thread, the render loop applies it between two event batches
+static int _post_command(MENU menu, int type, MENU_ITEM item, char* text, __menu_callback task, void* task_data)
+{
+    struct __menu_command_queue* queue = menu ? menu->commands : NULL;
+    if (!queue) return 1;
+
+    struct __menu_command* command = malloc(sizeof(struct __menu_command));
+    if (!command) return 1;
+    command->type = type;
+    command->item = item;
+    command->serial = item ? item->__serial : 0;
+    command->text = text;
+    command->task = task;
+    command->task_data = task_data;
+
+    // counted before the flag is read, so a clear either sees us or we see it
+    MENU_ATOMIC_ADD_INT(&queue->producers, 1);
+    if (MENU_ATOMIC_LOAD_INT(&queue->closed))
+        {
+            MENU_ATOMIC_ADD_INT(&queue->producers, -1);
+            free(command);
+            return 1;
+        }
+    _command_queue_push(queue, command);
+    if (!MENU_ATOMIC_XCHG_INT(&queue->wakeup_pending, TRUE)) _wake_render_loop();
+    MENU_ATOMIC_ADD_INT(&queue->producers, -1);
+    return 0;
+}
+
+// drains everything posted so far, returns TRUE if rows moved (or the menu is gone)
+static int _apply_menu_commands(MENU menu)
+{
+    struct __menu_command_queue* queue = menu->commands;
+    struct __menu_command* command;
+    MENU_ITEM item;
+    unsigned long long id = menu->__ID;
+    int changed = FALSE;
+
+    if (!queue) return FALSE;
+    MENU_ATOMIC_XCHG_INT(&queue->wakeup_pending, FALSE); // anything posted from now on wakes us again
+
+    // relabels only mark their row, anything that moves rows asks for a full redraw
+    int full_redraw = menu->full_redraw;
+    menu->full_redraw = FALSE;
+
+    while ((command = _command_queue_pop(queue)))
+        {
+            switch (command->type)
+                {
+                    case (COMMAND_ADD_OPTION):
+                        if (add_option(menu, command->item)) _free_menu_item(command->item);
+                        break;
+                    case (COMMAND_CLEAR_OPTION):
+                        // another thread may have removed it first, then its address may already hold a newer item
+                        if ((item = _find_option_by_serial(menu, command->serial))) _remove_option(menu, item); // an empty menu is closed after the batch
+                        break;
+                    case (COMMAND_OPTION_TEXT):
+                        if ((item = _find_option_by_serial(menu, command->serial))) _set_option_text(menu, item, command->text, strlen(command->text));
+                        else free(command->text);
+                        break;
+                    case (COMMAND_TASK):
+                        command->task(menu, command->task_data);
+                        if (!_find_menu_by_id(id))
+                            {
+                                free(command);
+                                return TRUE; // a task is free to clear its own menu
+                            }
+                        menu->need_redraw = TRUE;
+                        break;
+                }
+            free(command); // texts and items now belong to the menu
+        }
+
+    changed = menu->full_redraw;
+    menu->full_redraw |= full_redraw;
+    return changed;
+}
+
+static size_t _option_set_slot(unsigned long long serial, size_t mask)
+{
+    unsigned long long key = serial;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (size_t)key & mask;
+}
+
+static int _option_set_insert(struct __menu_item_set* set, MENU_ITEM item)
+{
+    // kept at most half full so the probes stay short
+    if ((set->used + 1) * 2 > set->mask + 1)
+        {
+            size_t capacity = (set->mask + 1) * 2;
+            MENU_ITEM* slots = calloc(capacity, sizeof(MENU_ITEM));
+            if (!slots) return FALSE;
+            for (size_t i = 0; i <= set->mask; i++)
+                if (set->slots[i])
+                    {
+                        size_t slot = _option_set_slot(set->slots[i]->__serial, capacity - 1);
+                        while (slots[slot]) slot = (slot + 1) & (capacity - 1);
+                        slots[slot] = set->slots[i];
+                    }
+            free(set->slots);
+            set->slots = slots;
+            set->mask = capacity - 1;
+        }
+
+    size_t slot = _option_set_slot(item->__serial, set->mask);
+    while (set->slots[slot])
+        {
+            if (set->slots[slot] == item) return TRUE;
+            slot = (slot + 1) & set->mask;
+        }
+    set->slots[slot] = item;
+    set->used++;
+    return TRUE;
+}
+
+static void _destroy_option_set(MENU menu)
+{
+    if (!menu->option_set) return;
+    free(menu->option_set->slots);
+    free(menu->option_set);
+    menu->option_set = NULL;
+}
+
+// the set only exists once something asked, from then on every add and remove keeps it current
+static void _option_set_added(MENU menu, MENU_ITEM item)
+{
+    if (!_option_set_insert(menu->option_set, item)) _destroy_option_set(menu); // the next check builds it again
+}
+
+static void _option_set_removed(MENU menu, MENU_ITEM item)
+{
+    struct __menu_item_set* set = menu->option_set;
+    size_t slot = _option_set_slot(item->__serial, set->mask);
+
+    while (set->slots[slot] != item)
+        {
+            if (!set->slots[slot]) return;
+            slot = (slot + 1) & set->mask;
+        }
+
+    // shift the rest of the run back so no lookup stops at the hole
+    size_t hole = slot;
+    for (;;)
+        {
+            slot = (slot + 1) & set->mask;
+            if (!set->slots[slot]) break;
+            size_t home = _option_set_slot(set->slots[slot]->__serial, set->mask);
+            if (((slot - home) & set->mask) >= ((slot - hole) & set->mask))
+                {
+                    set->slots[hole] = set->slots[slot];
+                    hole = slot;
+                }
+        }
+    set->slots[hole] = NULL;
+    set->used--;
+}
+
+// serials are never reused, a posted one finds its own item or nothing, whatever the address holds now
+static MENU_ITEM _find_option_by_serial(MENU menu, unsigned long long serial)
+{
+    if (!menu->option_set)
+        {
+            struct __menu_item_set* set = calloc(1, sizeof(struct __menu_item_set));
+            if (set) set->slots = calloc(16, sizeof(MENU_ITEM));
+            if (set && set->slots)
+                {
+                    set->mask = 15;
+                    menu->option_set = set;
+                    for (size_t i = 0; i < menu->count && menu->option_set; i++)
+                        _option_set_added(menu, menu->options[i]);
+                }
+            else if (set) free(set);
+        }
+
+    if (!menu->option_set)
+        {
+            // out of memory, the slow way still gives the right answer
+            for (size_t i = 0; i < menu->count; i++)
+                if (menu->options[i]->__serial == serial) return menu->options[i];
+            return NULL;
+        }
+
+    struct __menu_item_set* set = menu->option_set;
+    size_t slot = _option_set_slot(serial, set->mask);
+    while (set->slots[slot])
+        {
+            if (set->slots[slot]->__serial == serial) return set->slots[slot];
+            slot = (slot + 1) & set->mask;
+        }
+    return NULL;
+}
+
+static int _is_menu_option(MENU menu, MENU_ITEM item)
+{
+    return _find_option_by_serial(menu, item->__serial) == item;
+}
+
+/* ----- Async Callbacks ----- */
+static MENU_THREAD_RESULT _async_worker(void* argument)
+{
+    struct __menu_async_job* job;
+    (void)argument;
+
+    for (;;)
+        {
+            MENU_MUTEX_LOCK(&async_pool.lock);
+            while (!async_pool.pending_head) MENU_CONDITION_WAIT(&async_pool.work_ready, &async_pool.lock);
+            job = async_pool.pending_head;
+            async_pool.pending_head = job->next;
+            if (!async_pool.pending_head) async_pool.pending_tail = NULL;
+            MENU_MUTEX_UNLOCK(&async_pool.lock);
+
+            // only the callback, its data and the flag are touched here, everything else is the loop's
+            async_current_job = job;
+            if (!menu_callback_cancelled()) job->callback(job->menu, job->callback_data);
+            async_current_job = NULL;
+
+            _hand_back_async_job(job);
+            _wake_render_loop();
+        }
+    return 0;
+}
+
+static void _hand_back_async_job(struct __menu_async_job* job)
+{
+    MENU_MUTEX_LOCK(&async_pool.lock);
+    job->done = TRUE;
+    job->next = async_pool.finished;
+    async_pool.finished = job;
+    MENU_CONDITION_SIGNAL(&async_pool.job_done);
+    MENU_MUTEX_UNLOCK(&async_pool.lock);
+}
+
+static void _queue_async_job(struct __menu_async_job* job)
+{
+    job->next = NULL;
+    MENU_MUTEX_LOCK(&async_pool.lock);
+    if (async_pool.pending_tail) async_pool.pending_tail->next = job;
+    else async_pool.pending_head = job;
+    async_pool.pending_tail = job;
+    MENU_CONDITION_SIGNAL(&async_pool.work_ready);
+    MENU_MUTEX_UNLOCK(&async_pool.lock);
+}
+
+static int _start_async_pool()
+{
+    if (async_pool.workers) return TRUE;
+
+    MENU_MUTEX_INIT(&async_pool.lock);
+    MENU_CONDITION_INIT(&async_pool.work_ready);
+    MENU_CONDITION_INIT(&async_pool.job_done);
+    for (int i = 0; i < ASYNC_WORKER_COUNT; i++)
+        {
+#ifdef _WIN32
+            HANDLE thread = CreateThread(NULL, 0, _async_worker, NULL, 0, NULL);
+            if (!thread) break;
+            CloseHandle(thread);
+#else
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, _async_worker, NULL)) break;
+            pthread_detach(thread);
+#endif
+            async_pool.workers++;
+        }
+    return async_pool.workers > 0;
+}
+
+static void _async_timeout(MENU menu, void* job)
+{
+    _abandon_async_job(menu, (struct __menu_async_job*)job);
+}
+
+// hands the item's callback to the pool, the row shows a busy marker until it is done
+static int _start_async_callback(MENU menu, MENU_ITEM item)
+{
+    if (item->__job) return 1; // still running from the last time
+    if (!_start_async_pool()) return 1;
+
+    struct __menu_async_job* job = _safe_malloc(sizeof(struct __menu_async_job));
+    if (!job) return 1;
+    memset(job, 0, sizeof(struct __menu_async_job));
+    job->menu = menu;
+    job->menu_id = menu->__ID;
+    job->item = item;
+    job->callback = item->callback;
+    job->callback_data = item->data_chunk;
+    job->timeout = item->__async_timeout ? menu_add_timer(menu, item->__async_timeout, _async_timeout, job) : NULL;
+
+    item->__job = job;
+    _mark_option_dirty(menu, item);
+    _queue_async_job(job);
+    return 0;
+}
+
+// cancel or timeout: the row is free again right away, the worker finishes on its own time
+static void _abandon_async_job(MENU menu, struct __menu_async_job* job)
+{
+    MENU_ATOMIC_XCHG_INT(&job->cancelled, TRUE);
+    if (job->timeout)
+        {
+            menu_remove_timer(menu, job->timeout);
+            job->timeout = NULL;
+        }
+    if (job->item)
+        {
+            job->item->__job = NULL;
+            _mark_option_dirty(menu, job->item);
+            job->item = NULL;
+        }
+}
+
+// finished jobs of every menu, menus cleared by now are skipped
+static void _apply_async_completions()
+{
+    struct __menu_async_job *list, *job;
+    MENU menu;
+
+    if (!async_pool.workers) return;
+    MENU_MUTEX_LOCK(&async_pool.lock);
+    list = async_pool.finished;
+    async_pool.finished = NULL;
+    MENU_MUTEX_UNLOCK(&async_pool.lock);
+
+    while (list)
+        {
+            job = list;
+            list = list->next;
+            if (job->prefetch)
+                {
+                    async_pool.prefetching--;
+                    job->menu->__populating = NULL;
+                    if (job->submenu)
+                        {
+                            job->submenu->prefetch = NULL;
+                            job->submenu->populated = TRUE;
+                        }
+                    else if ((menu = _find_menu_anywhere(job->menu_id))) clear_menu(menu); // invalidated or its option is gone
+                }
+            // a closed menu still holds the marker and the timeout, only a cleared one took both with it
+            else if ((menu = _find_menu_anywhere(job->menu_id))) _abandon_async_job(menu, job);
+            free(job);
+        }
+}
+
+/* ----- Submenus ----- */
+// the child as populate left it, built right here unless a prefetch got there first
+static MENU _load_submenu(struct __menu_submenu* submenu)
+{
+    struct __menu_async_job *job = submenu->prefetch, **link, *previous = NULL;
+    MENU child;
+
+    if (job)
+        {
+            // a populate no worker picked up yet runs right here, a running one is waited for
+            MENU_MUTEX_LOCK(&async_pool.lock);
+            for (link = &async_pool.pending_head; *link && *link != job; link = &(*link)->next) previous = *link;
+            if (*link)
+                {
+                    *link = job->next;
+                    if (async_pool.pending_tail == job) async_pool.pending_tail = previous;
+                    MENU_MUTEX_UNLOCK(&async_pool.lock);
+                    job->callback(job->menu, job->callback_data);
+                    _hand_back_async_job(job);
+                }
+            else
+                {
+                    while (!job->done) MENU_CONDITION_WAIT(&async_pool.job_done, &async_pool.lock);
+                    MENU_MUTEX_UNLOCK(&async_pool.lock);
+                }
+            _apply_async_completions(); // marks it populated
+        }
+
+    child = _find_menu_anywhere(submenu->child_id);
+    if (!child)
+        {
+            child = create_menu();
+            if (!child) return NULL;
+            submenu->child_id = child->__ID;
+            submenu->populated = FALSE;
+        }
+    if (!submenu->populated)
+        {
+            if (child->count) clear_menu_options(child); // invalidated, rebuilt from scratch
+            submenu->populate(child, submenu->populate_data);
+            submenu->populated = TRUE;
+        }
+    return child;
+}
+
+// populate goes to the pool, the render loop keeps its hands off the child until the job is handed back
+static void _prefetch_submenu(struct __menu_submenu* submenu)
+{
+    struct __menu_async_job* job;
+    MENU child;
+
+    if (submenu->prefetch || async_pool.prefetching) return; // one at a time, the selection may have moved on by the next
+    child = _find_menu_anywhere(submenu->child_id);
+    if (child && (submenu->populated || child->session)) return;
+    if (!_start_async_pool()) return;
+
+    job = _safe_malloc(sizeof(struct __menu_async_job));
+    if (!job) return;
+    if (!child)
+        {
+            child = create_menu();
+            if (!child)
+                {
+                    free(job);
+                    return;
+                }
+            submenu->child_id = child->__ID;
+        }
+    else if (child->count) clear_menu_options(child);
+
+    memset(job, 0, sizeof(struct __menu_async_job));
+    job->menu = child;
+    job->menu_id = child->__ID;
+    job->callback = submenu->populate;
+    job->callback_data = submenu->populate_data;
+    job->prefetch = TRUE;
+    job->submenu = submenu;
+
+    submenu->prefetch = job;
+    child->__populating = job;
+    async_pool.prefetching++;
+    _queue_async_job(job);
+}
+
+// a running populate cannot be stopped halfway, its child is cleared once the job is handed back
+static void _orphan_prefetch(struct __menu_submenu* submenu)
+{
+    MENU_ATOMIC_XCHG_INT(&submenu->prefetch->cancelled, TRUE);
+    submenu->prefetch->submenu = NULL;
+    submenu->prefetch = NULL;
+    submenu->child_id = 0;
+}
+
+// the half filled child is an orphan from now on, cleared when the job is handed back
+static void _cancel_prefetch(struct __menu_async_job* job)
+{
+    if (job->submenu) _orphan_prefetch(job->submenu);
+    else MENU_ATOMIC_XCHG_INT(&job->cancelled, TRUE);
+}
+
+// cancelled, a populate nobody picked up yet never runs and a running one is waited for
+static void _finish_prefetch(struct __menu_async_job* job)
+{
+    struct __menu_async_job **link, *previous = NULL;
+
+    _cancel_prefetch(job);
+    MENU_MUTEX_LOCK(&async_pool.lock);
+    for (link = &async_pool.pending_head; *link && *link != job; link = &(*link)->next) previous = *link;
+    if (*link)
+        {
+            *link = job->next;
+            if (async_pool.pending_tail == job) async_pool.pending_tail = previous;
+            MENU_MUTEX_UNLOCK(&async_pool.lock);
+            _hand_back_async_job(job);
+            return;
+        }
+    while (!job->done) MENU_CONDITION_WAIT(&async_pool.job_done, &async_pool.lock);
+    MENU_MUTEX_UNLOCK(&async_pool.lock);
+}
+
+static void _release_submenu(struct __menu_submenu* submenu)
+{
+    MENU child;
+
+    if (submenu->prefetch) _orphan_prefetch(submenu);
+    else if ((child = _find_menu_anywhere(submenu->child_id))) clear_menu(child);
+    free(submenu);
+}
+
+// the child takes the screen over inside the same render loop, nothing is nested on the stack
+static int _open_submenu(MENU used_menu, MENU_ITEM item)
+{
+    MENU child = _load_submenu(item->__submenu);
+
+    if (!child || child->count == 0 || child->session) return FALSE; // nothing to show
+    if (!_find_menu_by_id(used_menu->session->saved_id)) return FALSE; // populate cleared the parent
+    if (used_menu->surface && child->surface != used_menu->surface) set_menu_surface(child, used_menu->surface);
+
+    child->__parent_menu = used_menu;
+    used_menu->__open_submenu = child;
+    _start_menu(child);
+    if (_begin_menu_session(child))
+        {
+            child->session->blocking = used_menu->session->blocking;
+            return TRUE;
+        }
+
+    _close_submenu(used_menu); // closed by its own first frame
+    return FALSE;
+}
+
+// the parent gets the screen back as it is now, the next frame repaints it whole
+static void _close_submenu(MENU used_menu)
+{
+    used_menu->__open_submenu->__parent_menu = NULL;
+    used_menu->__open_submenu = NULL;
+
+    used_menu->session->current_size = _get_console_size(used_menu->surface ? (HANDLE)used_menu->surface : hCurrent);
+    _setConsoleActiveScreenBuffer(used_menu->hBuffer);
+    _reset_mouse_state();
+    _invalidate_screen(used_menu);
+}
+
+// the open submenu gets the step, its parent draws nothing until it is closed again
+static int _submenu_step(MENU used_menu, DWORD timeout)
+{
+    struct __menu_session* session = used_menu->session;
+    MENU child = used_menu->__open_submenu;
+
+    // disabled from outside, every submenu above it closes too
+    if (!used_menu->running)
+        {
+            child->running = FALSE;
+            timeout = 0;
+        }
+    if (child->session && _menu_step(child, timeout)) return TRUE;
+
+    _close_submenu(used_menu);
+    if (used_menu->running && _find_menu_by_id(session->saved_id) && _menu_frame(used_menu)) return TRUE;
+    _end_menu_session(used_menu);
+    return FALSE;
+}
+
+/* ----- Timer Wheel ----- */
+static void _timer_insert(struct __menu_timer_wheel* wheel, struct __menu_timer* timer)
+{
+    unsigned long long place = timer->expires > wheel->now ? timer->expires : wheel->now;
+    int level = 0;
+
+    // past the top level a timer waits in its last slot and gets placed again once that one cascades
+    if (place - wheel->now >= TIMER_WHEEL_SPAN) place = wheel->now + TIMER_WHEEL_SPAN - 1;
+    while (level < TIMER_WHEEL_LEVELS - 1 && place - wheel->now >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) level++;
+
+    timer->level = level;
+    timer->slot = (int)((place >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1));
+
+    struct __menu_timer** head = &wheel->slots[level][timer->slot];
+    timer->next = *head;
+    if (timer->next) timer->next->link = &timer->next;
+    timer->link = head;
+    *head = timer;
+    wheel->occupied[level] |= 1ULL << timer->slot;
+}
+
+static void _timer_unlink(struct __menu_timer_wheel* wheel, struct __menu_timer* timer)
+{
+    *timer->link = timer->next;
+    if (timer->next) timer->next->link = timer->link;
+    if (!wheel->slots[timer->level][timer->slot]) wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+}
+
+static void _destroy_timer_wheel(struct __menu_timer_wheel* wheel)
+{
+    if (!wheel) return;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+            while (wheel->slots[level][slot])
+                {
+                    struct __menu_timer* timer = wheel->slots[level][slot];
+                    wheel->slots[level][slot] = timer->next;
+                    free(timer);
+                }
+    free(wheel->running); // the menu was cleared from inside a timer callback
+    free(wheel);
+}
+
+// first ms at which the wheel has something to do (fire a slot or cascade one), TIMER_NEVER when empty
+static unsigned long long _timer_wheel_next(struct __menu_timer_wheel* wheel)
+{
+    unsigned long long next = TIMER_NEVER, mask, window, when;
+    int level, shift, start, slot;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        {
+            mask = wheel->occupied[level];
+            if (!mask) continue;
+
+            // the first occupied slot after the current one, the bitmask is rotated so the search is one bit scan
+            shift = TIMER_WHEEL_BITS * level;
+            start = (int)(((wheel->now >> shift) + 1) & (TIMER_WHEEL_SLOTS - 1));
+            if (start) mask = (mask >> start) | (mask << (TIMER_WHEEL_SLOTS - start));
+            slot = (start + (int)_lowest_bit64(mask)) & (TIMER_WHEEL_SLOTS - 1);
+
+            window = 1ULL << (shift + TIMER_WHEEL_BITS);
+            when = (wheel->now & ~(window - 1)) + ((unsigned long long)slot << shift);
+            if (when <= wheel->now) when += window;
+            if (when < next) next = when;
+        }
+    return next;
+}
+
+// fires everything that is due, only occupied slots are visited no matter how long the loop slept
+// returns TRUE if rows moved (or the menu is gone)
+static int _run_timers(MENU menu)
+{
+    struct __menu_timer_wheel* wheel = menu->timers;
+    struct __menu_timer *timer, *list;
+    unsigned long long target, next, id = menu->__ID;
+    int level, shift, slot, full_redraw, changed;
+
+    if (!wheel || !wheel->count) return FALSE;
+
+    full_redraw = menu->full_redraw;
+    menu->full_redraw = FALSE;
+    target = (unsigned long long)(tick() * 1000.0);
+
+    while ((next = _timer_wheel_next(wheel)) <= target)
+        {
+            wheel->now = next;
+
+            // higher levels first, what they hand down may be due right now
+            for (level = TIMER_WHEEL_LEVELS - 1; level > 0; level--)
+                {
+                    shift = TIMER_WHEEL_BITS * level;
+                    if (next & ((1ULL << shift) - 1)) continue; // not a slot boundary of this level
+
+                    slot = (int)((next >> shift) & (TIMER_WHEEL_SLOTS - 1));
+                    list = wheel->slots[level][slot];
+                    wheel->slots[level][slot] = NULL;
+                    wheel->occupied[level] &= ~(1ULL << slot);
+                    while (list)
+                        {
+                            timer = list;
+                            list = list->next;
+                            _timer_insert(wheel, timer);
+                        }
+                }
+
+            slot = (int)(next & (TIMER_WHEEL_SLOTS - 1));
+            while ((timer = wheel->slots[0][slot]))
+                {
+                    _timer_unlink(wheel, timer);
+                    wheel->running = timer;
+                    wheel->running_removed = FALSE;
+                    timer->callback(menu, timer->callback_data);
+                    if (!_find_menu_anywhere(id)) return TRUE; // the callback cleared its menu, wheel included
+                    // only disabled, the timer goes back on the wheel and the step closes the menu afterwards
+                    wheel->running = NULL;
+
+                    if (wheel->running_removed)
+                        {
+                            free(timer);
+                            continue;
+                        }
+
+                    // periods missed while the menu was not running are skipped, not replayed
+                    timer->expires += timer->interval;
+                    if (timer->expires <= target) timer->expires = target + timer->interval;
+                    _timer_insert(wheel, timer);
+                }
+        }
+    wheel->now = target;
+
+    changed = menu->full_redraw;
+    menu->full_redraw |= full_redraw;
+    return changed;
+}
+
+// how long the loop may sleep before the wheel needs it again
+static DWORD _timer_delay(MENU menu)
+{
+    if (!menu->timers || !menu->timers->count) return UPDATE_FREQUENCE;
+
+    unsigned long long next = _timer_wheel_next(menu->timers);
+    unsigned long long now = (unsigned long long)(tick() * 1000.0);
+    if (next == TIMER_NEVER) return UPDATE_FREQUENCE;
+    if (next <= now) return 0;
+    return next - now < UPDATE_FREQUENCE ? (DWORD)(next - now) : UPDATE_FREQUENCE;
+}
+
+/* ----- Type-to-filter ----- */
+inline static unsigned char _fold_char(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c - 'A' + 'a') : c;
+}
+
+// letters and digits get a bit of their own, everything else shares the remaining ones
+inline static unsigned long long _char_bit(unsigned char c)
+{
+    if (c >= 'a' && c <= 'z') return 1ULL << (c - 'a');
+    if (c >= '0' && c <= '9') return 1ULL << (26 + c - '0');
+    return 1ULL << (36 + c % 28);
+}
+
+// folded text in, the key of the trigram starting there out
+inline static unsigned int _trigram_key(const unsigned char* p)
+{
+    return ((unsigned int)p[0] << 16) | ((unsigned int)p[1] << 8) | p[2];
+}
+
+// option at a position on screen: all options, or the matches of the typed query
+inline static MENU_ITEM _shown_option(MENU menu, size_t index)
+{
+    struct __menu_filter* filter = menu->filter;
+    struct __menu_filter_level* level;
+
+    if (!filter || !filter->length) return menu->options[index];
+    level = &filter->levels[filter->length - 1];
+    return filter->items[index < level->ranked ? level->shown[index] : level->ids[index]]; // the unranked tail is in option order
+}
+
+// matches found so far, see _filter_reach
+inline static size_t _shown_count(MENU menu)
+{
+    struct __menu_filter* filter = menu->filter;
+    return (filter && filter->length) ? filter->levels[filter->length - 1].count : menu->count;
+}
+
+// first occurrence of the query in the label, both are folded
+static const char* _filter_find(const char* text, size_t bytes, const char* query, size_t length)
+{
+    const char *p, *last;
+
+    if (length > bytes) return NULL;
+    for (p = text, last = text + bytes - length; p <= last; p++)
+        {
+            p = memchr(p, query[0], last - p + 1);
+            if (!p) return NULL;
+            if (!memcmp(p + 1, query + 1, length - 1)) return p;
+        }
+    return NULL;
+}
+
+inline static int _filter_match(const char* text, size_t bytes, const char* query, size_t length)
+{
+    return _filter_find(text, bytes, query, length) != NULL;
+}
+
+inline static int _filter_id_matches(struct __menu_filter* filter, unsigned int id, size_t length)
+{
+    return _filter_match(filter->text + filter->text_offsets[id], filter->text_lengths[id], filter->query, length);
+}
+
+// first position in ids (ascending) that is not below id
+static size_t _filter_position(const unsigned int* ids, size_t count, unsigned int id)
+{
+    size_t low = 0, high = count, middle;
+    while (low < high)
+        {
+            middle = low + (high - low) / 2;
+            if (ids[middle] < id) low = middle + 1;
+            else high = middle;
+        }
+    return low;
+}
+
+// word boundaries and camel humps are told apart on the original case
+inline static int _fuzzy_class(unsigned char c)
+{
+    if (c >= 'a' && c <= 'z') return 1;
+    if (c >= 'A' && c <= 'Z') return 2;
+    if (c >= '0' && c <= '9') return 3;
+    return c >= 0x80; // utf-8 bytes count as lower case letters, anything else separates words
+}
+
+inline static int _fuzzy_bonus(int previous, int current)
+{
+    if (!current) return 0;
+    if (!previous) return FUZZY_BONUS_BOUNDARY;
+    if ((previous == 1 && current == 2) || (previous != 3 && current == 3)) return FUZZY_BONUS_CAMEL;
+    return 0;
+}
+
+// fzf's v1 matcher: the leftmost match is tightened from its end and then scored, positions (if any) get the matched bytes
+static int _fuzzy_match(const char* text, const char* original, size_t bytes, const char* query, size_t length, int* score, size_t* positions)
+{
+    size_t start, stop = 0, i, q, last = 0;
+    int bonus, first_bonus = 0;
+
+    // labels are short, a plain loop beats a memchr call per query character
+    for (q = 0; q < length; q++, stop++)
+        {
+            while (stop < bytes && text[stop] != query[q]) stop++;
+            if (stop == bytes) return FALSE;
+        }
+
+    // walking back from the end finds the shortest window that still holds the query
+    start = stop - 1;
+    for (q = length - 1; q > 0; q--)
+        while (text[--start] != query[q - 1]);
+
+    // only the matched bytes and the ones before them are classified, a gap costs by its length
+    *score = 0;
+    for (i = start, q = 0; q < length; i++, q++)
+        {
+            while (text[i] != query[q]) i++;
+            bonus = _fuzzy_bonus(i ? _fuzzy_class((unsigned char)original[i - 1]) : 0, _fuzzy_class((unsigned char)original[i]));
+            if (q && i == last + 1)
+                {
+                    // a run keeps the bonus it started with
+                    if (bonus >= FUZZY_BONUS_BOUNDARY && bonus > first_bonus) first_bonus = bonus;
+                    if (bonus < first_bonus) bonus = first_bonus;
+                    if (bonus < FUZZY_BONUS_CONSECUTIVE) bonus = FUZZY_BONUS_CONSECUTIVE;
+                }
+            else
+                {
+                    if (q) *score -= FUZZY_GAP_START + (int)(i - last - 2) * FUZZY_GAP_EXTENSION;
+                    first_bonus = bonus;
+                }
+            *score += FUZZY_SCORE_MATCH + (q ? bonus : bonus * FUZZY_FIRST_MULTIPLIER);
+            if (positions) positions[q] = i;
+            last = i;
+        }
+    return TRUE;
+}
+
+// match test of whatever mode made the levels, only the fuzzy matcher sets score
+inline static int _filter_id_score(struct __menu_filter* filter, unsigned int id, size_t length, int* score)
+{
+    const char* text = filter->text + filter->text_offsets[id];
+
+    if (!filter->fuzzy) return _filter_id_matches(filter, id, length);
+    return _fuzzy_match(text, text + filter->text_lengths[id], filter->text_lengths[id], filter->query, length, score, NULL);
+}
+
+static int _filter_postings_grow(struct __menu_filter* filter)
+{
+    size_t new_capacity = filter->postings_capacity ? filter->postings_capacity * 2 : FILTER_POSTINGS_MIN;
+    struct __menu_posting* new_postings = _safe_malloc(new_capacity * sizeof(struct __menu_posting));
+    if (!new_postings) return 1;
+
+    for (size_t i = 0; i < filter->postings_capacity; i++)
+        if (filter->postings[i].key)
+            {
+                size_t slot = (filter->postings[i].key * 2654435761u) & (new_capacity - 1);
+                while (new_postings[slot].key) slot = (slot + 1) & (new_capacity - 1);
+                new_postings[slot] = filter->postings[i];
+            }
+    free(filter->postings);
+    filter->postings = new_postings;
+    filter->postings_capacity = new_capacity;
+    return 0;
+}
+
+// posting list of a trigram, NULL if no label has it (or a new list cant be made)
+static struct __menu_posting* _filter_posting(struct __menu_filter* filter, unsigned int key, int create)
+{
+    size_t slot;
+
+    // load factor stays under 3/4
+    if (create && (filter->postings_used + 1) * 4 > filter->postings_capacity * 3 && _filter_postings_grow(filter)) return NULL;
+    if (!filter->postings_capacity) return NULL;
+
+    slot = (key * 2654435761u) & (filter->postings_capacity - 1);
+    while (filter->postings[slot].key)
+        {
+            if (filter->postings[slot].key == key) return &filter->postings[slot];
+            slot = (slot + 1) & (filter->postings_capacity - 1);
+        }
+    if (!create) return NULL;
+
+    filter->postings[slot].key = key;
+    filter->postings_used++;
+    return &filter->postings[slot];
+}
+
+// ids come in ascending order while the index is built, only relabels land in the middle
+static int _posting_add(struct __menu_posting* posting, unsigned int id)
+{
+    size_t position = posting->count;
+
+    if (posting->count && posting->ids[posting->count - 1] >= id)
+        {
+            position = _filter_position(posting->ids, posting->count, id);
+            if (posting->ids[position] == id) return 0; // trigram repeated in the same label
+        }
+
+    if (posting->count == posting->capacity)
+        {
+            unsigned int new_capacity = posting->capacity ? posting->capacity * 2 : CAPACITY_STEP;
+            unsigned int* new_ids = _safe_realloc(posting->ids, new_capacity * sizeof(unsigned int));
+            if (!new_ids) return 1;
+            posting->ids = new_ids;
+            posting->capacity = new_capacity;
+        }
+    memmove(&posting->ids[position + 1], &posting->ids[position], (posting->count - position) * sizeof(unsigned int));
+    posting->ids[position] = id;
+    posting->count++;
+    return 0;
+}
+
+// folded and original copy of the label at the end of the text store, older copies of a relabeled item are left behind
+static int _filter_store_label(struct __menu_filter* filter, unsigned int id)
+{
+    MENU_ITEM item = filter->items[id];
+    size_t needed = filter->text_used + 2 * item->text_bytes;
+    unsigned long long mask = 0;
+    char* copy;
+
+    if (needed > filter->text_capacity)
+        {
+            size_t new_capacity = filter->text_capacity ? filter->text_capacity * 2 : ARENA_CHUNK_SIZE;
+            if (new_capacity < needed) new_capacity = needed;
+            char* new_text = _safe_realloc(filter->text, new_capacity);
+            if (!new_text) return 1;
+            filter->text = new_text;
+            filter->text_capacity = new_capacity;
+        }
+
+    copy = filter->text + filter->text_used;
+    for (size_t i = 0; i < item->text_bytes; i++)
+        {
+            copy[i] = (char)_fold_char((unsigned char)item->text[i]);
+            mask |= _char_bit((unsigned char)copy[i]);
+        }
+    memcpy(copy + item->text_bytes, item->text, item->text_bytes); // the fuzzy scores need the case
+    filter->text_offsets[id] = (unsigned int)filter->text_used;
+    filter->text_lengths[id] = (unsigned int)item->text_bytes;
+    filter->masks[id] = mask;
+    filter->text_used = needed;
+    filter->text_live += 2 * item->text_bytes;
+    return 0;
+}
+
+static int _filter_index_label(struct __menu_filter* filter, unsigned int id)
+{
+    const unsigned char* text = (const unsigned char*)filter->text + filter->text_offsets[id];
+    struct __menu_posting* posting;
+
+    for (size_t i = 0; i + 3 <= filter->text_lengths[id]; i++)
+        {
+            posting = _filter_posting(filter, _trigram_key(text + i), TRUE);
+            if (!posting || _posting_add(posting, id)) return 1;
+        }
+    return 0;
+}
+
+// gives the item the next id, ids grow with the option order since options are only ever appended
+static int _filter_register(struct __menu_filter* filter, MENU_ITEM item)
+{
+    unsigned int id;
+
+    if (filter->item_count == filter->item_capacity)
+        {
+            size_t new_capacity = filter->item_capacity ? filter->item_capacity * 2 : CAPACITY_MIN;
+            void* grown;
+
+            // the per id arrays grow together, the capacity only moves once all of them made it
+            if (!(grown = _safe_realloc(filter->items, new_capacity * sizeof(MENU_ITEM)))) return 1;
+            filter->items = grown;
+            if (!(grown = _safe_realloc(filter->text_offsets, new_capacity * sizeof(unsigned int)))) return 1;
+            filter->text_offsets = grown;
+            if (!(grown = _safe_realloc(filter->text_lengths, new_capacity * sizeof(unsigned int)))) return 1;
+            filter->text_lengths = grown;
+            if (!(grown = _safe_realloc(filter->masks, new_capacity * sizeof(unsigned long long)))) return 1;
+            filter->masks = grown;
+            filter->item_capacity = new_capacity;
+        }
+
+    id = (unsigned int)filter->item_count++;
+    item->__filter_id = id;
+    filter->items[id] = item;
+    return _filter_store_label(filter, id) || (filter->postings_kept && _filter_index_label(filter, id));
+}
+
+static void _filter_clear_postings(struct __menu_filter* filter)
+{
+    for (size_t i = 0; i < filter->postings_capacity; i++)
+        {
+            free(filter->postings[i].ids);
+            filter->postings[i].ids = NULL;
+            filter->postings[i].key = filter->postings[i].count = filter->postings[i].capacity = 0;
+        }
+    filter->postings_used = 0;
+    filter->postings_stale = FALSE;
+}
+
+// builds the trigram lists of the registered labels when substring matching starts, and frees them when it stops
+static int _filter_keep_postings(struct __menu_filter* filter, int keep)
+{
+    if (filter->postings_kept == keep) return 0;
+    filter->postings_kept = keep;
+    _filter_clear_postings(filter);
+    if (!keep)
+        {
+            free(filter->postings);
+            filter->postings = NULL;
+            filter->postings_capacity = 0;
+            return 0;
+        }
+
+    for (unsigned int id = 0; id < filter->item_count; id++)
+        if (filter->items[id] && _filter_index_label(filter, id)) return 1;
+    return 0;
+}
+
+// builds the index over the current options from scratch, levels made before keep their matches under the new ids
+static int _filter_index_options(struct __menu_filter* filter, MENU menu)
+{
+    unsigned int* renumbered;
+    unsigned int live = 0;
+    struct __menu_filter_level* level;
+
+    // the option order does not change, an id simply moves down by the dead ids below it and the levels stay ascending
+    if (filter->length)
+        {
+            renumbered = malloc((filter->item_count + 1) * sizeof(unsigned int));
+            if (!renumbered) return 1;
+            for (size_t i = 0; i < filter->item_count; i++)
+                {
+                    renumbered[i] = live;
+                    live += filter->items[i] != NULL;
+                }
+            renumbered[filter->item_count] = live;
+
+            for (size_t i = 0; i < filter->length; i++)
+                {
+                    level = &filter->levels[i];
+                    for (size_t j = 0; j < level->count; j++) level->ids[j] = renumbered[level->ids[j]];
+                    for (size_t j = 0; j < level->ranked; j++) level->shown[j] = renumbered[level->shown[j]];
+                    if (level->next != FILTER_ID_END) level->next = renumbered[level->next];
+                }
+            free(renumbered);
+        }
+
+    _filter_clear_postings(filter);
+    filter->item_count = 0;
+    filter->dead = 0;
+    filter->text_used = 0;
+    filter->text_live = 0;
+
+    for (size_t i = 0; i < menu->count; i++)
+        if (_filter_register(filter, menu->options[i])) return 1;
+    return 0;
+}
+
+inline static void _filter_free_level_arrays(struct __menu_filter_level* level)
+{
+    free(level->ids);
+    free(level->scores);
+    free(level->keys);
+    free(level->shown);
+}
+
+static void _filter_destroy(struct __menu_filter* filter)
+{
+    if (!filter) return;
+    for (size_t i = 0; i < filter->postings_capacity; i++)
+        free(filter->postings[i].ids);
+    for (size_t i = 0; i < filter->length; i++)
+        _filter_free_level_arrays(&filter->levels[i]);
+    free(filter->postings);
+    free(filter->items);
+    free(filter->text_offsets);
+    free(filter->text_lengths);
+    free(filter->masks);
+    free(filter->text);
+    free(filter);
+}
+
+// ids in [first, last) whose label has every character of the query, the masks are tested a vector at a time
+static size_t _filter_candidates(const unsigned long long* masks, size_t first, size_t last, unsigned long long mask, unsigned int* candidates)
+{
+    size_t id = first, amount = 0;
+    unsigned int hits;
+
+#if defined(MENU_SIMD_AVX2)
+    __m256i wanted4 = _mm256_set1_epi64x((long long)mask);
+    for (; id + 4 <= last; id += 4)
+        {
+            __m256i missing = _mm256_andnot_si256(_mm256_loadu_si256((const __m256i*)(masks + id)), wanted4);
+            hits = (unsigned int)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(missing, _mm256_setzero_si256())));
+            if (!hits) continue;
+            for (unsigned int i = 0; i < 4; i++)
+                {
+                    candidates[amount] = (unsigned int)(id + i);
+                    amount += (hits >> i) & 1;
+                }
+        }
+#endif
+#if defined(MENU_SIMD_AVX2) || defined(MENU_SIMD_SSE2)
+    // sse2 has no 64 bit compare, a mask matches when both of its halves do
+    __m128i wanted2 = _mm_set_epi32((int)(mask >> 32), (int)mask, (int)(mask >> 32), (int)mask);
+    for (; id + 2 <= last; id += 2)
+        {
+            __m128i missing = _mm_andnot_si128(_mm_loadu_si128((const __m128i*)(masks + id)), wanted2);
+            hits = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi32(missing, _mm_setzero_si128()));
+            if (!hits) continue;
+            candidates[amount] = (unsigned int)id;
+            amount += (hits & 0xFF) == 0xFF;
+            candidates[amount] = (unsigned int)(id + 1);
+            amount += (hits >> 8) == 0xFF;
+        }
+#else
+    (void)hits;
+#endif
+    for (; id < last; id++)
+        {
+            candidates[amount] = (unsigned int)id;
+            amount += (masks[id] & mask) == mask;
+        }
+    return amount;
+}
+
+// matches and scores one slice, the candidates are kept where the matches go since there are never fewer of them
+static void _fuzzy_scan(struct __menu_fuzzy_scan* scan)
+{
+    struct __menu_filter* filter = scan->filter;
+    struct __menu_filter_level* source = scan->source;
+    struct __menu_filter_level* result = scan->result;
+    unsigned int* candidates = result->ids + scan->first;
+    size_t amount = 0, i, at;
+    unsigned int id, position;
+    const char* text;
+    int score;
+
+    if (!source) amount = _filter_candidates(filter->masks, scan->first, scan->last, scan->mask, candidates);
+    else
+        for (i = scan->first; i < scan->last; i++)
+            {
+                candidates[amount] = (unsigned int)i;
+                amount += (filter->masks[source->ids[i]] & scan->mask) == scan->mask;
+            }
+
+    scan->count = 0;
+    for (i = 0; i < amount; i++)
+        {
+            position = candidates[i];
+            id = source ? source->ids[position] : position;
+            text = filter->text + filter->text_offsets[id];
+            if (!_fuzzy_match(text, text + filter->text_lengths[id], filter->text_lengths[id], filter->query, scan->length, &score, NULL)) continue;
+
+            at = scan->first + scan->count++;
+            result->ids[at] = id;
+            result->scores[at] = score;
+        }
+}
+
+static MENU_THREAD_RESULT _fuzzy_scan_worker(void* argument)
+{
+    _fuzzy_scan((struct __menu_fuzzy_scan*)argument);
+    return 0;
+}
+
+// fuzzy matches of the first level + 1 query characters, every label of the level below is scored again
+static int _fuzzy_compute_level(MENU menu, size_t level)
+{
+    struct __menu_filter* filter = menu->filter;
+    struct __menu_filter_level* result = &filter->levels[level];
+    struct __menu_filter_level* source = level ? &filter->levels[level - 1] : NULL;
+    struct __menu_fuzzy_scan scans[FILTER_THREADS_MAX];
+    int spawned[FILTER_THREADS_MAX];
+#ifdef _WIN32
+    HANDLE threads[FILTER_THREADS_MAX];
+#else
+    pthread_t threads[FILTER_THREADS_MAX];
+#endif
+    size_t total = source ? source->count : filter->item_count, slice;
+    unsigned long long mask = 0;
+    int amount = menu->menu_settings.filter_threads, i;
+
+    for (size_t j = 0; j <= level; j++) mask |= _char_bit((unsigned char)filter->query[j]);
+    result->ids = malloc((total + 1) * sizeof(unsigned int));
+    result->scores = malloc((total + 1) * sizeof(int));
+    if (!result->ids || !result->scores) goto failed;
+    result->capacity = total + 1;
+
+    // small sets are not worth a thread
+    if (amount > FILTER_THREADS_MAX) amount = FILTER_THREADS_MAX;
+    if (amount < 1 || total < FILTER_PARALLEL_MIN) amount = 1;
+    slice = total / amount + 1;
+    for (i = 0; i < amount; i++)
+        {
+            scans[i].filter = filter;
+            scans[i].source = source;
+            scans[i].result = result;
+            scans[i].mask = mask;
+            scans[i].length = level + 1;
+            scans[i].first = i * slice < total ? i * slice : total;
+            scans[i].last = scans[i].first + slice < total ? scans[i].first + slice : total;
+        }
+
+    // the first slice is scanned right here, so is every slice that did not get a thread
+    for (i = 1; i < amount; i++)
+        {
+#ifdef _WIN32
+            threads[i] = CreateThread(NULL, 0, _fuzzy_scan_worker, &scans[i], 0, NULL);
+            spawned[i] = threads[i] != NULL;
+#else
+            spawned[i] = !pthread_create(&threads[i], NULL, _fuzzy_scan_worker, &scans[i]);
+#endif
+            if (!spawned[i]) _fuzzy_scan(&scans[i]);
+        }
+    _fuzzy_scan(&scans[0]);
+
+    result->count = scans[0].count;
+    for (i = 1; i < amount; i++)
+        {
+            if (spawned[i])
+                {
+#ifdef _WIN32
+                    WaitForSingleObject(threads[i], INFINITE);
+                    CloseHandle(threads[i]);
+#else
+                    pthread_join(threads[i], NULL);
+#endif
+                }
+            memmove(&result->ids[result->count], &result->ids[scans[i].first], scans[i].count * sizeof(unsigned int));
+            memmove(&result->scores[result->count], &result->scores[scans[i].first], scans[i].count * sizeof(int));
+            result->count += scans[i].count;
+        }
+
+    // ranking gets its room now, so it can never fail halfway through a frame
+    result->next = FILTER_ID_END;
+    result->keys = malloc((result->count + 1) * sizeof(unsigned long long));
+    result->shown = malloc((result->count + 1) * sizeof(unsigned int));
+    if (result->keys && result->shown) return 0;
+
+failed:
+    _filter_free_level_arrays(result);
+    memset(result, 0, sizeof(struct __menu_filter_level));
+    return 1;
+}
+
+// higher scores first, then shorter labels, then the option order, every key of a level is unique
+inline static unsigned long long _fuzzy_key(int score, unsigned int bytes, size_t position)
+{
+    if (score < -(1 << 19)) score = -(1 << 19);
+    if (score >= (1 << 19)) score = (1 << 19) - 1;
+    if (bytes > 0xFFF) bytes = 0xFFF;
+    return ((unsigned long long)(score + (1 << 19)) << 44) | ((unsigned long long)(0xFFF - bytes) << 32) | (0xFFFFFFFFu - (unsigned int)position);
+}
+
+static int _compare_keys_descending(const void* a, const void* b)
+{
+    unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+    return (x < y) - (x > y);
+}
+
+// a min-heap over the front, the key at position grew and sinks to its place
+static void _sift_smallest(unsigned long long* keys, size_t amount, size_t position)
+{
+    unsigned long long key = keys[position];
+    size_t child;
+
+    while ((child = 2 * position + 1) < amount)
+        {
+            if (child + 1 < amount && keys[child + 1] < keys[child]) child++;
+            if (key <= keys[child]) break;
+            keys[position] = keys[child];
+            position = child;
+        }
+    keys[position] = key;
+}
+
+// partial selection (quickselect): the amount largest keys end up in front, in no particular order
+static void _select_largest(unsigned long long* keys, size_t count, size_t amount)
+{
+    ptrdiff_t low = 0, high = (ptrdiff_t)count - 1, target = (ptrdiff_t)amount - 1, i, j;
+    unsigned long long pivot, a, b, c, swap;
+
+    // a short front is kept as a heap instead, most keys cost one compare with its smallest one
+    if (amount && amount <= FUZZY_HEAP_MAX && amount * 16 <= count)
+        {
+            for (i = (ptrdiff_t)amount / 2; i-- > 0;) _sift_smallest(keys, amount, (size_t)i);
+            for (size_t k = amount; k < count; k++)
+                if (keys[k] > keys[0])
+                    {
+                        swap = keys[k];
+                        keys[k] = keys[0];
+                        keys[0] = swap;
+                        _sift_smallest(keys, amount, 0);
+                    }
+            return;
+        }
+
+    while (low < high)
+        {
+            // median of three, already ranked input does not go quadratic
+            a = keys[low];
+            b = keys[low + (high - low) / 2];
+            c = keys[high];
+            pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+
+            for (i = low, j = high; i <= j;)
+                {
+                    while (keys[i] > pivot) i++;
+                    while (keys[j] < pivot) j--;
+                    if (i <= j)
+                        {
+                            swap = keys[i];
+                            keys[i++] = keys[j];
+                            keys[j--] = swap;
+                        }
+                }
+            if (target <= j) high = j;
+            else if (target >= i) low = i;
+            else break;
+        }
+}
+
+// sorts the shown fuzzy matches up to position upto, nothing past what can be looked at is ranked
+static void _filter_rank(MENU menu, size_t upto)
+{
+    struct __menu_filter* filter = menu->filter;
+    struct __menu_filter_level* level;
+    size_t i;
+
+    if (!filter || !filter->fuzzy || !filter->length) return;
+    level = &filter->levels[filter->length - 1];
+
+    if (upto < FUZZY_RANK_MIN) upto = FUZZY_RANK_MIN;
+    if (upto > level->count) upto = level->count;
+    if (level->ranked && upto <= level->ranked) return;
+
+    if (!level->ranked)
+        for (i = 0; i < level->count; i++)
+            level->keys[i] = _fuzzy_key(level->scores[i], filter->text_lengths[level->ids[i]], i);
+    else if (upto < 2 * level->ranked) upto = 2 * level->ranked < level->count ? 2 * level->ranked : level->count; // scrolling on selects less often
+
+    if (upto < level->count) _select_largest(level->keys + level->ranked, level->count - level->ranked, upto - level->ranked);
+    qsort(level->keys + level->ranked, upto - level->ranked, sizeof(unsigned long long), _compare_keys_descending);
+    for (i = level->ranked; i < upto; i++)
+        level->shown[i] = level->ids[0xFFFFFFFFu - (unsigned int)level->keys[i]];
+    level->ranked = upto;
+}
+
+// the index cant follow the options anymore, the menu goes back to showing all of them
+static void _filter_drop(MENU menu)
+{
+    _filter_destroy(menu->filter);
+    menu->filter = NULL;
+    menu->selected_index = menu->count ? 0 : DISABLED;
+    menu->scroll_offset = 0;
+    menu->full_redraw = TRUE;
+    menu->need_redraw = TRUE;
+}
+
+static int _filter_level_reserve(struct __menu_filter_level* level, size_t amount)
+{
+    size_t new_capacity = level->capacity * 2 > amount ? level->capacity * 2 : amount;
+    unsigned int* grown;
+
+    if (amount <= level->capacity) return 0;
+    if (!(grown = _safe_realloc(level->ids, new_capacity * sizeof(unsigned int)))) return 1;
+    level->ids = grown;
+    level->capacity = new_capacity;
+    return 0;
+}
+
+// looks for more matches of a substring level until it holds want of them, is complete or has looked at budget ids
+static int _filter_extend(MENU menu, size_t index, size_t want, size_t* budget)
+{
+    struct __menu_filter* filter = menu->filter;
+    struct __menu_filter_level* level = &filter->levels[index];
+    struct __menu_filter_level* source = index ? &filter->levels[index - 1] : NULL;
+    struct __menu_posting* posting = NULL;
+    size_t length = index + 1, chunk = FILTER_SCAN_FIRST, size, first, last, i, j;
+    unsigned long long mask = 0;
+    unsigned int id;
+    int exact;
+
+    if (level->next == FILTER_ID_END || level->count >= want) return 0;
+    for (i = 0; i < length; i++) mask |= _char_bit((unsigned char)filter->query[i]);
+
+    // a label without the newest trigram cant match, no list at all means no match at all (looked up every time, adds move the lists)
+    if (length >= 3 && filter->postings_kept)
+        {
+            posting = _filter_posting(filter, _trigram_key((const unsigned char*)filter->query + length - 3), FALSE);
+            if (!posting)
+                {
+                    level->next = FILTER_ID_END;
+                    return 0;
+                }
+        }
+
+    // a letter or digit alone is answered by the masks and three characters by the trigram, the rest is checked on the folded copies
+    exact = (length == 1 && (mask & ((1ULL << 36) - 1))) || (length == 3 && posting && !filter->postings_stale);
+
+    while (level->count < want && level->next != FILTER_ID_END && *budget)
+        {
+            size = chunk < *budget ? chunk : *budget;
+            if (!source)
+                {
+                    first = level->next;
+                    last = first + size < filter->item_count ? first + size : filter->item_count;
+                    if (_filter_level_reserve(level, level->count + last - first + 1)) return 1;
+
+                    // exact answers are collected without branches, the slot after the last match is simply overwritten
+                    if (exact)
+                        for (id = (unsigned int)first; id < last; id++)
+                            {
+                                level->ids[level->count] = id;
+                                level->count += (filter->masks[id] & mask) == mask;
+                            }
+                    else
+                        for (id = (unsigned int)first; id < last; id++)
+                            if ((filter->masks[id] & mask) == mask && _filter_id_matches(filter, id, length)) level->ids[level->count++] = id;
+                    level->next = last == filter->item_count ? FILTER_ID_END : (unsigned int)last;
+                }
+            else if (posting && (source->next != FILTER_ID_END || posting->count < source->count))
+                {
+                    // fewer ids have the newest trigram than the level below holds (or it is not complete itself), they are checked on their own
+                    first = _filter_position(posting->ids, posting->count, level->next);
+                    last = first + size < posting->count ? first + size : posting->count;
+                    if (_filter_level_reserve(level, level->count + last - first + 1)) return 1;
+
+                    // removed items have no mask bits left
+                    if (exact)
+                        for (j = first; j < last; j++)
+                            {
+                                id = posting->ids[j];
+                                level->ids[level->count] = id;
+                                level->count += (filter->masks[id] & mask) == mask;
+                            }
+                    else
+                        for (j = first; j < last; j++)
+                            {
+                                id = posting->ids[j];
+                                if ((filter->masks[id] & mask) == mask && _filter_id_matches(filter, id, length)) level->ids[level->count++] = id;
+                            }
+                    level->next = last < posting->count ? posting->ids[last] : FILTER_ID_END;
+                }
+            else
+                {
+                    first = _filter_position(source->ids, source->count, level->next);
+                    if (first == source->count)
+                        {
+                            // everything the level below found is decided, it has to look further first
+                            level->next = source->next;
+                            if (source->next != FILTER_ID_END && _filter_extend(menu, index - 1, source->count + chunk, budget)) return 1;
+                            continue;
+                        }
+                    last = first + size < source->count ? first + size : source->count;
+                    if (_filter_level_reserve(level, level->count + last - first + 1)) return 1;
+
+                    // both lists are ascending, three characters are answered by walking them side by side
+                    if (posting && exact && posting->count <= 8 * source->count)
+                        {
+                            for (i = first, j = _filter_position(posting->ids, posting->count, source->ids[first]); i < last && j < posting->count;)
+                                {
+                                    id = source->ids[i];
+                                    level->ids[level->count] = id;
+                                    level->count += id == posting->ids[j];
+                                    i += id <= posting->ids[j];
+                                    j += id >= posting->ids[j];
+                                }
+                        }
+                    else
+                        {
+                            // a much longer list is slower to walk than the labels are to check
+                            for (i = first; i < last; i++)
+                                {
+                                    id = source->ids[i];
+                                    if ((filter->masks[id] & mask) == mask && _filter_id_matches(filter, id, length)) level->ids[level->count++] = id;
+                                }
+                        }
+                    level->next = last < source->count ? source->ids[last] : source->next;
+                }
+            *budget -= last - first;
+            if (chunk < FILTER_SCAN_CHUNK) chunk *= 2; // the first slices only look as far as a screen usually needs
+        }
+    return 0;
+}
+
+// the shown list holds at least upto matches unless there are fewer, returns how many it holds
+static size_t _filter_reach(MENU menu, size_t upto)
+{
+    struct __menu_filter* filter = menu->filter;
+    size_t budget = FILTER_UNLIMITED;
+
+    if (filter && filter->length && _filter_extend(menu, filter->length - 1, upto, &budget)) _filter_drop(menu);
+    return _shown_count(menu);
+}
+
+// a query typed over a long list leaves the rest of its matches to the following steps
+inline static int _filter_pending(MENU menu)
+{
+    return menu->filter && menu->filter->length && menu->filter->levels[menu->filter->length - 1].next != FILTER_ID_END;
+}
+
+// one more slice of the pending matches, TRUE once the count under the options is final
+static int _filter_continue(MENU menu)
+{
+    size_t budget = FILTER_STEP_BUDGET;
+
+    if (!_filter_pending(menu)) return FALSE;
+    if (_filter_extend(menu, menu->filter->length - 1, FILTER_UNLIMITED, &budget))
+        {
+            _filter_drop(menu);
+            return TRUE;
+        }
+    return !_filter_pending(menu);
+}
+
+// whatever the viewport, the page after it and the selection can reach is found (substring) or ranked (fuzzy) before it is drawn or picked
+static void _filter_rank_viewport(MENU menu)
+{
+    size_t page = (size_t)menu->viewport_rows * menu->layout_columns;
+    size_t upto = (size_t)menu->scroll_offset + page;
+
+    if (menu->selected_index >= 0 && (size_t)menu->selected_index >= upto) upto = (size_t)menu->selected_index + 1;
+    if (_filter_pending(menu)) _filter_reach(menu, upto + page); // arrows and page keys never run into the part not looked at yet
+    _filter_rank(menu, upto);
+}
+
+// where item is among the shown options, DISABLED if the query hides it
+static int _filter_shown_position(MENU menu, MENU_ITEM item)
+{
+    struct __menu_filter* filter = menu->filter;
+    struct __menu_filter_level* level;
+    size_t low = 0, high = menu->count, middle, budget = FILTER_UNLIMITED;
+
+    if (!filter->length)
+        {
+            while (low < high) // options are in id order as well
+                {
+                    middle = low + (high - low) / 2;
+                    if (menu->options[middle]->__filter_id < item->__filter_id) low = middle + 1;
+                    else high = middle;
+                }
+            return (low < menu->count && menu->options[low] == item) ? (int)low : DISABLED;
+        }
+
+    // the level has to get as far as the item first, one match at a time so it does not look much further
+    level = &filter->levels[filter->length - 1];
+    while (level->next != FILTER_ID_END && level->next <= item->__filter_id)
+        if (_filter_extend(menu, filter->length - 1, level->count + 1, &budget))
+            {
+                _filter_drop(menu);
+                return DISABLED;
+            }
+    low = _filter_position(level->ids, level->count, item->__filter_id);
+    return (low < level->count && filter->items[level->ids[low]] == item) ? (int)low : DISABLED;
+}
+
+// the option selected before the query changed stays selected if it is still shown, the first match otherwise
+static void _filter_select(MENU menu, MENU_ITEM previous)
+{
+    int position = DISABLED;
+
+    // fuzzy matches are ordered anew by every character, the best one is selected instead
+    if (previous && !(menu->filter->fuzzy && menu->filter->length)) position = _filter_shown_position(menu, previous);
+
+    if (position != DISABLED) menu->selected_index = position;
+    else menu->selected_index = _filter_reach(menu, 1) ? 0 : DISABLED;
+    menu->scroll_offset = 0;
+    _filter_rank_viewport(menu);
+    _scroll_to_selection(menu);
+    menu->full_redraw = TRUE;
+    menu->need_redraw = TRUE;
+}
+
+inline static MENU_ITEM _filter_selected_item(MENU menu)
+{
+    return (menu->selected_index >= 0 && (size_t)menu->selected_index < _shown_count(menu)) ? _shown_option(menu, menu->selected_index) : NULL;
+}
+
+// a new index over the current options, FALSE if there is no memory for it
+static int _filter_attach(MENU menu)
+{
+    struct __menu_filter* filter = _safe_malloc(sizeof(struct __menu_filter));
+
+    if (!filter) return FALSE;
+    filter->postings_kept = !menu->menu_settings.filter_fuzzy;
+    menu->filter = filter;
+    if (!_filter_index_options(filter, menu)) return TRUE;
+    _filter_destroy(filter);
+    menu->filter = NULL;
+    return FALSE;
+}
+
+// the index follows the settings: none while type-to-filter is off, trigram lists only while it matches substrings
+static void _filter_follow_settings(MENU menu)
+{
+    if (menu->menu_settings.filter_enabled)
+        {
+            if (!menu->filter)
+                {
+                    _filter_attach(menu); // without memory the first keystroke tries again
+                    return;
+                }
+            if (!_filter_keep_postings(menu->filter, !menu->menu_settings.filter_fuzzy)) return;
+        }
+    if (!menu->filter) return;
+
+    _filter_reset(menu); // the selection moves back to its option first
+    _filter_destroy(menu->filter);
+    menu->filter = NULL;
+}
+
+// typed character, TRUE if the query changed
+static int _filter_push(MENU menu, char c)
+{
+    struct __menu_filter* filter;
+    struct __menu_filter_level* level;
+    MENU_ITEM previous = _filter_selected_item(menu);
+
+    // the index comes with the menu, it is only missing after it ran out of memory
+    if (!menu->filter && !_filter_attach(menu)) return FALSE;
+    filter = menu->filter;
+    if (filter->length == FILTER_QUERY_MAX - 1) return FALSE;
+    if (!filter->length) filter->fuzzy = !!menu->menu_settings.filter_fuzzy;
+
+    filter->query[filter->length] = (char)_fold_char((unsigned char)c);
+    filter->query[filter->length + 1] = '\0';
+
+    // fuzzy levels are matched right away, substring levels start empty and are filled as far as somebody looks
+    level = &filter->levels[filter->length];
+    memset(level, 0, sizeof(struct __menu_filter_level));
+    if (filter->fuzzy && _fuzzy_compute_level(menu, filter->length))
+        {
+            filter->query[filter->length] = '\0';
+            return FALSE;
+        }
+    filter->length++;
+    _filter_select(menu, previous);
+    return TRUE;
+}
+
+inline static void _filter_free_level(struct __menu_filter* filter)
+{
+    struct __menu_filter_level* level = &filter->levels[--filter->length];
+
+    _filter_free_level_arrays(level);
+    memset(level, 0, sizeof(struct __menu_filter_level));
+    filter->query[filter->length] = '\0';
+}
+
+// backspace, the shorter query still has its results
+static int _filter_pop(MENU menu)
+{
+    MENU_ITEM previous = _filter_selected_item(menu);
+
+    if (!menu->filter || !menu->filter->length) return FALSE;
+    _filter_free_level(menu->filter);
+    _filter_select(menu, previous);
+    return TRUE;
+}
+
+// query gone, the index stays for the next one
+static void _filter_reset(MENU menu)
+{
+    MENU_ITEM previous = _filter_selected_item(menu);
+
+    if (!menu->filter || !menu->filter->length) return;
+    while (menu->filter->length) _filter_free_level(menu->filter);
+    _filter_select(menu, previous);
+}
+
+// the query is typed again once the matching mode changed
+static void _filter_requery(MENU menu)
+{
+    char query[FILTER_QUERY_MAX];
+
+    if (!menu->filter || !menu->filter->length || menu->filter->fuzzy == !!menu->menu_settings.filter_fuzzy) return;
+    memcpy(query, menu->filter->query, menu->filter->length + 1);
+    _filter_reset(menu);
+    set_menu_filter(menu, query);
+}
+
+// fuzzy levels are ranked again after a change, the selection stays on its option while that is among the ranked ones
+static void _fuzzy_reselect(MENU menu, MENU_ITEM previous)
+{
+    struct __menu_filter_level* level = &menu->filter->levels[menu->filter->length - 1];
+
+    _filter_rank_viewport(menu);
+    menu->selected_index = level->count ? 0 : DISABLED;
+    for (size_t i = 0; previous && i < level->ranked; i++)
+        if (menu->filter->items[level->shown[i]] == previous)
+            {
+                menu->selected_index = (int)i;
+                break;
+            }
+    _scroll_to_selection(menu);
+    menu->full_redraw = TRUE;
+}
+
+// puts the item into (or takes it out of) every level it should (not) be in, the selection stays on its option
+static int _filter_update_levels(MENU menu, MENU_ITEM item, int removed)
+{
+    struct __menu_filter* filter = menu->filter;
+    struct __menu_filter_level* level;
+    MENU_ITEM selected = _filter_selected_item(menu);
+    unsigned int id = item->__filter_id;
+    size_t position;
+    int present, matches, score = 0;
+    void* grown;
+
+    for (size_t i = 0; i < filter->length; i++)
+        {
+            level = &filter->levels[i];
+            if (id >= level->next) continue; // not looked at yet, the lazy scan decides once it gets there
+            position = _filter_position(level->ids, level->count, id);
+            present = position < level->count && level->ids[position] == id;
+            matches = !removed && _filter_id_score(filter, id, i + 1, &score);
+            if (present == matches)
+                {
+                    // a relabeled fuzzy match can move up or down
+                    if (present && filter->fuzzy && level->scores[position] != score)
+                        {
+                            level->scores[position] = score;
+                            level->ranked = 0;
+                        }
+                    continue;
+                }
+
+            if (present)
+                {
+                    level->count--;
+                    memmove(&level->ids[position], &level->ids[position + 1], (level->count - position) * sizeof(unsigned int));
+                    if (filter->fuzzy) memmove(&level->scores[position], &level->scores[position + 1], (level->count - position) * sizeof(int));
+                }
+            else
+                {
+                    if (_filter_level_reserve(level, level->count + 1)) return 1;
+                    if (filter->fuzzy)
+                        {
+                            if (!(grown = _safe_realloc(level->scores, (level->count + 1) * sizeof(int)))) return 1;
+                            level->scores = grown;
+                            if (!(grown = _safe_realloc(level->keys, (level->count + 1) * sizeof(unsigned long long)))) return 1;
+                            level->keys = grown;
+                            if (!(grown = _safe_realloc(level->shown, (level->count + 1) * sizeof(unsigned int)))) return 1;
+                            level->shown = grown;
+                            memmove(&level->scores[position + 1], &level->scores[position], (level->count - position) * sizeof(int));
+                            level->scores[position] = score;
+                        }
+                    memmove(&level->ids[position + 1], &level->ids[position], (level->count - position) * sizeof(unsigned int));
+                    level->ids[position] = id;
+                    level->count++;
+                }
+
+            if (filter->fuzzy) level->ranked = 0;
+            else if (i + 1 == filter->length)
+                {
+                    // same rule as for the options themselves
+                    if (present && menu->selected_index > (int)position) menu->selected_index--;
+                    else if (!present && menu->selected_index >= (int)position) menu->selected_index++;
+                    if (menu->selected_index >= (int)level->count) menu->selected_index = (int)level->count - 1;
+                    menu->full_redraw = TRUE;
+                }
+        }
+
+    if (filter->fuzzy && filter->length && !filter->levels[filter->length - 1].ranked) _fuzzy_reselect(menu, selected);
+    return 0;
+}
+
+static void _filter_option_added(MENU menu, MENU_ITEM item)
+{
+    if (_filter_register(menu->filter, item) || _filter_update_levels(menu, item, FALSE)) _filter_drop(menu);
+}
+
+static void _filter_option_removed(MENU menu, MENU_ITEM item)
+{
+    struct __menu_filter* filter = menu->filter;
+
+    if (_filter_update_levels(menu, item, TRUE))
+        {
+            _filter_drop(menu);
+            return;
+        }
+    filter->items[item->__filter_id] = NULL;
+    filter->masks[item->__filter_id] = 0; // ids left in the posting lists and not scanned yet never match again
+    filter->text_live -= 2 * filter->text_lengths[item->__filter_id];
+
+    // churn would otherwise grow the index forever
+    if (++filter->dead > CAPACITY_MIN && filter->dead * 2 > filter->item_count && _filter_index_options(filter, menu)) _filter_drop(menu);
+}
+
+static void _filter_option_relabeled(MENU menu, MENU_ITEM item)
+{
+    struct __menu_filter* filter = menu->filter;
+    unsigned int id = item->__filter_id;
+
+    // the old trigrams stay listed, only the trigram shortcut of _filter_extend has to stop trusting them
+    filter->postings_stale = filter->postings_kept;
+    filter->text_live -= 2 * filter->text_lengths[id];
+    if (_filter_store_label(filter, id) || (filter->postings_kept && _filter_index_label(filter, id)) || _filter_update_levels(menu, item, FALSE))
+        {
+            _filter_drop(menu);
+            return;
+        }
+
+    // every relabel leaves its old copy in the text store, a rebuild compacts it
+    if (filter->text_used > ARENA_CHUNK_SIZE && filter->text_used > 2 * filter->text_live && _filter_index_options(filter, menu)) _filter_drop(menu);
+}
+
+// byte offsets of the label characters the query matched, FALSE if it does not match
+static int _filter_positions(struct __menu_filter* filter, MENU_ITEM item, size_t* positions)
+{
+    const char* text = filter->text + filter->text_offsets[item->__filter_id];
+    size_t bytes = filter->text_lengths[item->__filter_id];
+    const char* found;
+    int score;
+
+    if (filter->fuzzy) return _fuzzy_match(text, text + bytes, bytes, filter->query, filter->length, &score, positions);
+
+    if (!(found = _filter_find(text, bytes, filter->query, filter->length))) return FALSE;
+    for (size_t i = 0; i < filter->length; i++) positions[i] = found - text + i;
+    return TRUE;
+}
+
+// matched characters switch between the plain and the option style, so they take the option color and lose it on the selected row
+static void _filter_highlight(MENU menu, COORD pos, MENU_ITEM item)
+{
+    struct __menu_filter* filter = menu->filter;
+    struct __menu_framebuffer* framebuffer = menu->framebuffer;
+    const unsigned char* text = (const unsigned char*)item->text;
+    size_t positions[FILTER_QUERY_MAX], next = 0, offset = 0, length;
+    unsigned int code_point;
+    int x = pos.X, width;
+    MENU_CELL* row;
+
+    if (!filter || !filter->length || pos.X < 0 || pos.Y < 0 || pos.Y >= framebuffer->size.Y) return;
+    if (!_filter_positions(filter, item, positions)) return;
+
+    // same walk as _put_text_cells, so a byte offset lands on the cell its character went to
+    row = framebuffer->back + (size_t)pos.Y * framebuffer->size.X;
+    while (next < filter->length && offset < item->text_bytes && x < framebuffer->size.X)
+        {
+            length = _decode_utf8(text + offset, &code_point);
+            width = _codepoint_width(code_point);
+            if (positions[next] < offset + length)
+                {
+                    for (int i = 0; i < width && x + i < framebuffer->size.X; i++) row[x + i].style ^= SELECTABLE_TYPE;
+                    while (next < filter->length && positions[next] < offset + length) next++;
+                }
+            x += width;
+            offset += length;
+        }
+}
+
+/* ----- Frame Buffer ----- */
+static struct __menu_framebuffer* _create_framebuffer()
+{
+    struct __menu_framebuffer* framebuffer = _safe_malloc(sizeof(struct __menu_framebuffer));
+    if (!framebuffer) return NULL;
+    framebuffer->size = zero_point;
+    framebuffer->front_valid = FALSE;
+    framebuffer->dirty_top = 0;
+    framebuffer->dirty_bottom = -1;
+    return framebuffer;
+}
+
+static void _destroy_framebuffer(struct __menu_framebuffer* framebuffer)
+{
+    if (!framebuffer) return;
+    free(framebuffer->back);
+    free(framebuffer->front);
+    free(framebuffer->output);
+    free(framebuffer);
+}
+
+/* ----- Render Buffer Pool ----- */
+// only shown menus hold a screen and a frame buffer, hidden ones cost nothing but their options
+static void _acquire_render_buffers(MENU menu)
+{
+    if (!menu->framebuffer)
+        {
+            menu->framebuffer = render_pool.framebuffer_count ? render_pool.framebuffers[--render_pool.framebuffer_count] : _create_framebuffer();
+            if (!menu->framebuffer)
+                {
+                    _lwrite_string(hConsoleError, "Fatal: Frame buffer allocation failed\n");
+                    exit(BAD_CALLOC);
+                }
+        }
+    _acquire_screen(menu);
+    _invalidate_screen(menu); // whatever the buffers hold was drawn for their last menu
+}
+
+static void _release_render_buffers(MENU menu)
+{
+    if (menu->framebuffer)
+        {
+            if (render_pool.framebuffer_count < RENDER_POOL_MAX) render_pool.framebuffers[render_pool.framebuffer_count++] = menu->framebuffer;
+            else _destroy_framebuffer(menu->framebuffer);
+            menu->framebuffer = NULL;
+        }
+    if (!menu->surface) _release_screen(menu); // a surface stays attached until the caller says otherwise
+}
+
+static void _acquire_screen(MENU menu)
+{
+    if (menu->hBuffer) return;
+    if (render_pool.screen_count) menu->hBuffer = render_pool.screens[--render_pool.screen_count];
+    else
+        {
+            menu->hBuffer = _createConsoleScreenBuffer();
+            _toggle_cursor(menu->hBuffer, FALSE);
+        }
+}
+
+static void _release_screen(MENU menu)
+{
+    if (menu->hBuffer && !menu->surface)
+        {
+            if (render_pool.screen_count < RENDER_POOL_MAX) render_pool.screens[render_pool.screen_count++] = menu->hBuffer;
+            else _close_screen_buffer(menu->hBuffer);
+        }
+    menu->hBuffer = NULL;
+}
+
+inline static void _blank_cells(MENU_CELL* cells, size_t amount)
+{
+    for (size_t i = 0; i < amount; i++)
+        {
+            cells[i].glyph[0] = ' ';
+            cells[i].length = 1;
+            cells[i].style = 0;
+        }
+}
+
+static void _resize_framebuffer(struct __menu_framebuffer* framebuffer, COORD size)
+{
+    if (size.X < 1) size.X = 1;
+    if (size.Y < 1) size.Y = 1;
+    if (framebuffer->back && framebuffer->size.X == size.X && framebuffer->size.Y == size.Y) return;
+
+    size_t amount = (size_t)size.X * size.Y;
+    MENU_CELL* back = _safe_malloc(amount * sizeof(MENU_CELL));
+    MENU_CELL* front = _safe_malloc(amount * sizeof(MENU_CELL));
+    if (!back || !front)
+        {
+            _lwrite_string(hConsoleError, "Fatal: Frame buffer allocation failed\n");
+            exit(BAD_CALLOC);
+        }
+
+    free(framebuffer->back);
+    free(framebuffer->front);
+    framebuffer->back = back;
+    framebuffer->front = front;
+    framebuffer->size = size;
+    framebuffer->front_valid = FALSE; // the terminal reflows on its own, nothing on screen can be trusted
+    _framebuffer_clear(framebuffer);
+}
+
+static void _framebuffer_clear(struct __menu_framebuffer* framebuffer)
+{
+    _blank_cells(framebuffer->back, (size_t)framebuffer->size.X * framebuffer->size.Y);
+    framebuffer->dirty_top = 0;
+    framebuffer->dirty_bottom = framebuffer->size.Y - 1;
+}
+
+// writes one utf-8 char per cell, anything past row_width is clipped
+static void _put_text_cells(MENU_CELL* row, int row_width, int x, const char* text, unsigned char style)
+{
+    const unsigned char* p = (const unsigned char*)text;
+    int width;
+    size_t length;
+    unsigned int code_point;
+
+    while (*p && x < row_width)
+        {
+            length = _decode_utf8(p, &code_point);
+            width = _codepoint_width(code_point);
+
+            if (width == 0)
+                {
+                    // combining marks ride along with the previous glyph while there is room
+                    int base = (x > 1 && !row[x - 1].length) ? x - 2 : x - 1;
+                    if (base >= 0 && row[base].length && row[base].length + length <= sizeof(row[base].glyph))
+                        {
+                            memcpy(row[base].glyph + row[base].length, p, length);
+                            row[base].length += (unsigned char)length;
+                        }
+                }
+            else if (width == 2 && x + 1 >= row_width) break; // half a wide char is worse than none
+            else
+                {
+                    if (x >= 0)
+                        {
+                            memcpy(row[x].glyph, p, length);
+                            row[x].length = (unsigned char)length;
+                            row[x].style = style;
+                        }
+                    if (width == 2 && x + 1 >= 0)
+                        {
+                            row[x + 1].length = 0; // covered by the wide glyph on its left
+                            row[x + 1].style = style;
+                        }
+                    x += width;
+                }
+            p += length;
+        }
+}
+
+static void _framebuffer_put_text(struct __menu_framebuffer* framebuffer, COORD pos, const char* text, unsigned char style)
+{
+    if (pos.Y < 0 || pos.Y >= framebuffer->size.Y) return;
+
+    _put_text_cells(framebuffer->back + (size_t)pos.Y * framebuffer->size.X, framebuffer->size.X, pos.X, text, style);
+
+    if (pos.Y < framebuffer->dirty_top) framebuffer->dirty_top = pos.Y;
+    if (pos.Y > framebuffer->dirty_bottom) framebuffer->dirty_bottom = pos.Y;
+}
+
+// decodes the label once, redraws of the option then only copy cells around
+static MENU_CELL* _item_cells(MENU_ITEM item)
+{
+    if (item->__cells || item->text_len <= 0) return item->__cells;
+
+    MENU_CELL* cells = _safe_malloc(2 * (size_t)item->text_len * sizeof(MENU_CELL));
+    if (!cells) return NULL;
+
+    _blank_cells(cells, item->text_len);
+    _put_text_cells(cells, item->text_len, 0, item->text, 0);
+    memcpy(cells + item->text_len, cells, item->text_len * sizeof(MENU_CELL));
+    for (int i = item->text_len; i < 2 * item->text_len; i++)
+        cells[i].style = SELECTABLE_TYPE;
+
+    item->__cells = cells;
+    return cells;
+}
+
+static void _framebuffer_put_option(struct __menu_framebuffer* framebuffer, COORD pos, MENU_ITEM item, int selected)
+{
+    if (pos.Y < 0 || pos.Y >= framebuffer->size.Y) return;
+
+    MENU_CELL* cells = _item_cells(item);
+    if (!cells || pos.X < 0)
+        {
+            // no cache (or nothing to cache), decode on the spot
+            _framebuffer_put_text(framebuffer, pos, item->text, selected ? SELECTABLE_TYPE : 0);
+            return;
+        }
+
+    int amount = item->text_len;
+    if (pos.X + amount > framebuffer->size.X) amount = framebuffer->size.X - pos.X;
+    if (amount <= 0) return;
+
+    MENU_CELL* row = framebuffer->back + (size_t)pos.Y * framebuffer->size.X + pos.X;
+    if (selected) cells += item->text_len;
+    memcpy(row, cells, amount * sizeof(MENU_CELL));
+
+    // a wide glyph cut in half by the right edge is dropped
+    if (amount < item->text_len && !cells[amount].length) _blank_cells(row + amount - 1, 1);
+
+    if (pos.Y < framebuffer->dirty_top) framebuffer->dirty_top = pos.Y;
+    if (pos.Y > framebuffer->dirty_bottom) framebuffer->dirty_bottom = pos.Y;
+}
+
+// an option row as it is shown right now, the characters matching a typed query stand out
+static void _put_shown_option(MENU menu, COORD pos, MENU_ITEM item, int selected)
+{
+    _framebuffer_put_option(menu->framebuffer, pos, item, selected);
+    _filter_highlight(menu, pos, item);
+}
+
+inline static int _cells_equal(const MENU_CELL* a, const MENU_CELL* b)
+{
+    return a->style == b->style && a->length == b->length && !memcmp(a->glyph, b->glyph, a->length);
+}
+
+static const char* _frame_style_sequence(MENU menu, unsigned char style)
+{
+    switch (style)
+        {
+            case (HEADER_TYPE):
+                return menu->color_object.headerColor.__rgb_seq;
+            case (FOOTER_TYPE):
+                return menu->color_object.footerColor.__rgb_seq;
+            case (SELECTABLE_TYPE):
+                return menu->color_object.optionColor.__rgb_seq;
+        }
+    return "";
+}
+
+static WORD _frame_style_attribute(MENU menu, unsigned char style)
+{
+    switch (style)
+        {
+            case (HEADER_TYPE):
+                return menu->legacy_color_object.headerColor;
+            case (FOOTER_TYPE):
+                return menu->legacy_color_object.footerColor;
+            case (SELECTABLE_TYPE):
+                return menu->legacy_color_object.optionColor;
+        }
+    return reset_color_attribute;
+}
+
+static void _frame_append(struct __menu_framebuffer* framebuffer, const char* data, size_t size)
+{
+    if (framebuffer->output_len + size > framebuffer->output_capacity)
+        {
+            size_t new_capacity = framebuffer->output_capacity ? framebuffer->output_capacity : FRAME_OUTPUT_MIN;
+            while (new_capacity < framebuffer->output_len + size) new_capacity *= 2;
+            char* new_output = _safe_realloc(framebuffer->output, new_capacity);
+            if (!new_output) exit(BAD_REALLOC);
+            framebuffer->output = new_output;
+            framebuffer->output_capacity = new_capacity;
+        }
+    memcpy(framebuffer->output + framebuffer->output_len, data, size);
+    framebuffer->output_len += size;
+}
+
+// one run of cells: a single cursor move followed by the glyphs, colors switched in between
+static void _frame_write_run_vt(MENU menu, COORD pos, const MENU_CELL* cells, int amount)
+{
+    struct __menu_framebuffer* framebuffer = menu->framebuffer;
+    char move[32];
+    int style = 0;
+
+    _frame_append(framebuffer, move, sprintf(move, "\x1b[%d;%dH", pos.Y + 1, pos.X + 1));
+    for (int i = 0; i < amount; i++)
+        {
+            if (cells[i].style != style)
+                {
+                    if (style) _frame_append(framebuffer, RESET_ALL_STYLES, sizeof(RESET_ALL_STYLES) - 1);
+                    style = cells[i].style;
+                    _frame_append(framebuffer, framebuffer->style_sequences[style], framebuffer->style_lengths[style]);
+                }
+            _frame_append(framebuffer, cells[i].glyph, cells[i].length);
+        }
+    if (style) _frame_append(framebuffer, RESET_ALL_STYLES, sizeof(RESET_ALL_STYLES) - 1);
+}
+
+// legacy consoles take attributes out of band, so every style change is its own write
+static void _frame_write_run_legacy(MENU menu, COORD pos, const MENU_CELL* cells, int amount)
+{
+    char chunk[FRAME_CHUNK_CAPACITY];
+    size_t length;
+    int i = 0, start;
+    unsigned char style;
+
+    while (i < amount)
+        {
+            start = i;
+            style = cells[i].style;
+            length = 0;
+            while (i < amount && cells[i].style == style && length + sizeof(cells[i].glyph) <= FRAME_CHUNK_CAPACITY)
+                {
+                    memcpy(chunk + length, cells[i].glyph, cells[i].length);
+                    length += cells[i].length;
+                    i++;
+                }
+            _set_cursor_position(menu->hBuffer, (COORD){pos.X + start, pos.Y});
+            if (style) _set_text_attribute(menu->hBuffer, _frame_style_attribute(menu, style));
+            _write_bytes(menu->hBuffer, chunk, length);
+            if (style) _set_text_attribute(menu->hBuffer, reset_color_attribute);
+            menu->framebuffer->frame_writes += style ? 4 : 2;
+            menu->frame_stats.last_frame_bytes += length;
+        }
+}
+
+// diffs back against front and puts only the changed runs on the screen
+static void _framebuffer_flush(MENU menu)
+{
+    struct __menu_framebuffer* framebuffer = menu->framebuffer;
+    int width = framebuffer->size.X;
+    int x, y, start, end, gap;
+    MENU_CELL *back, *front;
+
+    int use_vt100 = vt100_support && (menu->menu_settings.force_legacy_mode ^ 1);
+    void (*write_run)(MENU, COORD, const MENU_CELL*, int) = use_vt100
+            ? _frame_write_run_vt
+            : _frame_write_run_legacy;
+
+    framebuffer->output_len = 0;
+    framebuffer->frame_writes = 0;
+    menu->frame_stats.last_frame_bytes = 0;
+
+    // colors can change between frames, but not within one
+    for (int style = 0; style < ERROR_TYPE; style++)
+        {
+            framebuffer->style_sequences[style] = _frame_style_sequence(menu, style);
+            framebuffer->style_lengths[style] = strlen(framebuffer->style_sequences[style]);
+        }
+
+    if (!framebuffer->front_valid)
+        {
+            // unknown screen, start from a blank one and diff against that
+            if (use_vt100) _frame_append(framebuffer, CLEAR_SCREEN CLEAR_SCROLL_BUFFER RESET_MOUSE_POSITION,
+                                             sizeof(CLEAR_SCREEN CLEAR_SCROLL_BUFFER RESET_MOUSE_POSITION) - 1);
+            else
+                {
+                    _clear_buffer_func(menu->hBuffer);
+                    framebuffer->frame_writes++;
+                }
+            _blank_cells(framebuffer->front, (size_t)width * framebuffer->size.Y);
+            framebuffer->front_valid = TRUE;
+            framebuffer->dirty_top = 0;
+            framebuffer->dirty_bottom = framebuffer->size.Y - 1;
+        }
+
+    for (y = framebuffer->dirty_top; y <= framebuffer->dirty_bottom; y++)
+        {
+            back = framebuffer->back + (size_t)y * width;
+            front = framebuffer->front + (size_t)y * width;
+            x = 0;
+            while (x < width)
+                {
+                    if (_cells_equal(&back[x], &front[x]))
+                        {
+                            x++;
+                            continue;
+                        }
+
+                    // extend the run over short equal gaps, one cursor move costs more than a few glyphs
+                    start = end = x;
+                    for (x++, gap = 0; x < width && gap <= FRAME_RUN_GAP; x++)
+                        {
+                            if (_cells_equal(&back[x], &front[x])) gap++;
+                            else
+                                {
+                                    end = x;
+                                    gap = 0;
+                                }
+                        }
+                    x = end + 1;
+
+                    write_run(menu, (COORD){start, y}, back + start, end - start + 1);
+                    memcpy(front + start, back + start, (end - start + 1) * sizeof(MENU_CELL));
+                }
+        }
+
+    framebuffer->dirty_top = framebuffer->size.Y;
+    framebuffer->dirty_bottom = -1;
+
+    // the whole vt frame goes out in a single write
+    if (framebuffer->output_len)
+        {
+            _write_bytes(menu->hBuffer, framebuffer->output, framebuffer->output_len);
+            menu->frame_stats.last_frame_bytes = framebuffer->output_len;
+            framebuffer->frame_writes++;
+        }
+
+    menu->last_frame = tick();
+    menu->frame_stats.frames++;
+    menu->frame_stats.last_frame_writes = framebuffer->frame_writes;
+    menu->frame_stats.total_bytes += menu->frame_stats.last_frame_bytes;
+    menu->frame_stats.total_writes += framebuffer->frame_writes;
 }
 
-inline static void _reset_mouse_state()
+// the menu screen was drawn over by someone else, next frame has to be a complete one
+inline static void _invalidate_screen(MENU menu)
 {
-    SendInput(1, &input, sizeof(INPUT));
+    menu->full_redraw = TRUE;
+    menu->need_redraw = TRUE;
+    if (menu->framebuffer) menu->framebuffer->front_valid = FALSE;
 }
 
 /* ----- Error Handling ----- */
@@ -1108,24 +6034,25 @@ static void _show_error_and_wait_extended(MENU menu)
     menu->need_redraw = TRUE;
 
     // size intitialization
-    GetConsoleScreenBufferInfo(menu->hBuffer[menu->active_buffer], &hBack_csbi);
-    SMALL_RECT cr_window = hBack_csbi.srWindow;
-    COORD current_size = (COORD)
-    {
-        cr_window.Right - cr_window.Left + 1, cr_window.Bottom - cr_window.Top + 1
-    }, menu_size = menu->menu_size;
+    COORD current_size = _get_console_size(menu->hBuffer),
+          menu_size = menu->menu_size;
 
     // function variables pre-define
     INPUT_RECORD inputRecords[EVENT_MAX_RECORDS];
-    int running, event_running;
-    DWORD objectWait, k, numEvents, oldMode;
+    int running, event_running, waitResult;
+    DWORD k, numEvents;
+    CONSOLE_INPUT_MODE oldMode;
+
+    // headless menus show the error on their own surface
+    if (!menu->surface && !_hError) _init_hError();
+    HANDLE hErrorBuffer = menu->surface ? (HANDLE)menu->surface : _hError;
 
     // error message intialization
     char error_message[BUFFER_CAPACITY];
     sprintf(error_message, ERROR_MESSAGE1, menu_size.X, menu_size.Y);
     strcat(error_message, ERROR_MESSAGE2);
     MENU_RENDER_UNIT errormsg_render_unit;
-    MENU_RENDER_ARGUMENT rargument = _create_render_argument(HANDLE_TYPE, (void*)_hError);
+    MENU_RENDER_ARGUMENT rargument = _create_render_argument(HANDLE_TYPE, (void*)hErrorBuffer);
 
     // pre-start calls
     _block_input(&oldMode);
@@ -1135,10 +6062,12 @@ static void _show_error_and_wait_extended(MENU menu)
     errormsg_render_unit = _create_render_unit(TBUFFER, ERROR_TYPE, NULL);
     _draw_render_unit_legacy(rargument, zero_point, &errormsg_render_unit);
 
-    _setConsoleActiveScreenBuffer(_hError);
+    _setConsoleActiveScreenBuffer(hErrorBuffer);
 
-    FlushConsoleInputBuffer(hStdin);
-    SetConsoleScreenBufferSize(_hError, menu_size);
+    _flush_input();
+#ifdef _WIN32
+    if (!menu->surface) SetConsoleScreenBufferSize(_hError, menu_size);
+#endif
 
     running = TRUE;
     while (running)
@@ -1146,11 +6075,10 @@ static void _show_error_and_wait_extended(MENU menu)
             // some stuff is going on here!
         error_wait_start:
             ;
-            objectWait = WaitForSingleObject(hStdin, UPDATE_FREQUENCE);
-            if (objectWait == WAIT_OBJECT_0)
+            waitResult = _wait_input_events(hErrorBuffer, inputRecords, EVENT_MAX_RECORDS, &numEvents, UPDATE_FREQUENCE);
+            if (waitResult == INPUT_EXHAUSTED) running = FALSE;
+            else if (waitResult)
                 {
-                    GetNumberOfConsoleInputEvents(hStdin, &numEvents);
-                    ReadConsoleInput(hStdin, inputRecords, min(EVENT_MAX_RECORDS, numEvents), &numEvents);
                     event_running = TRUE;
                     for (k = 0; k < numEvents && event_running; k++)
                         switch(inputRecords[k].EventType)
@@ -1166,7 +6094,7 @@ static void _show_error_and_wait_extended(MENU menu)
                     if (current_size.X >= menu_size.X && current_size.Y >= menu_size.Y) running = FALSE;
                     else
                         {
-                            _clear_buffer_func(_hError);
+                            _clear_buffer_func(hErrorBuffer);
                             memset(TBUFFER, '\0', BUFFER_CAPACITY);
                             sprintf(TBUFFER, error_message, current_size.X, current_size.Y);
                             errormsg_render_unit.text = TBUFFER;
@@ -1175,12 +6103,16 @@ static void _show_error_and_wait_extended(MENU menu)
                 }
         }
 
-    _clear_buffer_func(_hError);
+    _clear_buffer_func(hErrorBuffer);
 
-    FlushConsoleInputBuffer(hStdin);
+    _flush_input();
+    _restore_input(&oldMode);
     _reset_mouse_state();
-    _setConsoleActiveScreenBuffer(menu->hBuffer[menu->active_buffer]);
+    _setConsoleActiveScreenBuffer(menu->hBuffer);
     cached_size = current_size;
+
+    // the error text was drawn over the menu if both share one screen
+    if (!SCREEN_BUFFERS_PERSIST || menu->surface) _invalidate_screen(menu);
 }
 
 /* ----- Main Rendering Loop ----- */
@@ -1203,14 +6135,158 @@ inline static MENU_RENDER_ARGUMENT _create_render_argument(enum RenderArgumentTa
     return new_argument;
 }
 
+inline static int _menu_chrome_rows(MENU menu)
+{
+    // top/bottom borders plus header and footer with their blank lines
+    return 2 + (menu->menu_settings.header_enabled ? 2 : 0) + (menu->menu_settings.footer_enabled ? 2 : 0);
+}
+
+// columns that fit the console and the hit index over them, only redone after a resize or option changes
+static void _layout_options(MENU menu, COORD current_size)
+{
+    int columns = 1, cell_width, stride, width;
+
+    if (!menu->layout_dirty && menu->layout_console_width == current_size.X) return;
+
+    // list mode is a grid with a single slot as wide as the menu
+    cell_width = menu->menu_size.X - 4;
+    width = menu->menu_size.X;
+    if (menu->menu_settings.grid_layout && menu->max_option_width > 0)
+        {
+            stride = (int)menu->max_option_width + GRID_COLUMN_GAP;
+            columns = (current_size.X - 4 + GRID_COLUMN_GAP) / stride;
+            if (columns > (int)menu->count) columns = (int)menu->count;
+            if (columns > 1)
+                {
+                    cell_width = (int)menu->max_option_width;
+                    if (columns * stride - GRID_COLUMN_GAP + 4 > width) width = columns * stride - GRID_COLUMN_GAP + 4;
+                }
+            else columns = 1;
+        }
+    if (cell_width < 1) cell_width = 1;
+
+    if ((size_t)width > menu->hit_columns_capacity)
+        {
+            short* new_hit = _safe_realloc(menu->hit_columns, width * sizeof(short));
+            if (!new_hit) return; // keep the old layout, we try again next frame
+            menu->hit_columns = new_hit;
+            menu->hit_columns_capacity = width;
+        }
+    stride = cell_width + GRID_COLUMN_GAP;
+    for (int x = 0; x < width - 4; x++)
+        menu->hit_columns[x] = (x % stride < cell_width && x / stride < columns) ? x / stride : DISABLED;
+
+    if (width != menu->layout_width) menu->header_dirty = menu->footer_dirty = TRUE;
+    menu->layout_columns = columns;
+    menu->layout_cell_width = cell_width;
+    menu->layout_width = width;
+    menu->layout_console_width = current_size.X;
+    menu->layout_dirty = FALSE;
+}
+
+// rows of the shown options, fewer than the menu has room for while a query filters them
+inline static int _layout_rows(MENU menu)
+{
+    return ((int)_shown_count(menu) + menu->layout_columns - 1) / menu->layout_columns;
+}
+
+// fits the viewport into the console and keeps the offset in range, the offset is always the start of a row
+static void _clamp_viewport(MENU menu, COORD current_size)
+{
+    int rows, max_offset, all_rows;
+
+    _layout_options(menu, current_size);
+    // sized for every option so the menu keeps its place while a query narrows the list
+    all_rows = ((int)menu->count + menu->layout_columns - 1) / menu->layout_columns;
+    rows = current_size.Y - _menu_chrome_rows(menu);
+    if (rows > all_rows) rows = all_rows;
+    if (rows < 1) rows = 1;
+    menu->viewport_rows = rows;
+
+    max_offset = (_layout_rows(menu) - rows) * menu->layout_columns;
+    if (max_offset < 0) max_offset = 0;
+    menu->scroll_offset -= menu->scroll_offset % menu->layout_columns;
+    if (menu->scroll_offset > max_offset) menu->scroll_offset = max_offset;
+    if (menu->scroll_offset < 0) menu->scroll_offset = 0;
+}
+
+// moves the viewport so the selected option is visible, TRUE if it had to scroll
+static int _scroll_to_selection(MENU menu)
+{
+    int selected = menu->selected_index;
+    int old_offset = menu->scroll_offset;
+    int columns = menu->layout_columns;
+
+    if (selected == DISABLED || menu->viewport_rows < 1) return FALSE;
+    if (selected < menu->scroll_offset) menu->scroll_offset = selected - selected % columns;
+    else if (selected >= menu->scroll_offset + menu->viewport_rows * columns)
+        menu->scroll_offset = (selected / columns - menu->viewport_rows + 1) * columns;
+    _filter_rank_viewport(menu);
+    return menu->scroll_offset != old_offset;
+}
+
+// wheel scrolling by rows, the selection is left where it is
+static int _scroll_viewport(MENU menu, int delta)
+{
+    int old_offset = menu->scroll_offset;
+    int max_offset = (_layout_rows(menu) - menu->viewport_rows) * menu->layout_columns;
+
+    menu->scroll_offset += delta * menu->layout_columns;
+    if (menu->scroll_offset > max_offset) menu->scroll_offset = max_offset;
+    if (menu->scroll_offset < 0) menu->scroll_offset = 0;
+    _filter_rank_viewport(menu);
+    return menu->scroll_offset != old_offset;
+}
+
+inline static int _option_visible(MENU menu, int index)
+{
+    return index >= menu->scroll_offset && index < menu->scroll_offset + menu->viewport_rows * menu->layout_columns;
+}
+
+// arrow key target in the row-major grid, leaving an edge wraps around like the list always did
+static int _grid_neighbor(MENU menu, int index, WORD vk)
+{
+    int columns = menu->layout_columns;
+    int column = index % columns;
+    int wraps = (vk == VK_LEFT && index == 0) || (vk == VK_UP && index < columns);
+    int count = (int)_filter_reach(menu, wraps ? FILTER_UNLIMITED : (size_t)index + columns + 1); // the way back around lands on the last match
+
+    switch (vk)
+        {
+            case VK_LEFT:
+                return (index - 1 + count) % count;
+            case VK_RIGHT:
+                return (index + 1) % count;
+            case VK_UP:
+                if (index >= columns) return index - columns;
+                index = (_layout_rows(menu) - 1) * columns + column; // same column in the last row
+                return index < count ? index : index - columns;
+            default:
+                return index + columns < count ? index + columns : column;
+        }
+}
+
+// keyboard jumps (page up/down, home/end), clamped to the option list
+static void _select_option(MENU menu, int index)
+{
+    if (index >= 0 && (size_t)index >= _filter_reach(menu, (size_t)index + 1)) index = (int)_shown_count(menu) - 1;
+    if (index < 0) index = 0;
+    menu->selected_index = index;
+    if (_scroll_to_selection(menu)) menu->full_redraw = TRUE;
+}
+
 static COORD _calculate_start_coordinates(MENU menu, COORD current_size)
 {
     MENU_COORD normcoord = menu->menu_settings.menu_center;
     COORD menu_size = menu->menu_size;
     COORD newcoord;
 
-    int haltx = menu->halt_size.X;
-    int halty = menu->halt_size.Y;
+    // only the visible part of the menu is centered, grids are wider than the menu itself
+    menu_size.Y = _menu_chrome_rows(menu) + menu->viewport_rows;
+    menu_size.X = menu->layout_width;
+
+    int haltx = menu_size.X / 2;
+    int halty = menu_size.Y / 2;
 
     // main calculations
     newcoord.X = (float)(normcoord.X + 1.0f) * (float)(current_size.X - 1.0f) / 2.0f - haltx;
@@ -1226,22 +6302,25 @@ static COORD _calculate_start_coordinates(MENU menu, COORD current_size)
     return newcoord;
 }
 
-static void _draw_render_unit(MENU_RENDER_ARGUMENT rargument, COORD pos, PMENU_RENDER_UNIT render_unit)
+// menus draw into their frame buffer, colors are picked when the frame is flushed
+inline static void _draw_render_unit_to_frame(MENU menu, COORD pos, PMENU_RENDER_UNIT render_unit)
 {
-    HANDLE backBuffer;
-    MENU_COLOR menu_color;
+    unsigned char style = (unsigned char)render_unit->unit_type;
+    if (style == SELECTABLE_TYPE && !*((WORD*)render_unit->extra_data)) style = 0;
+    _framebuffer_put_text(menu->framebuffer, pos, render_unit->text, style);
+}
 
+static void _draw_render_unit(MENU_RENDER_ARGUMENT rargument, COORD pos, PMENU_RENDER_UNIT render_unit)
+{
     if (rargument.tag == MENU_TYPE)
         {
-            menu_color = rargument.value.menu->color_object;
-            backBuffer = rargument.value.menu->hBuffer[rargument.value.menu->active_buffer ^ 1];
-        }
-    else
-        {
-            menu_color = MENU_DEFAULT_COLOR; // fallback for non-menu contexts jic
-            backBuffer = rargument.value.handle;
+            _draw_render_unit_to_frame(rargument.value.menu, pos, render_unit);
+            return;
         }
 
+    MENU_COLOR menu_color = MENU_DEFAULT_COLOR; // fallback for non-menu contexts jic
+    HANDLE backBuffer = rargument.value.handle;
+
     DWORD unit_type = render_unit->unit_type;
     const char* color_seq;
 
@@ -1265,20 +6344,15 @@ static void _draw_render_unit(MENU_RENDER_ARGUMENT rargument, COORD pos, PMENU_R
 
 static void _draw_render_unit_legacy(MENU_RENDER_ARGUMENT rargument, COORD pos, PMENU_RENDER_UNIT render_unit)
 {
-    HANDLE backBuffer;
-    LEGACY_MENU_COLOR menu_color;
-
     if (rargument.tag == MENU_TYPE)
         {
-            menu_color = rargument.value.menu->legacy_color_object;
-            backBuffer = rargument.value.menu->hBuffer[rargument.value.menu->active_buffer ^ 1];
-        }
-    else
-        {
-            menu_color = MENU_LEGACY_DEFAULT_COLOR;
-            backBuffer = rargument.value.handle;
+            _draw_render_unit_to_frame(rargument.value.menu, pos, render_unit);
+            return;
         }
 
+    LEGACY_MENU_COLOR menu_color = MENU_LEGACY_DEFAULT_COLOR;
+    HANDLE backBuffer = rargument.value.handle;
+
     DWORD unit_type = render_unit->unit_type;
     WORD text_color = reset_color_attribute;
 
@@ -1303,29 +6377,32 @@ static void _draw_render_unit_legacy(MENU_RENDER_ARGUMENT rargument, COORD pos,
         _ldraw_at_position(backBuffer, pos.X, pos.Y, render_unit->text);
     else
         {
-            SetConsoleTextAttribute(backBuffer, text_color);
+            _set_text_attribute(backBuffer, text_color);
             _ldraw_at_position(backBuffer, pos.X, pos.Y, render_unit->text);
-            SetConsoleTextAttribute(backBuffer, reset_color_attribute);
+            _set_text_attribute(backBuffer, reset_color_attribute);
         }
 }
 
 inline static void _performFullRedraw(MENU used_menu, COORD current_size, int* y_min, int* y_max, int* x_start, int* x_max, RenderUnitDrawer _draw_render_unit_func)
 {
     static int full_redraw_count = 0;
-    HANDLE hBackBuffer = used_menu->hBuffer[used_menu->active_buffer ^ 1];
-    _clear_buffer_func(hBackBuffer);
+    _framebuffer_clear(used_menu->framebuffer); // only the cells, the screen is fixed up by the diff
+    _clear_dirty_options(used_menu); // every row is drawn anyway
+    _clamp_viewport(used_menu, current_size);
+    _filter_rank_viewport(used_menu); // fuzzy matches are only ranked as far as they are shown
+    _update_formatted_strings(used_menu);
     COORD start = _calculate_start_coordinates(used_menu, current_size);
 
     MENU_RENDER_ARGUMENT rargument = _create_render_argument(MENU_TYPE, used_menu);
 
     // predefined render units
     MENU_RENDER_UNIT header_render_unit = _create_render_unit("", HEADER_TYPE, NULL);
-    MENU_RENDER_UNIT option_render_unit = _create_render_unit("", SELECTABLE_TYPE, NULL);
     MENU_RENDER_UNIT footer_render_unit = _create_render_unit("", FOOTER_TYPE, NULL);
 
-    int i, y, x;
+    int i, y, x, last_visible, columns, stride;
 
 #ifdef DEBUG
+    HANDLE hBackBuffer = used_menu->hBuffer;
     _draw_at_position(hBackBuffer, 0, 0, "__ID: %llu", used_menu->__ID);
     _draw_at_position(hBackBuffer, 0, 6, "WINDOW SIZE: %d %d ", current_size.X, current_size.Y);
     _draw_at_position(hBackBuffer, 0, 14, "menus_amount: %d", menus_amount);
@@ -1345,30 +6422,54 @@ inline static void _performFullRedraw(MENU used_menu, COORD current_size, int* y
             }, &header_render_unit);
         }
 
-    // options
-    MENU_ITEM* options = used_menu->options;
+    // options (just the matches while a query is typed)
+    MENU_ITEM option;
+    size_t count = _shown_count(used_menu);
     y = *y_min = start.Y + (used_menu->menu_settings.header_enabled ? 3 : 1);
     *x_max = 0;
     *x_start = x;
 
-    for (i = 0; i < used_menu->count; i++, y++)
+    // only the rows inside the viewport, the rest of the list costs nothing per frame
+    columns = used_menu->layout_columns;
+    stride = used_menu->layout_cell_width + GRID_COLUMN_GAP;
+    last_visible = used_menu->scroll_offset + used_menu->viewport_rows * columns;
+    if ((size_t)last_visible > count) last_visible = (int)count; // viewport_rows is never below 1, even with no options left
+    for (i = used_menu->scroll_offset; i < last_visible; i++)
         {
-            WORD is_selected = (i == used_menu->selected_index);
-            option_render_unit.text = used_menu->options[i]->text;
-            option_render_unit.extra_data = (void*)&is_selected;
-            _draw_render_unit_func(rargument, (COORD)
+            x = *x_start + (i - used_menu->scroll_offset) % columns * stride;
+            y = *y_min + (i - used_menu->scroll_offset) / columns;
+
+            // options skip the render unit and copy their cached cells
+            option = _shown_option(used_menu, i);
+            _put_shown_option(used_menu, (COORD)
             {
                 x, y
-            }, &option_render_unit);
+            }, option, i == used_menu->selected_index);
+            if (option->__job) _framebuffer_put_text(used_menu->framebuffer, (COORD){x - 1, y}, ASYNC_BUSY_MARKER, 0);
 
             // boundaries calc
-            options[i]->boundaries.Y = y;
-            options[i]->boundaries.X = x + used_menu->options[i]->text_len - 1;
-            options[i]->x_position = x;
-            if (options[i]->boundaries.X > *x_max)
-                *x_max = options[i]->boundaries.X;
+            option->boundaries.Y = y;
+            option->boundaries.X = x + option->text_len - 1;
+            option->x_position = x;
+            if (option->boundaries.X > *x_max)
+                *x_max = option->boundaries.X;
+        }
+    *y_max = *y_min + (last_visible - used_menu->scroll_offset + columns - 1) / columns;
+    y = *y_min + used_menu->viewport_rows; // same as y_max unless a query left rows empty
+
+    // markers next to the first/last row when there is more to scroll to
+    if (used_menu->scroll_offset > 0)
+        _framebuffer_put_text(used_menu->framebuffer, (COORD){start.X, *y_min}, "^", 0);
+    if ((size_t)last_visible < count)
+        _framebuffer_put_text(used_menu->framebuffer, (COORD){start.X, y - 1}, "v", 0);
+
+    // the typed query goes into the blank row under the options
+    if (used_menu->filter && used_menu->filter->length)
+        {
+            char line[FILTER_QUERY_MAX + 32];
+            snprintf(line, sizeof(line), _filter_pending(used_menu) ? "/%s (%lu+)" : "/%s (%lu)", used_menu->filter->query, (unsigned long)count);
+            _framebuffer_put_text(used_menu->framebuffer, (COORD){start.X + 2, y}, line, 0);
         }
-    *y_max = y;
 
     // footer
     if (used_menu->menu_settings.footer_enabled)
@@ -1380,388 +6481,634 @@ inline static void _performFullRedraw(MENU used_menu, COORD current_size, int* y
             }, &footer_render_unit);
         }
 
-    _setConsoleActiveScreenBuffer(hBackBuffer);
-    used_menu->active_buffer ^= 1;
+    _framebuffer_flush(used_menu);
+}
+
+// repaints the slots of relabeled options that are on screen, the diff sends only what changed
+static void _draw_dirty_options(MENU menu)
+{
+    struct __menu_framebuffer* framebuffer = menu->framebuffer;
+    size_t count = _shown_count(menu);
+    int slot_width = menu->layout_cell_width;
+    int index, column, offset;
+    MENU_ITEM item, first;
+
+    for (size_t i = 0; i < menu->dirty_count; i++)
+        {
+            item = menu->dirty_options[i];
+            item->__dirty = FALSE;
+            if ((size_t)menu->scroll_offset >= count) continue;
+
+            // slots are laid out from the first visible option, an item that is not where its slot says is off screen
+            first = _shown_option(menu, menu->scroll_offset);
+            offset = item->x_position - first->x_position;
+            column = (offset >= 0 && offset < menu->layout_width - 4) ? menu->hit_columns[offset] : DISABLED;
+            index = menu->scroll_offset + (item->boundaries.Y - first->boundaries.Y) * menu->layout_columns + column;
+            if (column == DISABLED || !_option_visible(menu, index) || (size_t)index >= count || _shown_option(menu, index) != item) continue;
+
+            if (item->boundaries.Y >= 0 && item->boundaries.Y < framebuffer->size.Y && item->x_position >= 0 && slot_width > 0)
+                {
+                    MENU_CELL* row = framebuffer->back + (size_t)item->boundaries.Y * framebuffer->size.X;
+                    int amount = item->x_position + slot_width > framebuffer->size.X ? framebuffer->size.X - item->x_position : slot_width;
+                    if (amount > 0) _blank_cells(row + item->x_position, amount);
+                }
+            _put_shown_option(menu, (COORD)
+            {
+                item->x_position, item->boundaries.Y
+            }, item, index == menu->selected_index);
+            _framebuffer_put_text(framebuffer, (COORD){item->x_position - 1, item->boundaries.Y}, item->__job ? ASYNC_BUSY_MARKER : " ", 0);
+            item->boundaries.X = item->x_position + item->text_len - 1;
+        }
+    menu->dirty_count = 0;
+}
+
+// a frame with nothing but relabeled rows
+inline static void _performRowRedraw(MENU used_menu)
+{
+    _draw_dirty_options(used_menu);
+    _framebuffer_flush(used_menu);
+}
+
+// milliseconds until max_frame_rate allows the next paced frame
+static DWORD _frame_delay(MENU menu)
+{
+    if (menu->menu_settings.max_frame_rate <= 0) return 0;
+
+    double remaining = 1.0 / menu->menu_settings.max_frame_rate - (tick() - menu->last_frame);
+    return remaining > 0 ? (DWORD)(remaining * 1000.0) + 1 : 0;
 }
 
 inline static void _performDirtyRedraw(MENU used_menu, int last_selected_index, int cached_selected_index, RenderUnitDrawer _draw_render_unit_func)
 {
-    HANDLE hCurrentBuffer = used_menu->hBuffer[used_menu->active_buffer];
-    MENU_RENDER_ARGUMENT rargument = _create_render_argument(HANDLE_TYPE, hCurrentBuffer);
-    MENU_RENDER_UNIT option_render_unit = _create_render_unit("", SELECTABLE_TYPE, NULL);
     int selected_index = used_menu->selected_index;
 
 #ifdef DEBUG
+    HANDLE hCurrentBuffer = used_menu->hBuffer;
     static int dirty_counter = 0;
     _draw_at_position(hCurrentBuffer, 0, 34, "selected: %d, previous: %d, cached: %d      ", selected_index, last_selected_index, cached_selected_index);
     _draw_at_position(hCurrentBuffer, 0, 36, "dirty redraws %d", ++dirty_counter);
 #endif
 
+    _draw_dirty_options(used_menu); // relabels ride along with the selection change
+
     // determine the actual previous index to un-highlight
     int previous_index = (last_selected_index != DISABLED) ? last_selected_index : cached_selected_index;
 
     // un-highlight the previous option (previous_index is never going to be negative due to the how event handler works)
-    if (previous_index != DISABLED)
+    if (previous_index != DISABLED && _option_visible(used_menu, previous_index) && (size_t)previous_index < _shown_count(used_menu))
         {
-            WORD is_selected = FALSE;
-            MENU_ITEM previous_option = used_menu->options[previous_index];
-            option_render_unit.text = previous_option->text;
-            option_render_unit.extra_data = (void*)&is_selected;
-            _draw_render_unit_func(rargument, (COORD)
+            MENU_ITEM previous_option = _shown_option(used_menu, previous_index);
+            _put_shown_option(used_menu, (COORD)
             {
                 previous_option->x_position, previous_option->boundaries.Y
-            }, &option_render_unit);
+            }, previous_option, FALSE);
         }
 
     // highlight the new option
-    if (selected_index != DISABLED)
+    if (selected_index != DISABLED && _option_visible(used_menu, selected_index) && (size_t)selected_index < _shown_count(used_menu))
         {
-            WORD is_selected = TRUE;
-            MENU_ITEM current_option = used_menu->options[selected_index];
-            option_render_unit.text = current_option->text;
-            option_render_unit.extra_data = (void*)&is_selected;
-            _draw_render_unit_func(rargument, (COORD)
+            MENU_ITEM current_option = _shown_option(used_menu, selected_index);
+            _put_shown_option(used_menu, (COORD)
             {
                 current_option->x_position, current_option->boundaries.Y
-            }, &option_render_unit);
+            }, current_option, TRUE);
         }
-}
 
-static void _ensure_safe_startup()
-{
-    size_t cycle = 0;
-    DWORD eventsAmount = 0;
-    _reset_mouse_state();
-    while (1)
-        {
-            if (GetNumberOfConsoleInputEvents(hStdin, &eventsAmount))
-                {
-                    // brute forcing to fix input buffer
-                    if (eventsAmount < 10 && cycle > 10) break;
-                    _reset_mouse_state();
-                    FlushConsoleInputBuffer(hStdin);
-                }
-            if (cycle > 100) exit(2);
-            ++cycle;
-        }
+    _framebuffer_flush(used_menu);
 }
 
 static void _renderMenu(MENU used_menu)
 {
     if (!used_menu) return;
+    if (!used_menu->session && !_begin_menu_session(used_menu)) return;
+    used_menu->session->blocking = TRUE;
 
-    // BASIC VARIABLES BLOCK
-    COORD current_size, old_size;
-    int y_max, y_min, x_max, x_start;
-    int size_check;
-    int i,
-        last_selected_index = DISABLED,
-        cached_selected_index = DISABLED,
-        can_tick = TRUE,
-        selected_by_mouse = FALSE;
-    int selected_index;
-
-    unsigned long long saved_id; // saved menu ID to verify menu validity after callbacks
-    static int something_is_selected; // static flag persisting between function calls
-
-    MouseEventHandler mouse_event_handler;
-
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    SMALL_RECT new_window;
-    COORD menu_size;
-
-    DWORD old_mode, numEvents, event, waitResult;
-    WORD vk;
-    INPUT_RECORD inputRecords[EVENT_MAX_RECORDS];
-
-#ifdef DEBUG
-    int mouse_status;
-    size_t tick_count;
-    COORD debug_mouse_pos;
-#endif
-
-    GetConsoleScreenBufferInfo(hCurrent, &csbi);
-    old_size = current_size = (COORD)
-    {
-        csbi.srWindow.Right - csbi.srWindow.Left + 1, csbi.srWindow.Bottom - csbi.srWindow.Top + 1
-    };
+    // a step that returns FALSE has already torn the session down
+    while (_menu_step(used_menu, UPDATE_FREQUENCE))
+        ;
+}
 
-    menu_size = used_menu->menu_size;
-    saved_id = used_menu->__ID;
+// everything the render loop keeps between two steps, the first frame is rendered here
+static int _begin_menu_session(MENU used_menu)
+{
+    struct __menu_session* session = _safe_malloc(sizeof(struct __menu_session));
+    if (!session) return FALSE;
+    used_menu->session = session;
+    session->stepping = TRUE;
+
+    session->old_size = session->current_size = _get_console_size(used_menu->surface ? (HANDLE)used_menu->surface : hCurrent);
+
+    session->menu_size = used_menu->menu_size;
+    session->saved_id = used_menu->__ID;
+    session->last_selected_index = DISABLED;
+    session->cached_selected_index = DISABLED;
+    session->can_tick = TRUE;
+    session->selected_by_mouse = FALSE;
+    session->shown_index = DISABLED;
     used_menu->need_redraw = TRUE;
     used_menu->full_redraw = TRUE; // THIS FLAG IS SET TO TRUE IN SOME FUNCTIONS / WHEN SIZE CHECKING (AND IT CHANGES)
 
+    if (used_menu->filter) _filter_reset(used_menu); // every showing starts with the whole list
     used_menu->selected_index = used_menu->menu_settings.mouse_enabled ? DISABLED : 0;
-    selected_index = used_menu->selected_index;
+    used_menu->scroll_offset = 0;
+    session->selected_index = used_menu->selected_index;
 
-    RenderUnitDrawer _draw_render_unit_func = (vt100_support && used_menu->menu_settings.force_legacy_mode ^ 1)
-            ? _draw_render_unit
-            : _draw_render_unit_legacy;
+    session->draw_render_unit = (vt100_support && used_menu->menu_settings.force_legacy_mode ^ 1)
+                                ? _draw_render_unit
+                                : _draw_render_unit_legacy;
 
-    mouse_event_handler = (used_menu->menu_settings.mouse_enabled)
-                          ? _handle_mouse_event_enabled
-                          : _handle_mouse_event_disabled;
+    session->mouse_event_handler = (used_menu->menu_settings.mouse_enabled)
+                                   ? _handle_mouse_event_enabled
+                                   : _handle_mouse_event_disabled;
 
 #ifdef DEBUG
-    tick_count = 1;
-    debug_mouse_pos = (COORD)
+    session->tick_count = 1;
+    session->debug_mouse_pos = (COORD)
     {
         0, 0
     };
-    mouse_status = FALSE;
+    session->mouse_status = FALSE;
 #endif
 
-    _setConsoleActiveScreenBuffer(used_menu->hBuffer[used_menu->active_buffer]);
+    // another menu may have used the same screen since our last frame
+    _resize_framebuffer(used_menu->framebuffer, session->current_size);
+    _invalidate_screen(used_menu);
+
+    _setConsoleActiveScreenBuffer(used_menu->hBuffer);
     _reset_mouse_state();
-    _block_input(&old_mode);
-    fflush(stdin);
-    FlushConsoleInputBuffer(hStdin);
-    if (menus_array[0]->__ID == used_menu->__ID) _ensure_safe_startup(); // running only for the first menu
+    if (used_menu->__parent_menu) session->old_mode = used_menu->__parent_menu->session->old_mode; // input stays blocked, type-ahead is ours
+    else
+        {
+            _block_input(&session->old_mode);
+            fflush(stdin);
+            _discard_pending_input(used_menu->hBuffer); // drained once, whatever arrives from now on is real input
+#ifdef _WIN32
+            if (!used_menu->surface) holding = TRUE; // a button still down from the click that launched us has to be released first
+#endif
+        }
+
+    if (!_menu_frame(used_menu))
+        {
+            _end_menu_session(used_menu);
+            return FALSE;
+        }
+    session->stepping = FALSE;
+    return TRUE;
+}
+
+static void _end_menu_session(MENU used_menu)
+{
+    struct __menu_session* session = used_menu->session;
+    if (!session) return;
+    used_menu->session = NULL;
 
-    while (used_menu->running)
+    // a submenu hands the input over to its parent as it is
+    if (!used_menu->__parent_menu)
         {
+            _discard_pending_input(used_menu->hBuffer);
+            _restore_input(&session->old_mode);
+        }
+    if (menus_amount == 0) _setConsoleActiveScreenBuffer(hConsole);
+    else _setConsoleActiveScreenBuffer(_find_first_active_menu_buffer());
+    _release_render_buffers(used_menu); // hidden from now on, the next menu shown reuses them
+    free(session);
+}
+
+// timers, posted commands, resizes and at most one frame; FALSE once the menu has to close
+static int _menu_frame(MENU used_menu)
+{
+    struct __menu_session* session = used_menu->session;
+    int size_check, rows_moved;
+
+frame_start:
 #ifdef DEBUG
-            _draw_at_position(hCurrent, 0, 4, "loop cycle: %llu", ++tick_count);
-            _draw_at_position(hCurrent, 0, 8, "need redraw: %d", used_menu->need_redraw);
-            _draw_at_position(hCurrent, 0, 12, "mouse status: %d", mouse_status);
-            _draw_at_position(hCurrent, 0, 34, "selected: %d, previous: %d, cached: %d      ", selected_index, last_selected_index, cached_selected_index);
+    _draw_at_position(hCurrent, 0, 4, "loop cycle: %llu", ++session->tick_count);
+    _draw_at_position(hCurrent, 0, 8, "need redraw: %d", used_menu->need_redraw);
+    _draw_at_position(hCurrent, 0, 12, "mouse status: %d", session->mouse_status);
+    _draw_at_position(hCurrent, 0, 34, "selected: %d, previous: %d, cached: %d      ", session->selected_index, session->last_selected_index, session->cached_selected_index);
 #endif
-            if (can_tick)
+    // due timers and everything other threads posted since the last batch, one redraw for all of it
+    _apply_async_completions();
+    rows_moved = _run_timers(used_menu);
+    if (!rows_moved || _find_menu_by_id(session->saved_id)) rows_moved |= _apply_menu_commands(used_menu);
+    if (rows_moved)
+        {
+            if (!_find_menu_by_id(session->saved_id)) return FALSE;
+            if (used_menu->count == 0)
                 {
-                    if ((old_size.X != current_size.X) || (old_size.Y != current_size.Y))
-                        {
-                            old_size = current_size;
-                            size_check = (current_size.X < menu_size.X) || (current_size.Y < menu_size.Y);
-                            _initWindow(&new_window, current_size);
-
-                            if (size_check)
-                                {
-                                    _show_error_and_wait_extended(used_menu);
-                                    current_size = cached_size;
-                                    continue;
-                                }
+                    clear_menu(used_menu); // same as the last clear_option() would do
+                    return FALSE;
+                }
 
-                            SetConsoleScreenBufferSize(used_menu->hBuffer[0], current_size);
-                            SetConsoleScreenBufferSize(used_menu->hBuffer[1], current_size);
-                            SetConsoleWindowInfo(used_menu->hBuffer[0], TRUE, &new_window);
-                            SetConsoleWindowInfo(used_menu->hBuffer[1], TRUE, &new_window);
+            // indices from before the batch may point past the end now
+            session->last_selected_index = DISABLED;
+            session->cached_selected_index = used_menu->selected_index;
+            session->menu_size = used_menu->menu_size;
+            if (_size_check(used_menu)) _show_error_and_wait_extended(used_menu);
+            session->current_size = cached_size;
+            used_menu->need_redraw = TRUE;
+            used_menu->full_redraw = TRUE;
+        }
+    if (!used_menu->running) return FALSE; // a task disabled the menu
 
-                            FlushConsoleInputBuffer(hStdin);
-                            used_menu->need_redraw = TRUE;
-                            used_menu->full_redraw = TRUE;
-                        }
-                }
+    // steps with nothing else to draw look for another slice of the matches, the count under the options is drawn once it is final
+    if (!used_menu->need_redraw && _filter_continue(used_menu))
+        {
+            used_menu->need_redraw = TRUE;
+            used_menu->full_redraw = TRUE;
+        }
 
-            if (used_menu->need_redraw)
+    if (session->can_tick)
+        {
+            if ((session->old_size.X != session->current_size.X) || (session->old_size.Y != session->current_size.Y))
                 {
-                    selected_index = used_menu->selected_index;
-                    // cache the last known valid index. This is crucial for dirty redraws
-                    // when the mouse moves off all options (selected_index becomes DISABLED).
-                    if (selected_index != DISABLED) cached_selected_index = selected_index;
+                    session->old_size = session->current_size;
+                    size_check = (session->current_size.X < session->menu_size.X) || (session->current_size.Y < session->menu_size.Y);
 
-                    // if the size changed, a full redraw is mandatory
-                    if (used_menu->full_redraw)
+                    if (size_check)
                         {
-                            _performFullRedraw(used_menu, current_size, &y_min, &y_max, &x_start, &x_max, _draw_render_unit_func);
-                            used_menu->full_redraw = FALSE; // reset
-                        }
-                    // otherwise, perform a much faster "dirty" redraw
-                    else
-                        {
-                            _performDirtyRedraw(used_menu, last_selected_index, cached_selected_index, _draw_render_unit_func);
+                            _show_error_and_wait_extended(used_menu);
+                            session->current_size = cached_size;
+                            goto frame_start;
                         }
 
-                    used_menu->need_redraw = FALSE; // reset redraw flag
+                    _resize_screen_buffer(used_menu->hBuffer, session->current_size);
+                    _resize_framebuffer(used_menu->framebuffer, session->current_size);
+                    _clamp_viewport(used_menu, session->current_size);
+                    _scroll_to_selection(used_menu);
+
+                    used_menu->need_redraw = TRUE;
+                    used_menu->full_redraw = TRUE;
                 }
+        }
 
-            // events handling
-        event_wait:
-            ;
-            waitResult = WaitForSingleObject(hStdin, UPDATE_FREQUENCE);
-            if (waitResult == WAIT_OBJECT_0)
+    if (used_menu->need_redraw)
+        {
+            session->selected_index = used_menu->selected_index;
+            // cache the last known valid index. This is crucial for dirty redraws
+            // when the mouse moves off all options (selected_index becomes DISABLED).
+            if (session->selected_index != DISABLED) session->cached_selected_index = session->selected_index;
+
+            // if the size changed, a full redraw is mandatory
+            if (used_menu->full_redraw)
                 {
-                    if (GetNumberOfConsoleInputEvents(hStdin, &numEvents))
-                        {
-                            ReadConsoleInput(hStdin, inputRecords, min(EVENT_MAX_RECORDS, numEvents), &numEvents);
-                            for (event = 0; event < numEvents; event++)
-                                switch(inputRecords[event].EventType)
-                                    {
-                                        case KEY_EVENT:
-                                            if (inputRecords[event].Event.KeyEvent.bKeyDown)
+                    _performFullRedraw(used_menu, session->current_size, &session->y_min, &session->y_max, &session->x_start, &session->x_max, session->draw_render_unit);
+                    used_menu->full_redraw = FALSE; // reset
+                }
+            // otherwise, perform a much faster "dirty" redraw
+            else
+                {
+                    // several moves may have been handled since the last frame, the stale highlight is the one on screen
+                    _performDirtyRedraw(used_menu, session->shown_index != DISABLED ? session->shown_index : session->last_selected_index,
+                                        session->cached_selected_index, session->draw_render_unit);
+                }
+
+            session->shown_index = used_menu->selected_index;
+            used_menu->need_redraw = FALSE; // reset redraw flag
+        }
+    // label updates are paced by max_frame_rate, a burst of them ends up in a single frame
+    else if (used_menu->dirty_count && !_frame_delay(used_menu))
+        {
+            _performRowRedraw(used_menu);
+        }
+
+    // the submenu under the selection is built in the background while the user makes up their mind
+    if (used_menu->menu_settings.submenu_prefetch && used_menu->selected_index >= 0 && used_menu->selected_index < (int)_shown_count(used_menu) &&
+            _shown_option(used_menu, used_menu->selected_index)->__submenu)
+        _prefetch_submenu(_shown_option(used_menu, used_menu->selected_index)->__submenu);
+    return TRUE;
+}
+
+// one batch of input (waiting at most timeout ms) followed by one frame; FALSE once the session is over
+static int _menu_step(MENU used_menu, DWORD timeout)
+{
+    struct __menu_session* session = used_menu->session;
+    static int something_is_selected; // static flag persisting between function calls
+    DWORD wait_timeout, timer_timeout;
+    int waitResult, page_step;
+    WORD vk;
+    unsigned char ascii;
+    HANDLE hCallbackBuffer;
+    INPUT_RECORD input_record; // stack only, an idle step allocates nothing
+
+    session->stepping = TRUE;
+    if (used_menu->__open_submenu)
+        {
+            if (!_submenu_step(used_menu, timeout)) return FALSE;
+            session->stepping = FALSE;
+            return TRUE;
+        }
+
+    // sleep until the next paced repaint or timer at the latest, idle menus never wake up on their own
+    wait_timeout = timeout;
+    if (used_menu->dirty_count)
+        {
+            timer_timeout = _frame_delay(used_menu);
+            if (timer_timeout < wait_timeout) wait_timeout = timer_timeout;
+        }
+    timer_timeout = _timer_delay(used_menu);
+    if (timer_timeout < wait_timeout) wait_timeout = timer_timeout;
+    if (_filter_pending(used_menu)) wait_timeout = 0; // the rest of the matches are looked for between keystrokes
+
+    // events handling
+event_wait:
+    ;
+    waitResult = _fill_input_ring(used_menu->hBuffer, wait_timeout);
+    if (waitResult == INPUT_EXHAUSTED && !session->blocking) waitResult = FALSE; // menu_poll() comes back once more is pushed
+    if (waitResult == INPUT_EXHAUSTED)
+        {
+            // headless input ran dry, whatever is still paced goes out now
+            if (used_menu->dirty_count) _performRowRedraw(used_menu);
+            used_menu->running = FALSE;
+        }
+    else if (waitResult)
+        {
+                // everything read so far, a callback, submenu or ESC leaves the rest queued for whoever reads next
+                while (used_menu->running && !used_menu->__open_submenu && input_ring.count > 0)
+                    {
+                        input_record = input_ring.records[input_ring.head];
+                        input_ring.head = (input_ring.head + 1) & (INPUT_RING_CAPACITY - 1);
+                        input_ring.count--;
+                        switch(input_record.EventType)
+                            {
+                                case KEY_EVENT:
+                                    if (input_record.Event.KeyEvent.bKeyDown)
+                                        {
+                                            vk = input_record.Event.KeyEvent.wVirtualKeyCode;
+                                            ascii = (unsigned char)input_record.Event.KeyEvent.uChar.AsciiChar;
+
+                                            // printable characters and backspace edit the query, even the ones sharing a code with a navigation key
+                                            if (used_menu->menu_settings.filter_enabled && ((ascii >= 0x20 && ascii < 0x7F) || vk == VK_BACK))
+                                                {
+                                                    if (vk == VK_BACK ? _filter_pop(used_menu) : _filter_push(used_menu, (char)ascii))
+                                                        {
+                                                            session->can_tick = TRUE;
+                                                            session->last_selected_index = DISABLED;
+                                                            session->selected_by_mouse = FALSE;
+                                                        }
+                                                    break; // next event
+                                                }
+
+                                            // a query matching nothing leaves only escape
+                                            if (!_shown_count(used_menu) && vk != VK_ESCAPE) break;
+
+                                            if ((vk == VK_UP) || (vk == VK_DOWN) || (vk == VK_RETURN) || (vk == VK_ESCAPE) || (vk == VK_DELETE) ||
+                                                    (vk == VK_PRIOR) || (vk == VK_NEXT) || (vk == VK_HOME) || (vk == VK_END) ||
+                                                    ((vk == VK_LEFT || vk == VK_RIGHT) && used_menu->layout_columns > 1))
                                                 {
-                                                    vk = inputRecords[event].Event.KeyEvent.wVirtualKeyCode;
-                                                    if ((vk == VK_UP) || (vk == VK_DOWN) || (vk == VK_RETURN) || (vk == VK_ESCAPE) || (vk == VK_DELETE))
+                                                    session->can_tick = TRUE;
+                                                    used_menu->need_redraw = TRUE;
+                                                    switch (vk)
                                                         {
-                                                            can_tick = TRUE;
-                                                            used_menu->need_redraw = TRUE;
-                                                            switch (vk)
-                                                                {
-                                                                    case VK_UP:
-                                                                        last_selected_index = used_menu->selected_index;
-                                                                        if (used_menu->selected_index == DISABLED)
-                                                                            used_menu->selected_index = used_menu->count - 1 % used_menu->count;
-                                                                        else
-                                                                            used_menu->selected_index =
-                                                                                (used_menu->selected_index - 1 + used_menu->count) % used_menu->count;
-                                                                        selected_by_mouse = FALSE;
-                                                                        break;
-                                                                    case VK_DOWN:
-                                                                        last_selected_index = used_menu->selected_index;
-                                                                        used_menu->selected_index =
-                                                                            (used_menu->selected_index + 1) % used_menu->count;
-                                                                        selected_by_mouse = FALSE;
-                                                                        break;
-                                                                    case VK_RETURN: // ENTER
-                                                                        if (used_menu->selected_index >= 0 && used_menu->options[used_menu->selected_index]->callback)
+                                                            case VK_UP:
+                                                                session->last_selected_index = used_menu->selected_index;
+                                                                if (used_menu->selected_index == DISABLED)
+                                                                    used_menu->selected_index = _filter_reach(used_menu, FILTER_UNLIMITED) - 1 % _shown_count(used_menu);
+                                                                else
+                                                                    used_menu->selected_index = _grid_neighbor(used_menu, used_menu->selected_index, vk);
+                                                                if (_scroll_to_selection(used_menu)) used_menu->full_redraw = TRUE;
+                                                                session->selected_by_mouse = FALSE;
+                                                                break;
+                                                            case VK_DOWN:
+                                                            case VK_LEFT:
+                                                            case VK_RIGHT:
+                                                                session->last_selected_index = used_menu->selected_index;
+                                                                if (used_menu->selected_index == DISABLED)
+                                                                    used_menu->selected_index = 0;
+                                                                else
+                                                                    used_menu->selected_index = _grid_neighbor(used_menu, used_menu->selected_index, vk);
+                                                                if (_scroll_to_selection(used_menu)) used_menu->full_redraw = TRUE;
+                                                                session->selected_by_mouse = FALSE;
+                                                                break;
+                                                            case VK_PRIOR:
+                                                            case VK_NEXT:
+                                                                session->last_selected_index = used_menu->selected_index;
+                                                                page_step = (used_menu->viewport_rows > 1 ? used_menu->viewport_rows - 1 : 1) * used_menu->layout_columns;
+                                                                _select_option(used_menu, (used_menu->selected_index == DISABLED ? used_menu->scroll_offset : used_menu->selected_index)
+                                                                               + (vk == VK_NEXT ? page_step : -page_step));
+                                                                session->selected_by_mouse = FALSE;
+                                                                break;
+                                                            case VK_HOME:
+                                                            case VK_END:
+                                                                session->last_selected_index = used_menu->selected_index;
+                                                                _select_option(used_menu, vk == VK_HOME ? 0 : (int)_filter_reach(used_menu, FILTER_UNLIMITED) - 1);
+                                                                session->selected_by_mouse = FALSE;
+                                                                break;
+                                                            case VK_RETURN: // ENTER
+                                                                if (used_menu->selected_index >= 0 && (_shown_option(used_menu, used_menu->selected_index)->callback ||
+                                                                                                        _shown_option(used_menu, used_menu->selected_index)->__submenu))
+                                                                    {
+                                                                    input_handler:
+                                                                        ;
+                                                                        // a submenu replaces us on screen, the input left in the ring is its own
+                                                                        if (_shown_option(used_menu, used_menu->selected_index)->__submenu)
+                                                                            {
+                                                                                if (!_open_submenu(used_menu, _shown_option(used_menu, used_menu->selected_index))) used_menu->need_redraw = FALSE;
+                                                                                break;
+                                                                            }
+                                                                        // async options never leave the menu screen
+                                                                        if (_shown_option(used_menu, used_menu->selected_index)->__async)
                                                                             {
-                                                                            input_handler:
-                                                                                ;
-                                                                                SetConsoleMode(hStdin, old_mode);
-                                                                                SetConsoleScreenBufferSize(hConsole, current_size);
-                                                                                _initWindow(&new_window, current_size);
-                                                                                SetConsoleWindowInfo(hConsole, TRUE, &new_window);
+                                                                                _start_async_callback(used_menu, _shown_option(used_menu, used_menu->selected_index));
+                                                                                used_menu->need_redraw = FALSE;
+                                                                                break;
+                                                                            }
+                                                                        // keys typed ahead wait in the ring, the rest would leak into the callback's stdin
+                                                                        _fill_input_ring(used_menu->hBuffer, 0);
+                                                                        _discard_pending_input(used_menu->hBuffer);
+                                                                        _restore_input(&session->old_mode);
+                                                                        hCallbackBuffer = used_menu->surface ? (HANDLE)used_menu->surface : hConsole;
+                                                                        _resize_screen_buffer(hCallbackBuffer, session->current_size);
 
-                                                                                fflush(stdin);
-                                                                                FlushConsoleInputBuffer(hStdin);
+                                                                        fflush(stdin);
 
-                                                                                _clear_buffer_func(hConsole);
-                                                                                _setConsoleActiveScreenBuffer(hConsole);
+                                                                        _setConsoleActiveScreenBuffer(hCallbackBuffer);
+                                                                        _clear_buffer_func(hCallbackBuffer);
 
-                                                                                MENU_ITEM current_option = used_menu->options[used_menu->selected_index];
-                                                                                current_option->callback(used_menu, current_option->data_chunk);
-                                                                                FlushConsoleInputBuffer(hStdin);
+                                                                        MENU_ITEM current_option = _shown_option(used_menu, used_menu->selected_index);
+                                                                        current_option->callback(used_menu, current_option->data_chunk);
+                                                                        _discard_pending_input(used_menu->hBuffer);
+
+                                                                        if (_find_menu_by_id(session->saved_id)) // if exists after the callback (may be deleted)
+                                                                            {
+                                                                                if (_size_check(used_menu)) _show_error_and_wait_extended(used_menu);
 
-                                                                                used_menu = _find_menu_by_id(saved_id); // redefining
+                                                                                session->selected_by_mouse = 0;
+                                                                                session->current_size = cached_size;
+                                                                                _block_input(&session->old_mode);
+                                                                                _reset_mouse_state();
 
-                                                                                if (used_menu) // if exists after the callback (may be deleted)
+                                                                                /* in proccess of rethinking this...
+                                                                                if (session->selected_by_mouse)
                                                                                     {
-                                                                                        if (_size_check(used_menu)) _show_error_and_wait_extended(used_menu);
-
-                                                                                        selected_by_mouse = 0;
-                                                                                        current_size = cached_size;
-                                                                                        _block_input(&old_mode);
-                                                                                        _reset_mouse_state();
-
-                                                                                        /* in proccess of rethinking this...
-                                                                                        if (selected_by_mouse)
-                                                                                            {
-                                                                                                // resetting menu values
-                                                                                                last_selected_index = DISABLED;
-                                                                                                cached_selected_index = used_menu->selected_index;
-                                                                                                used_menu->selected_index = DISABLED;
-
-                                                                                                // redrawing (clearing any selected option before the call)
-                                                                                                _performDirtyRedraw(used_menu, last_selected_index, cached_selected_index, _draw_render_unit_func);
-                                                                                            }
-                                                                                        */
-
-                                                                                        // swapping
-                                                                                        _setConsoleActiveScreenBuffer(used_menu->hBuffer[used_menu->active_buffer]);
+                                                                                        // resetting menu values
+                                                                                        session->last_selected_index = DISABLED;
+                                                                                        session->cached_selected_index = used_menu->selected_index;
+                                                                                        used_menu->selected_index = DISABLED;
+
+                                                                                        // redrawing (clearing any selected option before the call)
+                                                                                        _performDirtyRedraw(used_menu, session->last_selected_index, session->cached_selected_index, session->draw_render_unit);
                                                                                     }
-                                                                                else goto end_render_loop;
+                                                                                */
+
+                                                                                // swapping
+                                                                                _setConsoleActiveScreenBuffer(used_menu->hBuffer);
+                                                                                if (!SCREEN_BUFFERS_PERSIST || used_menu->surface) _invalidate_screen(used_menu);
                                                                             }
-                                                                        else used_menu->need_redraw = FALSE; // if selected but enter is not at valid index
-                                                                        break;
-                                                                    case VK_ESCAPE:
-                                                                        clear_menu(used_menu);
-                                                                        break;
+                                                                        else goto end_step;
+                                                                    }
+                                                                else used_menu->need_redraw = FALSE; // if selected but enter is not at valid index
+                                                                break;
+                                                            case VK_ESCAPE:
+                                                                // the first escape only drops a typed query
+                                                                if (used_menu->filter && used_menu->filter->length) _filter_reset(used_menu);
+                                                                else if (used_menu->__parent_menu) used_menu->running = FALSE; // back to the parent, the options stay cached
+                                                                else clear_menu(used_menu);
+                                                                break;
 #ifdef DEBUG
-                                                                    case VK_DELETE:
-                                                                        clear_option(used_menu, used_menu->options[used_menu->selected_index]);
-                                                                        break;
+                                                            case VK_DELETE:
+                                                                clear_option(used_menu, _shown_option(used_menu, used_menu->selected_index));
+                                                                break;
 #endif
-                                                                }
-                                                            goto next_event_iteration; // break from key handling
                                                         }
+                                                    break; // next event
                                                 }
-                                            break;
-                                        case MOUSE_EVENT:
+                                        }
+                                    break;
+                                case MOUSE_EVENT:
 #ifdef DEBUG
-                                            debug_mouse_pos = inputRecords[event].Event.MouseEvent.dwMousePosition;
-                                            mouse_status = inputRecords[event].Event.MouseEvent.dwButtonState & FROM_LEFT_1ST_BUTTON_PRESSED;
-                                            _draw_at_position(hCurrent, 0, 10, "MOUSE POS: %d %d    ", debug_mouse_pos.X, debug_mouse_pos.Y);
+                                    session->debug_mouse_pos = input_record.Event.MouseEvent.dwMousePosition;
+                                    session->mouse_status = input_record.Event.MouseEvent.dwButtonState & FROM_LEFT_1ST_BUTTON_PRESSED;
+                                    _draw_at_position(hCurrent, 0, 10, "MOUSE POS: %d %d    ", session->debug_mouse_pos.X, session->debug_mouse_pos.Y);
 #endif
-                                            if (mouse_event_handler(used_menu, &inputRecords[event].Event.MouseEvent,
-                                                                    y_min, y_max, x_start, x_max,
-                                                                    &last_selected_index, &something_is_selected,
-                                                                    &selected_by_mouse, &holding))
-                                                {
-                                                    can_tick = TRUE;
-                                                    goto input_handler;
-                                                }
-                                            else can_tick = FALSE;
-                                            break;
-                                        case WINDOW_BUFFER_SIZE_EVENT:
-                                            can_tick = TRUE;
-                                            current_size = inputRecords[event].Event.WindowBufferSizeEvent.dwSize;
-                                            break;
-                                    }
-                        next_event_iteration:
-                            ;
-                        }
-                    FlushConsoleInputBuffer(hStdin); // ensures that when we are swapping our menus there's not going to be events spam (idk how it works but it works)
-                }
+                                    if (session->mouse_event_handler(used_menu, &input_record.Event.MouseEvent,
+                                                            session->y_min, session->y_max, session->x_start, session->x_max,
+                                                            &session->last_selected_index, &something_is_selected,
+                                                            &session->selected_by_mouse, &holding))
+                                        {
+                                            session->can_tick = TRUE;
+                                            goto input_handler;
+                                        }
+                                    else session->can_tick = FALSE;
+                                    break;
+                                case WINDOW_BUFFER_SIZE_EVENT:
+                                    session->can_tick = TRUE;
+                                    session->current_size = input_record.Event.WindowBufferSizeEvent.dwSize;
+#ifndef _WIN32
+                                    if (posix_screen_lost && !used_menu->surface)
+                                        {
+                                            posix_screen_lost = FALSE;
+                                            _invalidate_screen(used_menu);
+                                        }
+#endif
+                                    break;
+                            }
+                    }
         }
 
-end_render_loop:; // anchor
+    if (used_menu->__open_submenu || (used_menu->running && _menu_frame(used_menu)))
+        {
+            session->stepping = FALSE; // an opened submenu has drawn its first frame already
+            return TRUE;
+        }
 
-    FlushConsoleInputBuffer(hStdin);
-    SetConsoleMode(hStdin, old_mode);
-    if (menus_amount == 0) _setConsoleActiveScreenBuffer(hConsole);
-    else _setConsoleActiveScreenBuffer(_find_first_active_menu_buffer());
+end_step:
+    _end_menu_session(used_menu);
+    return FALSE;
 }
 
-static void _update_formatted_strings(MENU menu)
+/* ----- Input Ring ----- */
+// a mouse move right behind another one replaces it, only the latest position matters
+static void _input_ring_push(const INPUT_RECORD* record)
 {
-    free(menu->formatted_header);
-    menu->formatted_header = NULL;
-    free(menu->formatted_footer);
-    menu->formatted_footer = NULL;
+    input_ring.stats.received++;
+    if (record->EventType == MOUSE_EVENT && record->Event.MouseEvent.dwEventFlags == MOUSE_MOVED && input_ring.count > 0)
+        {
+            INPUT_RECORD* last = &input_ring.records[(input_ring.head + input_ring.count - 1) & (INPUT_RING_CAPACITY - 1)];
+            if (last->EventType == MOUSE_EVENT && last->Event.MouseEvent.dwEventFlags == MOUSE_MOVED &&
+                    last->Event.MouseEvent.dwButtonState == record->Event.MouseEvent.dwButtonState)
+                {
+                    *last = *record;
+                    input_ring.stats.coalesced++;
+                    return;
+                }
+        }
 
-    // determine the inner width for text content, ensuring its not negative
-    size_t inner_width = menu->menu_size.X > 4 ? menu->menu_size.X - 4 : 0;
+    input_ring.records[(input_ring.head + input_ring.count) & (INPUT_RING_CAPACITY - 1)] = *record;
+    input_ring.count++;
+}
 
-    // determine if we are using modern VT100 rendering or legacy
-    int use_vt100 = vt100_support && (menu->menu_settings.force_legacy_mode ^ 1);
+// reads everything that is ready, only the first read waits; a full ring leaves the rest with the system
+static int _fill_input_ring(HANDLE hSource, DWORD timeout)
+{
+    INPUT_RECORD records[INPUT_READ_CHUNK];
+    DWORD numEvents, room;
+    int waitResult;
+
+    while ((room = INPUT_RING_CAPACITY - input_ring.count) > 0)
+        {
+            waitResult = _wait_input_events(hSource, records, room < INPUT_READ_CHUNK ? room : INPUT_READ_CHUNK, &numEvents, timeout);
+            if (waitResult == INPUT_EXHAUSTED && input_ring.count == 0) return INPUT_EXHAUSTED;
+            if (waitResult != TRUE) break;
+            for (DWORD i = 0; i < numEvents; i++) _input_ring_push(&records[i]);
+            timeout = 0;
+        }
+    return input_ring.count > 0;
+}
 
-    // size is menu_size.X (visual width) * 4 (max UTF-8 bytes) + color codes + null terminator
-    size_t buffer_size = menu->menu_size.X * 4 + MAX_RGB_LEN * 2;
-    menu->formatted_header = _safe_malloc(buffer_size);
-    menu->formatted_footer = _safe_malloc(buffer_size);
+// unread input belongs to the screen we are leaving, it is counted before it goes
+static void _discard_pending_input(HANDLE hSource)
+{
+    INPUT_RECORD records[INPUT_READ_CHUNK];
+    DWORD numEvents;
 
-    if (!menu->formatted_header || !menu->formatted_footer)
+    if (_as_surface(hSource)) return; // injected events are never thrown away
+    for (;;)
         {
-            free(menu->formatted_header);
-            menu->formatted_header = NULL;
-            free(menu->formatted_footer);
-            menu->formatted_footer = NULL;
-            return;
+#ifndef _WIN32
+            if (posix_input_closed) break; // stdin is gone, the escape handed back for it is made up and never runs out
+#endif
+            if (_wait_input_events(hSource, records, INPUT_READ_CHUNK, &numEvents, 0) != TRUE || numEvents == 0) break;
+            input_ring.stats.dropped += numEvents;
         }
+    _flush_input();
+}
+
+// only rebuilds what changed since the last full redraw, buffers are reused
+static void _update_formatted_strings(MENU menu)
+{
+    if (!menu->header_dirty && !menu->footer_dirty) return;
 
-    // format Header
-    size_t header_text_len = _count_utf8_chars(menu->header);
-    size_t header_pad_left = (inner_width > header_text_len) ? (inner_width - header_text_len) / 2 : 0;
-    size_t header_pad_right = (inner_width > header_text_len) ? (inner_width - header_text_len - header_pad_left) : 0;
+    // determine the inner width for text content, ensuring its not negative
+    size_t inner_width = menu->layout_width > 4 ? menu->layout_width - 4 : 0;
 
-    // format Footer
-    size_t footer_text_len = _count_utf8_chars(menu->footer);
-    size_t footer_pad_left = (inner_width > footer_text_len) ? (inner_width - footer_text_len) / 2 : 0;
-    size_t footer_pad_right = (inner_width > footer_text_len) ? (inner_width - footer_text_len - footer_pad_left) : 0;
+    // size is the drawn width * 4 (max UTF-8 bytes) + null terminator, colors live in the frame cells
+    size_t buffer_size = menu->layout_width * 4 + 1;
+    if (buffer_size > menu->formatted_capacity)
+        {
+            char* new_header = _safe_realloc(menu->formatted_header, buffer_size);
+            if (new_header) menu->formatted_header = new_header;
+            char* new_footer = _safe_realloc(menu->formatted_footer, buffer_size);
+            if (new_footer) menu->formatted_footer = new_footer;
+            if (!new_header || !new_footer) return; // keep the old strings, we try again next frame
+            menu->formatted_capacity = buffer_size;
+        }
 
-    if (use_vt100)
+    if (menu->header_dirty)
         {
-            snprintf(menu->formatted_header, buffer_size, VT100_MENU_STRING_FORMAT,
-                     menu->color_object.headerColor.__rgb_seq,
+            size_t header_pad_left = (inner_width > menu->header_len) ? (inner_width - menu->header_len) / 2 : 0;
+            size_t header_pad_right = (inner_width > menu->header_len) ? (inner_width - menu->header_len - header_pad_left) : 0;
+            snprintf(menu->formatted_header, buffer_size, MENU_STRING_FORMAT,
                      (int)header_pad_left, "", menu->header, (int)header_pad_right, "");
-            snprintf(menu->formatted_footer, buffer_size, VT100_MENU_STRING_FORMAT,
-                     menu->color_object.footerColor.__rgb_seq,
-                     (int)footer_pad_left, "", menu->footer, (int)footer_pad_right, "");
+            menu->header_dirty = FALSE;
         }
-    else
+
+    if (menu->footer_dirty)
         {
-            snprintf(menu->formatted_header, buffer_size, LEGACY_MENU_STRING_FORMAT,
-                     (int)header_pad_left, "", menu->header, (int)header_pad_right, "");
-            snprintf(menu->formatted_footer, buffer_size, LEGACY_MENU_STRING_FORMAT,
+            size_t footer_pad_left = (inner_width > menu->footer_len) ? (inner_width - menu->footer_len) / 2 : 0;
+            size_t footer_pad_right = (inner_width > menu->footer_len) ? (inner_width - menu->footer_len - footer_pad_left) : 0;
+            snprintf(menu->formatted_footer, buffer_size, MENU_STRING_FORMAT,
                      (int)footer_pad_left, "", menu->footer, (int)footer_pad_right, "");
+            menu->footer_dirty = FALSE;
         }
 }
\ No newline at end of file
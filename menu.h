@@ -7,8 +7,8 @@
 // uncomment or add a compiler flag if static lib is needed
 // #define MENULIB_STATIC
 
-#if defined(MENULIB_STATIC)
-#define MENULIB_API // if static, no dll
+#if defined(MENULIB_STATIC) || !defined(_WIN32)
+#define MENULIB_API // if static (or not on windows), no dll
 #elif defined(MENULIB_EXPORTS)
 #define MENULIB_API __declspec(dllexport) // if building the DLL, export
 #else
@@ -24,9 +24,15 @@
 #include <stdlib.h>
 #endif
 
+#ifdef _WIN32
 #ifndef _WINDOWS_H_
 #include <windows.h>
 #endif
+#else
+#ifndef _STDINT_H
+#include <stdint.h>
+#endif
+#endif
 
 #ifndef _STRING_H_
 #include <string.h>
@@ -46,6 +52,61 @@
 
 /* end */
 
+/* ============== POSIX COMPATIBILITY ============== */
+// the public types below are shared with the windows build, so on posix
+// we provide the few win32 names they rely on
+#ifndef _WIN32
+typedef unsigned short WORD;
+typedef unsigned int DWORD;
+typedef short SHORT;
+typedef int BOOL;
+typedef void* HANDLE;
+
+typedef struct _COORD
+{
+    SHORT X;
+    SHORT Y;
+} COORD;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+
+// console attribute bits (same values as wincon.h)
+#define FOREGROUND_BLUE      0x0001
+#define FOREGROUND_GREEN     0x0002
+#define FOREGROUND_RED       0x0004
+#define FOREGROUND_INTENSITY 0x0008
+#define BACKGROUND_BLUE      0x0010
+#define BACKGROUND_GREEN     0x0020
+#define BACKGROUND_RED       0x0040
+#define BACKGROUND_INTENSITY 0x0080
+
+// virtual keys and mouse flags (same values as winuser.h / wincon.h)
+#define VK_BACK   0x08
+#define VK_TAB    0x09
+#define VK_RETURN 0x0D
+#define VK_ESCAPE 0x1B
+#define VK_PRIOR  0x21
+#define VK_NEXT   0x22
+#define VK_END    0x23
+#define VK_HOME   0x24
+#define VK_LEFT   0x25
+#define VK_UP     0x26
+#define VK_RIGHT  0x27
+#define VK_DOWN   0x28
+#define VK_DELETE 0x2E
+
+#define FROM_LEFT_1ST_BUTTON_PRESSED 0x0001
+#define MOUSE_MOVED   0x0001
+#define MOUSE_WHEELED 0x0004
+#endif
+
 /* ============== CONSTANTS & MACROS ============== */
 // Color Definitions
 // text Colors (Foreground)
@@ -124,6 +185,12 @@
 #define DEFAULT_FOOTER_SETTING 0 // temp while im fixing it
 #define DEFAULT_WIDTH_SETTING 1
 #define DEFAULT_LEGACY_SETTING 0
+#define DEFAULT_FRAME_RATE_SETTING 30 // frames per second for label updates, 0 = no limit
+#define DEFAULT_GRID_SETTING 0
+#define DEFAULT_FILTER_SETTING 1
+#define DEFAULT_FUZZY_SETTING 0
+#define DEFAULT_FILTER_THREADS_SETTING 1 // a single core scans the options
+#define DEFAULT_PREFETCH_SETTING 0
 
 /* ============== LEGACY COLORS ============== */
 
@@ -182,6 +249,43 @@
 // main menu type
 struct __menu;
 
+// headless render surface (in-memory screen used instead of a console)
+typedef struct __menu_surface* MENU_SURFACE;
+typedef struct __menu_timer* MENU_TIMER;
+
+// what a menu_poll() host waits on: a file descriptor on POSIX, a waitable handle on Windows
+#ifdef _WIN32
+typedef HANDLE MENU_FD;
+#define MENU_NO_FD INVALID_HANDLE_VALUE
+#else
+typedef int MENU_FD;
+#define MENU_NO_FD (-1)
+#endif
+
+typedef struct __menu_surface_stats
+{
+    size_t bytes_written;
+    size_t write_calls;
+    size_t cursor_moves;
+    size_t clears;
+} MENU_SURFACE_STATS;
+
+typedef struct __menu_frame_stats
+{
+    size_t frames;
+    size_t last_frame_bytes;
+    size_t last_frame_writes; // console calls of the last frame, 1 (or 0 if nothing changed) with vt output
+    size_t total_bytes;
+    size_t total_writes;
+} MENU_FRAME_STATS;
+
+typedef struct __menu_input_stats
+{
+    size_t received; // records read from the console (or surface)
+    size_t coalesced; // mouse moves replaced by the move right after them
+    size_t dropped; // unread records thrown away when a callback or another screen took over
+} MENU_INPUT_STATS;
+
 // string macro
 typedef char* RGB_COLOR_SEQ;
 
@@ -198,9 +302,20 @@ typedef struct __menu_item
     COORD boundaries;
     int x_position;
     int text_len; // Visual length in characters, not bytes
+    size_t text_bytes; // byte length, cached so borrowed labels are never rescanned
     char* text;
     void (*callback)(struct __menu*, void*);
     void* data_chunk;
+    struct __menu* __arena_owner; // NULL for heap items, otherwise the menu whose arena holds the item
+    int __label_kind; // who owns text (LABEL_OWNED, LABEL_BORROWED, LABEL_INTERNED)
+    struct __menu_cell* __cells; // decoded label, unselected cells followed by selected ones, built on first draw
+    int __dirty; // relabeled, waiting in the menu's dirty list for a row repaint
+    int __async; // callback runs on the worker pool (set_option_async)
+    DWORD __async_timeout; // ms before a running async callback is abandoned, 0 = never
+    struct __menu_async_job* __job; // in-flight async callback, the row shows a busy marker meanwhile
+    unsigned int __filter_id; // slot in the menu's trigram index, ascending in option order
+    struct __menu_submenu* __submenu; // child menu filled on first expansion (set_option_submenu)
+    unsigned long long __serial; // unique for the whole run, posted commands find the item by it
 } *MENU_ITEM;
 
 // color settings
@@ -231,6 +346,12 @@ typedef struct __menu_settings
     int footer_enabled;
     int double_width_enabled;
     int force_legacy_mode;
+    int max_frame_rate; // label updates are merged into at most this many frames per second (0 = every update)
+    int grid_layout; // options are packed into as many columns as the console width allows
+    int filter_enabled; // typed characters narrow the options down to the labels containing them
+    int filter_fuzzy; // the query characters only have to appear in order, the best matches are listed first
+    int filter_threads; // threads scanning large option sets while a query is typed
+    int submenu_prefetch; // the submenu under the selection is populated on the async pool before it is opened
     MENU_COORD menu_center;
     int __garbage_collector;
 } MENU_SETTINGS;
@@ -262,9 +383,8 @@ typedef struct
 typedef struct __menu
 {
     // basic info
-    WORD count;
+    size_t count;
     MENU_ITEM* options;
-    int active_buffer;
     size_t capacity;
 
     // boolean
@@ -273,13 +393,16 @@ typedef struct __menu
     int full_redraw;
 
     // handles
-    HANDLE hBuffer[2];
-    short int selected_index;
+    HANDLE hBuffer; // screen the menu is shown on, frames are diffed on our side
+    int selected_index;
 
     // render
+    int scroll_offset; // first option shown in the viewport
+    int viewport_rows; // option rows that fit on the screen, set on every full redraw
     COORD menu_size;
     COORD current_size;
     COORD halt_size;
+    MENU_FRAME_STATS frame_stats; // kept here, the frame buffer goes back to a shared pool while the menu is hidden
 
     char* footer;
     char* header;
@@ -288,6 +411,37 @@ typedef struct __menu
 
     char* formatted_header;
     char* formatted_footer;
+    size_t formatted_capacity;
+    int header_dirty; // formatted strings are rebuilt lazily, right before a full redraw
+    int footer_dirty;
+
+    // label widths: options per width, so the widest label survives removals cheaply
+    size_t* width_histogram;
+    size_t width_histogram_len;
+    size_t max_option_width;
+
+    struct __menu_arena_chunk* arena; // items and labels made by create_menu_item_in
+
+    struct __menu_framebuffer* framebuffer; // back/front cell grids
+    struct __menu_command_queue* commands; // mutations posted from other threads
+    struct __menu_item_set* option_set; // which items are options right now, built by the first posted mutation that names one
+    struct __menu_timer_wheel* timers; // created by the first menu_add_timer()
+    struct __menu_filter* filter; // trigram index and typed query, kept while filtering is enabled
+
+    // relabeled options waiting for their row to be repainted, paced by max_frame_rate
+    struct __menu_item** dirty_options;
+    size_t dirty_count;
+    size_t dirty_capacity;
+    double last_frame; // tick() of the last flushed frame
+
+    // layout: options go row-major into layout_columns columns (1 in list mode), redone on resize or option changes
+    int layout_columns;
+    int layout_cell_width; // width of one option slot, the gap between columns not included
+    int layout_width; // drawn menu width, borders included
+    int layout_dirty;
+    SHORT layout_console_width; // console width the layout was made for
+    short* hit_columns; // x offset from the first slot -> column, DISABLED in the gaps
+    size_t hit_columns_capacity;
 
     // objects
     MENU_SETTINGS menu_settings;
@@ -298,6 +452,16 @@ typedef struct __menu
     struct __menu** next; // ** cuz MENU is * and pointer is *
     unsigned long long __ID;
     int __first_run;
+    MENU_SURFACE surface; // NULL when rendering to the console
+    struct __menu_session* session; // render loop state while the menu is shown
+    struct __menu* __parent_menu; // menu this one was opened from as a submenu, it gets the screen back on escape
+    struct __menu* __open_submenu; // submenu shown on top of this menu, it receives the input meanwhile
+    struct __menu_async_job* __populating; // prefetch filling this menu on a worker, clearing it waits for the job to come back
+    struct __menu* __older; // creation order, the oldest live menu is the one the others fall back on
+    struct __menu* __newer;
+    struct __menu* __shown_below; // started and not closed yet, the top of the stack owns the screen
+    struct __menu* __shown_above;
+    int __shown;
 } *MENU;
 
 // callback func
@@ -309,9 +473,18 @@ typedef void (*__menu_callback)(MENU, dpointer);
 /* ----- Core Functions ----- */
 
 MENULIB_API MENU create_menu();
+MENULIB_API MENU create_menu_with_capacity(size_t capacity);
 MENULIB_API MENU_ITEM create_menu_item(const char* text, __menu_callback callback, void* callback_data);
+MENULIB_API MENU_ITEM create_menu_item_in(MENU owner, const char* text, __menu_callback callback, void* callback_data);
+MENULIB_API MENU_ITEM create_menu_item_borrowed(const char* text, __menu_callback callback, void* callback_data);
+MENULIB_API MENU_ITEM create_menu_item_interned(const char* text, __menu_callback callback, void* callback_data);
+MENULIB_API const char* intern_label(const char* text);
+MENULIB_API void release_interned_labels();
 MENULIB_API void enable_menu(MENU used_menu);
 MENULIB_API void disable_menu(MENU used_menu);
+MENULIB_API int menu_poll(MENU used_menu, DWORD timeout);
+MENULIB_API MENU_FD menu_get_fd(MENU used_menu);
+MENULIB_API MENU_FD menu_get_wakeup_fd();
 MENULIB_API void clear_menu(MENU menu_to_clear);
 MENULIB_API void clear_menus();
 MENULIB_API void clear_menus_and_exit();
@@ -321,13 +494,39 @@ MENULIB_API void set_menu_settings(MENU menu, MENU_SETTINGS new_settings);
 MENULIB_API void set_color_object(MENU menu, MENU_COLOR color_object);
 MENULIB_API void change_menu_policy(MENU menu_to_change, int new_header_policy, int new_footer_policy);
 MENULIB_API void toggle_mouse(MENU menu_to_change);
+MENULIB_API void toggle_grid_layout(MENU menu_to_change);
+MENULIB_API void toggle_filter(MENU menu_to_change);
+MENULIB_API void toggle_fuzzy_filter(MENU menu_to_change);
+MENULIB_API size_t set_menu_filter(MENU used_menu, const char* query);
 MENULIB_API void change_header(MENU used_menu, const char* text);
 MENULIB_API void change_footer(MENU used_menu, const char* text);
 
 /* ----- Item Management ----- */
 MENULIB_API int add_option(MENU used_menu, const MENU_ITEM item);
+MENULIB_API int add_options(MENU used_menu, const MENU_ITEM* items, size_t amount);
 MENULIB_API void clear_menu_options(MENU menu_to_clear);
 MENULIB_API void clear_option(MENU used_menu, MENU_ITEM option_to_clear);
+MENULIB_API int update_option_text(MENU used_menu, MENU_ITEM item, const char* text);
+
+/* ----- Async Callback Functions ----- */
+MENULIB_API void set_option_async(MENU_ITEM item, int enabled, DWORD timeout);
+MENULIB_API void cancel_option_callback(MENU used_menu, MENU_ITEM item);
+MENULIB_API int menu_callback_cancelled();
+
+/* ----- Submenu Functions ----- */
+MENULIB_API int set_option_submenu(MENU_ITEM item, __menu_callback populate, void* populate_data);
+MENULIB_API MENU get_option_submenu(MENU_ITEM item);
+MENULIB_API void invalidate_submenu(MENU_ITEM item);
+
+/* ----- Timer Functions ----- */
+MENULIB_API MENU_TIMER menu_add_timer(MENU used_menu, DWORD interval, __menu_callback callback, void* callback_data);
+MENULIB_API void menu_remove_timer(MENU used_menu, MENU_TIMER timer);
+
+/* ----- Cross-thread Functions ----- */
+MENULIB_API int post_add_option(MENU used_menu, MENU_ITEM item);
+MENULIB_API int post_clear_option(MENU used_menu, MENU_ITEM option_to_clear);
+MENULIB_API int post_option_text(MENU used_menu, MENU_ITEM item, const char* text);
+MENULIB_API int post_menu_task(MENU used_menu, __menu_callback task, void* task_data);
 
 /* ----- Color Functions ----- */
 MENULIB_API MENU_RGB_COLOR mrgb(short r, short g, short b);
@@ -342,8 +541,29 @@ MENULIB_API void set_default_menu_settings(MENU_SETTINGS new_settings);
 MENULIB_API void set_default_color_object(MENU_COLOR color_object);
 MENULIB_API void set_default_legacy_color_object(LEGACY_MENU_COLOR color_object);
 
+/* ----- Headless Surface Functions ----- */
+MENULIB_API MENU_SURFACE create_headless_surface(int width, int height);
+MENULIB_API void destroy_surface(MENU_SURFACE surface);
+MENULIB_API void set_menu_surface(MENU menu, MENU_SURFACE surface);
+MENULIB_API void surface_push_key(MENU_SURFACE surface, WORD virtual_key, char ascii);
+MENULIB_API void surface_push_mouse(MENU_SURFACE surface, int x, int y, DWORD button_state, DWORD event_flags);
+MENULIB_API void surface_push_resize(MENU_SURFACE surface, int width, int height);
+MENULIB_API void surface_record_output(MENU_SURFACE surface, int enabled);
+MENULIB_API const char* surface_get_output(MENU_SURFACE surface, size_t* size);
+MENULIB_API const char* surface_get_row(MENU_SURFACE surface, int y);
+MENULIB_API unsigned int surface_get_style(MENU_SURFACE surface, int x, int y);
+MENULIB_API COORD surface_get_cursor(MENU_SURFACE surface);
+MENULIB_API COORD surface_get_size(MENU_SURFACE surface);
+MENULIB_API MENU_SURFACE_STATS surface_get_stats(MENU_SURFACE surface);
+MENULIB_API void surface_reset_stats(MENU_SURFACE surface);
+
 /* ----- Utility Functions ----- */
 MENULIB_API double tick();
+MENULIB_API size_t menu_text_width(const char* text);
+MENULIB_API MENU_FRAME_STATS get_frame_stats(MENU menu);
+MENULIB_API void reset_frame_stats(MENU menu);
+MENULIB_API MENU_INPUT_STATS get_input_stats();
+MENULIB_API void reset_input_stats();
 
 // Global struct that defines types for render units
 static MENU_RENDER_UNIT_TYPES mrut;
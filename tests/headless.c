@@ -0,0 +1,550 @@
+// regression tests on headless surfaces: viewport, timers, the command queue, menu handles, filtering, legacy
+// output, allocation failures and stdin at end of file
+//
+//   gcc -O1 -g tests/headless.c menu.c -I. -o headless_tests -pthread -Wl,--wrap=realloc
+//   ./headless_tests [name]
+//
+// prints one line per test and exits with the number of failed ones, allocation failures are injected through
+// the linker wrap (GNU ld). Most of these guard memory safety, so build them with -fsanitize=address,undefined
+// as well. Cleared menus stay allocated so their stale handles can still be checked, run that build with
+// ASAN_OPTIONS=detect_leaks=0
+#include "menu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define SURFACE_WIDTH 60
+#define SURFACE_HEIGHT 16
+#define FILTER_OPTIONS 30000 // more than one lazy scan chunk
+#define POSTING_THREADS 4
+#define POSTS_PER_THREAD 2000
+
+static int failures;
+
+#define CHECK(condition)                                                            \
+    do                                                                              \
+        {                                                                           \
+            if (!(condition))                                                       \
+                {                                                                   \
+                    printf("    %s:%d: %s\n", __FILE__, __LINE__, #condition);       \
+                    failures++;                                                     \
+                }                                                                   \
+        }                                                                           \
+    while (0)
+
+/* ----- Allocation Failures ----- */
+void* __real_realloc(void* block, size_t size);
+
+static int fail_realloc;
+
+void* __wrap_realloc(void* block, size_t size)
+{
+    if (fail_realloc) return NULL;
+    return __real_realloc(block, size);
+}
+
+/* ----- Helpers ----- */
+static MENU headless_menu(MENU_SURFACE* surface, const char* first, ...)
+{
+    MENU menu = create_menu();
+    va_list labels;
+
+    va_start(labels, first);
+    for (const char* label = first; label; label = va_arg(labels, const char*)) add_option(menu, create_menu_item(label, NULL, NULL));
+    va_end(labels);
+
+    *surface = create_headless_surface(SURFACE_WIDTH, SURFACE_HEIGHT);
+    set_menu_surface(menu, *surface);
+    return menu;
+}
+
+static void press(MENU menu, MENU_SURFACE surface, WORD key, char ascii)
+{
+    surface_push_key(surface, key, ascii);
+    menu_poll(menu, 0);
+}
+
+static void type_text(MENU menu, MENU_SURFACE surface, const char* text)
+{
+    for (; *text; text++)
+        press(menu, surface, islower((unsigned char)*text) ? (WORD)toupper((unsigned char)*text) : (WORD)(unsigned char)*text, *text);
+}
+
+// row showing the label, -1 if it is not on the screen
+static int row_of(MENU_SURFACE surface, const char* label)
+{
+    for (int y = 0; y < SURFACE_HEIGHT; y++)
+        if (strstr(surface_get_row(surface, y), label)) return y;
+    return -1;
+}
+
+// the count printed under the options while a query is typed, -1 while more matches are being looked for
+static long filter_count(MENU_SURFACE surface, const char* query)
+{
+    char prefix[64];
+    const char* at;
+    long count;
+
+    snprintf(prefix, sizeof(prefix), "/%s (", query);
+    for (int y = 0; y < SURFACE_HEIGHT; y++)
+        if ((at = strstr(surface_get_row(surface, y), prefix)) && sscanf(at + strlen(prefix), "%ld", &count) == 1)
+            return strstr(at, "+)") ? -1 : count;
+    return -2;
+}
+
+// idle steps until the typed query is matched against every option
+static long finish_filter(MENU menu, MENU_SURFACE surface, const char* query)
+{
+    long count = filter_count(surface, query);
+
+    for (int step = 0; count == -1 && step < 100000; step++)
+        {
+            menu_poll(menu, 0);
+            count = filter_count(surface, query);
+        }
+    return count;
+}
+
+static int contains_folded(const char* label, const char* query)
+{
+    for (; *label; label++)
+        {
+            size_t i = 0;
+            while (query[i] && tolower((unsigned char)label[i]) == tolower((unsigned char)query[i])) i++;
+            if (!query[i]) return 1;
+        }
+    return 0;
+}
+
+static int subsequence_folded(const char* label, const char* query)
+{
+    for (; *label && *query; label++)
+        if (tolower((unsigned char)*label) == tolower((unsigned char)*query)) query++;
+    return !*query;
+}
+
+static long brute_count(MENU menu, const char* query, int fuzzy)
+{
+    long count = 0;
+    for (size_t i = 0; i < menu->count; i++)
+        count += fuzzy ? subsequence_folded(menu->options[i]->text, query) : contains_folded(menu->options[i]->text, query);
+    return count;
+}
+
+// same sequence on every platform
+static unsigned int next_random(unsigned int* seed)
+{
+    *seed = *seed * 1103515245u + 12345u;
+    return *seed >> 16;
+}
+
+static void random_label(char* label, unsigned int* seed)
+{
+    int length = 6 + (int)(next_random(seed) % 10);
+    for (int i = 0; i < length; i++) label[i] = "abcdeABC "[next_random(seed) % 9];
+    label[length] = '\0';
+}
+
+/* ----- Tests ----- */
+// only the rows in view are drawn, End and Home scroll the viewport to the selection
+static void test_viewport()
+{
+    MENU_SURFACE surface;
+    MENU menu = headless_menu(&surface, NULL);
+    char label[32];
+
+    for (int i = 0; i < 500; i++)
+        {
+            snprintf(label, sizeof(label), "Row %03d", i);
+            add_option(menu, create_menu_item(label, NULL, NULL));
+        }
+    menu_poll(menu, 0);
+    CHECK(row_of(surface, "Row 000") >= 0);
+    CHECK(row_of(surface, "Row 499") < 0);
+    CHECK(menu->viewport_rows > 0 && menu->viewport_rows < SURFACE_HEIGHT);
+
+    press(menu, surface, VK_END, 0);
+    CHECK(menu->selected_index == 499);
+    CHECK(menu->scroll_offset + menu->viewport_rows == 500);
+    CHECK(row_of(surface, "Row 499") >= 0);
+    CHECK(row_of(surface, "Row 000") < 0);
+
+    press(menu, surface, VK_HOME, 0);
+    CHECK(menu->selected_index == 0 && menu->scroll_offset == 0);
+    CHECK(row_of(surface, "Row 000") >= 0);
+
+    // wrapping up from the first option lands on the last one
+    press(menu, surface, VK_UP, 0);
+    CHECK(menu->selected_index == 499);
+
+    clear_menu(menu);
+    destroy_surface(surface);
+}
+
+// removing an option while nothing is selected keeps it that way
+static void test_remove_without_selection()
+{
+    MENU_SURFACE surface;
+    MENU menu = headless_menu(&surface, "alpha", "beta", "gamma", NULL);
+
+    menu->selected_index = -1;
+    clear_option(menu, menu->options[0]);
+    CHECK(menu->selected_index == -1);
+    CHECK(menu->count == 2);
+
+    clear_menu(menu);
+    destroy_surface(surface);
+}
+
+// a label that cannot be tracked is refused and leaves the menu as it was
+static void test_width_histogram_failure()
+{
+    MENU menu = create_menu();
+    char wide[300];
+    MENU_ITEM item, batch[2];
+
+    add_option(menu, create_menu_item("a", NULL, NULL));
+    memset(wide, 'w', sizeof(wide) - 1);
+    wide[sizeof(wide) - 1] = '\0';
+    item = create_menu_item(wide, NULL, NULL);
+    batch[0] = create_menu_item("b", NULL, NULL);
+    batch[1] = item;
+
+    fail_realloc = 1;
+    CHECK(add_option(menu, item) != 0);
+    CHECK(add_options(menu, batch, 2) != 0);
+    fail_realloc = 0;
+    CHECK(menu->count == 1);
+
+    CHECK(add_options(menu, batch, 2) == 0);
+    CHECK(menu->count == 3);
+
+    clear_menu(menu);
+}
+
+static int timer_fired;
+
+static void close_from_timer(MENU menu, void* data)
+{
+    (void)data;
+    timer_fired++;
+    disable_menu(menu);
+}
+
+// a timer whose callback closes its menu fires again every time the menu is shown
+static void test_timer_rearms_after_disable()
+{
+    MENU_SURFACE surface;
+    MENU menu = headless_menu(&surface, "a", NULL);
+    double start;
+
+    menu_add_timer(menu, 5, close_from_timer, NULL);
+    for (int show = 1; show <= 3; show++)
+        {
+            start = tick();
+            while (menu_poll(menu, 5) && tick() - start < 2.0);
+            CHECK(timer_fired == show);
+        }
+
+    clear_menu(menu);
+    destroy_surface(surface);
+}
+
+static MENU posting_menu;
+
+#ifdef _WIN32
+static DWORD WINAPI post_options(void* argument)
+#else
+static void* post_options(void* argument)
+#endif
+{
+    (void)argument;
+
+    for (int i = 0; i < POSTS_PER_THREAD; i++)
+        {
+            MENU_ITEM item = create_menu_item("posted", NULL, NULL);
+            if (!post_add_option(posting_menu, item)) continue;
+
+            // refused, the item is still ours
+            free(item->text);
+            free(item);
+        }
+    return 0;
+}
+
+// the producers are started, then clear (if set) runs while they post
+static void run_posting_threads(MENU clear)
+{
+#ifdef _WIN32
+    HANDLE threads[POSTING_THREADS];
+    for (int i = 0; i < POSTING_THREADS; i++) threads[i] = CreateThread(NULL, 0, post_options, NULL, 0, NULL);
+    if (clear) clear_menu(clear);
+    WaitForMultipleObjects(POSTING_THREADS, threads, TRUE, INFINITE);
+    for (int i = 0; i < POSTING_THREADS; i++) CloseHandle(threads[i]);
+#else
+    pthread_t threads[POSTING_THREADS];
+    for (int i = 0; i < POSTING_THREADS; i++) pthread_create(&threads[i], NULL, post_options, NULL);
+    if (clear) clear_menu(clear);
+    for (int i = 0; i < POSTING_THREADS; i++) pthread_join(threads[i], NULL);
+#endif
+}
+
+// every option posted from other threads is added once, posting to a cleared menu is refused
+static void test_command_queue()
+{
+    MENU_SURFACE surface;
+    MENU menu = headless_menu(&surface, "first", NULL);
+    MENU_ITEM late = create_menu_item("late", NULL, NULL);
+
+    posting_menu = menu;
+    menu_poll(menu, 0);
+    run_posting_threads(NULL);
+    menu_poll(menu, 0);
+    CHECK(menu->count == 1 + POSTING_THREADS * POSTS_PER_THREAD);
+
+    // producers racing the clear must not write into a freed queue
+    for (int round = 0; round < 20; round++)
+        {
+            posting_menu = create_menu();
+            add_option(posting_menu, create_menu_item("x", NULL, NULL));
+            run_posting_threads(posting_menu);
+            CHECK(post_add_option(posting_menu, late) != 0);
+        }
+    free(late->text);
+    free(late);
+
+    clear_menu(menu);
+    destroy_surface(surface);
+}
+
+// a command posted for an option that is gone never reaches whatever took its place
+static void test_posted_command_outlives_option()
+{
+    MENU_SURFACE surface;
+    MENU menu = headless_menu(&surface, "a", "keep", NULL);
+    MENU_ITEM gone = menu->options[0], replacement;
+
+    menu_poll(menu, 0);
+    CHECK(post_option_text(menu, gone, "stale") == 0);
+    CHECK(post_clear_option(menu, gone) == 0);
+    clear_option(menu, gone);
+
+    // the allocator usually hands the same block out again
+    replacement = create_menu_item("b", NULL, NULL);
+    add_option(menu, replacement);
+    menu_poll(menu, 0);
+    CHECK(menu->count == 2);
+    CHECK(menu->options[1] == replacement);
+    CHECK(!strcmp(replacement->text, "b"));
+
+    clear_menu(menu);
+    destroy_surface(surface);
+}
+
+// a cleared menu's handle stays stale after its slot is reused
+static void test_stale_menu_handle()
+{
+    MENU cleared = create_menu(), reused;
+    MENU_ITEM item = create_menu_item("posted", NULL, NULL);
+
+    add_option(cleared, create_menu_item("a", NULL, NULL));
+    clear_menu(cleared);
+    reused = create_menu();
+    add_option(reused, create_menu_item("b", NULL, NULL));
+
+    clear_menu(cleared);
+    CHECK(!menu_poll(cleared, 0));
+    CHECK(post_add_option(cleared, item) != 0);
+    CHECK(reused->count == 1 && !strcmp(reused->options[0]->text, "b"));
+    CHECK(post_add_option(reused, item) == 0);
+
+    clear_menu(reused);
+}
+
+// typed queries end up with exactly the labels containing them, however options change meanwhile
+static void test_filter_levels()
+{
+    static const char* queries[] = {"a", "ab", "abc", "b c", "cab", "e"};
+    MENU_SURFACE surface;
+    MENU menu = headless_menu(&surface, NULL);
+    unsigned int seed = 7;
+    char label[32];
+
+    for (int i = 0; i < FILTER_OPTIONS; i++)
+        {
+            random_label(label, &seed);
+            add_option(menu, create_menu_item(label, NULL, NULL));
+        }
+    menu_poll(menu, 0);
+
+    for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); q++)
+        {
+            // the first character leaves most of the list unmatched, the changes land in both parts
+            type_text(menu, surface, (char[]){queries[q][0], '\0'});
+            for (int i = 0; i < 50; i++)
+                {
+                    random_label(label, &seed);
+                    add_option(menu, create_menu_item(label, NULL, NULL));
+                    clear_option(menu, menu->options[next_random(&seed) % menu->count]);
+                    random_label(label, &seed);
+                    update_option_text(menu, menu->options[next_random(&seed) % menu->count], label);
+                }
+            type_text(menu, surface, queries[q] + 1);
+            CHECK(finish_filter(menu, surface, queries[q]) == brute_count(menu, queries[q], 0));
+
+            // Backspace goes back to the shorter query
+            if (queries[q][1])
+                {
+                    char shorter[16];
+                    snprintf(shorter, sizeof(shorter), "%.*s", (int)strlen(queries[q]) - 1, queries[q]);
+                    press(menu, surface, VK_BACK, '\b');
+                    CHECK(finish_filter(menu, surface, shorter) == brute_count(menu, shorter, 0));
+                }
+            press(menu, surface, VK_ESCAPE, 0);
+            CHECK(filter_count(surface, queries[q]) == -2);
+
+            CHECK(set_menu_filter(menu, queries[q]) == (size_t)brute_count(menu, queries[q], 0));
+            set_menu_filter(menu, NULL);
+        }
+
+    // the index starts over with the options
+    clear_menu_options(menu);
+    add_option(menu, create_menu_item("cabbage", NULL, NULL));
+    add_option(menu, create_menu_item("abacus", NULL, NULL));
+    CHECK(set_menu_filter(menu, "ab") == 2);
+    CHECK(set_menu_filter(menu, "cab") == 1);
+
+    clear_menu(menu);
+    destroy_surface(surface);
+}
+
+// fuzzy queries keep the labels holding them in order, the best match comes first
+static void test_fuzzy_ranking()
+{
+    MENU_SURFACE surface;
+    MENU menu = headless_menu(&surface, NULL);
+    unsigned int seed = 11;
+    char label[32];
+
+    for (int i = 0; i < FILTER_OPTIONS; i++)
+        {
+            random_label(label, &seed);
+            if (strstr(label, "abc") || strstr(label, "ABC")) label[0] = 'x';
+            add_option(menu, create_menu_item(label, NULL, NULL));
+        }
+    add_option(menu, create_menu_item("abc", NULL, NULL));
+    toggle_fuzzy_filter(menu);
+    menu_poll(menu, 0);
+
+    CHECK(set_menu_filter(menu, "abc") == (size_t)brute_count(menu, "abc", 1));
+    set_menu_filter(menu, NULL);
+
+    type_text(menu, surface, "abc");
+    CHECK(filter_count(surface, "abc") == brute_count(menu, "abc", 1));
+    CHECK(menu->selected_index == 0);
+    CHECK(row_of(surface, "abc ") >= 0 && row_of(surface, "abc ") < row_of(surface, "/abc ("));
+    press(menu, surface, VK_BACK, '\b');
+    CHECK(filter_count(surface, "ab") == brute_count(menu, "ab", 1));
+
+    clear_menu(menu);
+    destroy_surface(surface);
+}
+
+// legacy consoles get runs of cells with combining marks copied into a fixed chunk
+static void test_legacy_combining_marks()
+{
+    MENU menu = create_menu();
+    MENU_SURFACE surface = create_headless_surface(400, 8);
+    MENU_SETTINGS settings = create_new_settings();
+    char label[2048] = "";
+
+    for (int i = 0; i < 300; i++) strcat(label, "e\xcc\x81\xcc\xa3"); // e with an acute accent and a dot below
+    add_option(menu, create_menu_item(label, NULL, NULL));
+    settings.force_legacy_mode = TRUE;
+    set_menu_settings(menu, settings);
+    set_menu_surface(menu, surface);
+    menu_poll(menu, 0);
+
+    CHECK(row_of(surface, "e\xcc\x81") >= 0);
+
+    clear_menu(menu);
+    destroy_surface(surface);
+}
+
+// stdin at end of file closes the menu instead of spinning on made-up input
+static void test_input_eof()
+{
+#ifndef _WIN32
+    int saved_in = dup(STDIN_FILENO), saved_out = dup(STDOUT_FILENO);
+    int null_in = open("/dev/null", O_RDONLY), null_out = open("/dev/null", O_WRONLY);
+    MENU menu = create_menu();
+    int shown, stepped;
+
+    fflush(stdout);
+    dup2(null_in, STDIN_FILENO);
+    dup2(null_out, STDOUT_FILENO);
+    alarm(10); // a hang kills the run
+
+    add_option(menu, create_menu_item("a", NULL, NULL));
+    shown = menu_poll(menu, 0);
+    stepped = menu_poll(menu, 0);
+    clear_menu(menu);
+
+    alarm(0);
+    dup2(saved_in, STDIN_FILENO);
+    dup2(saved_out, STDOUT_FILENO);
+    close(saved_in);
+    close(saved_out);
+    close(null_in);
+    close(null_out);
+
+    CHECK(shown);
+    CHECK(!stepped && !menu_poll(menu, 0));
+#endif
+}
+
+static const struct
+{
+    const char* name;
+    void (*run)();
+} tests[] = {
+    {"viewport", test_viewport},
+    {"remove_without_selection", test_remove_without_selection},
+    {"width_histogram_failure", test_width_histogram_failure},
+    {"timer_rearms_after_disable", test_timer_rearms_after_disable},
+    {"command_queue", test_command_queue},
+    {"posted_command_outlives_option", test_posted_command_outlives_option},
+    {"stale_menu_handle", test_stale_menu_handle},
+    {"filter_levels", test_filter_levels},
+    {"fuzzy_ranking", test_fuzzy_ranking},
+    {"legacy_combining_marks", test_legacy_combining_marks},
+    {"input_eof", test_input_eof},
+};
+
+int main(int argc, char** argv)
+{
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+        {
+            if (argc > 1 && strcmp(argv[1], tests[i].name)) continue;
+            int before = failures;
+            tests[i].run();
+            printf("test=%s result=%s\n", tests[i].name, failures == before ? "ok" : "FAIL");
+            fflush(stdout); // a test that hangs or crashes still leaves the ones before it
+            failed += failures != before;
+        }
+
+    clear_menus();
+    return failed;
+}